@@ -0,0 +1,131 @@
+/*
+    chars_benchmark.cpp
+
+    Numbers to characters and back: the ostringstream that to_string() used
+    to make for every number, and the >> that reads the temperatures in
+    vector.cpp, against Chars_buffer and chars_to() from std_lib_facilities.h.
+    Prints nanoseconds per number, and checks that both ways give the same
+    characters and the same numbers.
+
+    Chars_buffer and chars_to() use to_chars() and from_chars() in C++17 and
+    snprintf() and strtod() before; build it both ways:
+        g++ -O2 -std=c++17 -o chars_benchmark chars_benchmark.cpp
+        g++ -O2 -std=c++11 -o chars_benchmark chars_benchmark.cpp
+*/
+
+#include <chrono>
+#include <functional> // before std_lib_facilities.h, which #defines vector
+#include "std_lib_facilities.h"
+
+//------------------------------------------------------------------------------
+// run f until at least min_time has passed; return seconds per run
+double seconds_per_run(function<void()> f)
+{
+    const double min_time = 0.2;
+    int runs = 0;
+    auto start = chrono::steady_clock::now();
+    chrono::duration<double> t;
+    do
+    {
+        f();
+        ++runs;
+        t = chrono::steady_clock::now() - start;
+    } while (t.count() < min_time);
+    return t.count() / runs;
+}
+
+//------------------------------------------------------------------------------
+template<class T> string stream_to_string(const T& t) // to_string() as it was
+{
+    ostringstream os;
+    os << t;
+    return os.str();
+}
+
+//------------------------------------------------------------------------------
+int main()
+{
+#ifdef PPP_CHARCONV
+    cout << "Chars_buffer and chars_to(): to_chars() and from_chars()\n\n";
+#else
+    cout << "Chars_buffer and chars_to(): snprintf() and strtod()\n\n";
+#endif
+    const int n = 100000;
+    vector<double> temps(n); // "temperatures" as vector.cpp reads them
+    vector<long> counts(n);
+    for (int i = 0; i < n; ++i)
+    {
+        temps[i] = randint(-500000, 500000) / 1000.0;
+        counts[i] = randint(0, 1 << 30) * long(randint(1, 1000));
+    }
+
+    // the same characters both ways?
+    string expected;
+    string text;
+    Chars_buffer b;
+    for (int i = 0; i < n; ++i)
+    {
+        expected += stream_to_string(temps[i]) + ' ';
+        text += b.format(temps[i]);
+        text += ' ';
+        if (stream_to_string(counts[i]) != b.format(counts[i]))
+            error("the integers differ at ", i);
+    }
+    if (text != expected)
+        error("the doubles differ");
+
+    cout << setw(24) << "ns per number" << setw(14) << "ostringstream" << setw(14) << "Chars_buffer" << '\n';
+    size_t total = 0; // so the work isn't optimized away
+    double old_way = seconds_per_run([&] {
+        for (double x : temps)
+            total += stream_to_string(x).size();
+    });
+    double new_way = seconds_per_run([&] {
+        for (double x : temps)
+        {
+            b.format(x);
+            total += b.size();
+        }
+    });
+    cout << setw(24) << "format double" << setw(14) << old_way / n * 1e9 << setw(14) << new_way / n * 1e9 << '\n';
+    old_way = seconds_per_run([&] {
+        for (long x : counts)
+            total += stream_to_string(x).size();
+    });
+    new_way = seconds_per_run([&] {
+        for (long x : counts)
+        {
+            b.format(x);
+            total += b.size();
+        }
+    });
+    cout << setw(24) << "format long" << setw(14) << old_way / n * 1e9 << setw(14) << new_way / n * 1e9 << '\n';
+
+    cout << '\n' << setw(24) << "ns per number" << setw(14) << ">>" << setw(14) << "chars_to()" << '\n';
+    vector<double> read_back(n);
+    old_way = seconds_per_run([&] {
+        istringstream is(text);
+        int i = 0;
+        for (double temp; is >> temp;)
+            read_back[i++] = temp;
+    });
+    vector<double> read_back2(n);
+    new_way = seconds_per_run([&] {
+        const char* p = text.data();
+        const char* end = p + text.size();
+        for (int i = 0; p < end; ++i)
+        {
+            const char* space = p;
+            while (*space != ' ')
+                ++space;
+            if (!chars_to(p, space, read_back2[i]))
+                error("not a number at ", i);
+            p = space + 1;
+        }
+    });
+    if (read_back != read_back2)
+        error("the numbers read differ");
+    cout << setw(24) << "parse double" << setw(14) << old_way / n * 1e9 << setw(14) << new_way / n * 1e9 << '\n';
+
+    cout << "\nsame characters and numbers both ways (" << total << " characters formatted)\n";
+}
@@ -0,0 +1,144 @@
+/*
+    subscript_benchmark.cpp
+
+    What a range check on every v[i] costs in a hot loop, with the choice of
+    checking std_lib_facilities.h offers (PPP_SUBSCRIPT_CHECK). Each loop
+    runs over a Vector with checked subscripts (as chosen when building),
+    over a checked_span() of it (checked once, before the loop), and over a
+    std::vector (never checked), and prints elements per nanosecond.
+
+    A loop whose subscripts may throw can't be vectorized: the compiler must
+    stop at exactly the element that is out of range. Where the loop's own
+    condition proves the check (i<v.size() for v[i], as in the sum) the
+    compiler drops it, but the checked x[i] of axpy, which runs to y.size(),
+    stays in, and that loop is done an element at a time. Build it the three
+    ways and compare, and ask the compiler which loops it vectorized:
+        g++ -O3 -std=c++17 -o subscript_benchmark subscript_benchmark.cpp
+        g++ -O3 -std=c++17 -DPPP_SUBSCRIPT_CHECK=1 -DNDEBUG -o subscript_benchmark subscript_benchmark.cpp
+        g++ -O3 -std=c++17 -DPPP_SUBSCRIPT_CHECK=0 -o subscript_benchmark subscript_benchmark.cpp
+        g++ -O3 -std=c++17 -fopt-info-vec-optimized -c subscript_benchmark.cpp
+    (The sum of doubles in vector.cpp isn't vectorized however it is
+    subscripted, unless -ffast-math lets the compiler reorder the additions;
+    so the sums here are of integers.)
+*/
+
+#include <chrono>
+#include <functional> // before std_lib_facilities.h, which #defines vector
+#include <vector>
+
+template<class T> using Std_vector = std::vector<T>; // the unchecked one, by a name the #define leaves alone
+
+#include "std_lib_facilities.h"
+
+//------------------------------------------------------------------------------
+// run f until at least min_time has passed; return seconds per run
+double seconds_per_run(function<void()> f)
+{
+    const double min_time = 0.2;
+    int runs = 0;
+    auto start = chrono::steady_clock::now();
+    chrono::duration<double> t;
+    do
+    {
+        f();
+        ++runs;
+        t = chrono::steady_clock::now() - start;
+    } while (t.count() < min_time);
+    return t.count() / runs;
+}
+
+//------------------------------------------------------------------------------
+// the loops: a sum, and y = a*x+y
+
+long sum_checked(const Vector<int> &v)
+{
+    long sum = 0;
+    for (int i = 0; size_t(i) < v.size(); ++i)
+        sum += v[i];
+    return sum;
+}
+
+long sum_span(const Vector<int> &v)
+{
+    Checked_span<const int> s = checked_span(v);
+    long sum = 0;
+    for (size_t i = 0; i < s.size(); ++i)
+        sum += s[i];
+    return sum;
+}
+
+long sum_raw(const Std_vector<int> &v)
+{
+    long sum = 0;
+    for (size_t i = 0; i < v.size(); ++i)
+        sum += v[i];
+    return sum;
+}
+
+void axpy_checked(double a, const Vector<double> &x, Vector<double> &y)
+{
+    for (int i = 0; size_t(i) < y.size(); ++i)
+        y[i] += a * x[i];
+}
+
+void axpy_span(double a, const Vector<double> &x, Vector<double> &y)
+{
+    Checked_span<const double> xs = checked_span(x, 0, y.size()); // x at least as long as y
+    Checked_span<double> ys = checked_span(y);
+    for (size_t i = 0; i < ys.size(); ++i)
+        ys[i] += a * xs[i];
+}
+
+void axpy_raw(double a, const Std_vector<double> &x, Std_vector<double> &y)
+{
+    for (size_t i = 0; i < y.size(); ++i)
+        y[i] += a * x[i];
+}
+
+//------------------------------------------------------------------------------
+int main()
+{
+    cout << "Vector subscripts: "
+         << (PPP_CHECKED_SUBSCRIPTS ? "checked" : "not checked")
+         << " (PPP_SUBSCRIPT_CHECK=" << PPP_SUBSCRIPT_CHECK << ")\n\n";
+    cout << setw(9) << "n" << setw(12) << "loop" << setw(10) << "checked"
+         << setw(10) << "span" << setw(10) << "raw" << "   elements/ns\n";
+    for (int n : {1000, 100000, 10000000})
+    {
+        Vector<int> vi(n);
+        Vector<double> x(n), y(n);
+        for (int i = 0; i < n; ++i)
+        {
+            vi[i] = randint(-1000, 1000);
+            x[i] = vi[i] / 1000.0;
+        }
+        Std_vector<int> raw_vi(vi.begin(), vi.end());
+        Std_vector<double> raw_x(x.begin(), x.end()), raw_y(n);
+
+        long s1 = 0, s2 = 0, s3 = 0;
+        double checked = seconds_per_run([&] { s1 = sum_checked(vi); });
+        double span = seconds_per_run([&] { s2 = sum_span(vi); });
+        double raw = seconds_per_run([&] { s3 = sum_raw(raw_vi); });
+        if (s1 != s2 || s1 != s3)
+            error("the sums differ");
+        cout << setw(9) << n << setw(12) << "sum" << setw(10) << n / checked / 1e9
+             << setw(10) << n / span / 1e9 << setw(10) << n / raw / 1e9 << '\n';
+
+        checked = seconds_per_run([&] { axpy_checked(0.5, x, y); });
+        span = seconds_per_run([&] { axpy_span(0.5, x, y); });
+        raw = seconds_per_run([&] { axpy_raw(0.5, raw_x, raw_y); });
+        cout << setw(9) << n << setw(12) << "axpy" << setw(10) << n / checked / 1e9
+             << setw(10) << n / span / 1e9 << setw(10) << n / raw / 1e9 << '\n';
+    }
+
+    Vector<int> v(10);
+    try
+    {
+        checked_span(v, 5, 6); // one too many: caught before any loop starts
+        error("checked_span() missed a bad range");
+    }
+    catch (Range_error &e)
+    {
+        cout << "\nchecked_span(v, 5, 6): " << e.what() << '\n';
+    }
+}
@@ -1,4 +1,5 @@
-#include "std_lib_facilities.h"
+#include "../std_lib_facilities/std_lib_vector.h" // the parts of std_lib_facilities.h this program uses
+#include "../std_lib_facilities/std_lib_algorithms.h"
 
 // simple dictionary: list of sorted words
 int main()
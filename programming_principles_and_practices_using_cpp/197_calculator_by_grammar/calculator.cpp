@@ -46,7 +46,7 @@
         Input comes from cin through the Token_stream called ts.
 */
 
-#include "std_lib_facilities.h"
+#include "../std_lib_facilities/std_lib_core.h" // the part of std_lib_facilities.h this program uses
 
 //------------------------------------------------------------------------------
 // variables and names
@@ -0,0 +1,249 @@
+/*
+    autodiff.h
+
+    The gradient of an expression, exact and in one evaluation, instead of
+    one extra evaluation per variable for finite differences
+    (calculator --gradient). run() is a template on the type of its values;
+    it is instantiated for two more types:
+
+    Dual, for forward mode: a value with its partial derivatives with
+    respect to the chosen variables. Each operation computes the
+    derivatives of its result along with the value, so the cost grows with
+    the number of variables (at most max_duals of them).
+
+    Adjoint, for reverse mode: a value with its node on a Tape, which
+    records every operation and the partial derivatives of its result with
+    respect to its operands. One sweep backwards over the tape then gives
+    the derivatives with respect to all the variables at once, so the cost
+    doesn't depend on how many there are; the tape takes memory instead.
+
+    Comparisons, if, %, and user-defined functions work as usual: the
+    derivative is that of the branch taken (0 for %). Memo functions don't
+    remember results of derivatives. integrate(), solve() and matrices
+    can't be differentiated.
+*/
+
+#ifndef AUTODIFF_H
+#define AUTODIFF_H
+
+#include <string>
+#include "compiled_expression.h"
+#include "std_lib_facilities.h" // after the standard headers: it #defines vector
+
+//------------------------------------------------------------------------------
+const int max_duals = 16; // variables in forward mode; a Dual is on run()'s stack max_stack times
+
+class Dual
+{
+public:
+    double value;
+    double d[max_duals]; // d[i]: the partial derivative with respect to variable i; only width are used
+
+    Dual(double v = 0) : value(v)
+    {
+        for (int i = 0; i < width; ++i)
+            d[i] = 0;
+    }
+
+    static inline thread_local int width = 0; // the number of variables
+};
+
+inline Dual operator+(const Dual &a, const Dual &b)
+{
+    Dual r = a;
+    r.value += b.value;
+    for (int i = 0; i < Dual::width; ++i)
+        r.d[i] += b.d[i];
+    return r;
+}
+
+inline Dual operator-(const Dual &a, const Dual &b)
+{
+    Dual r = a;
+    r.value -= b.value;
+    for (int i = 0; i < Dual::width; ++i)
+        r.d[i] -= b.d[i];
+    return r;
+}
+
+inline Dual operator-(const Dual &a)
+{
+    Dual r = a;
+    r.value = -r.value;
+    for (int i = 0; i < Dual::width; ++i)
+        r.d[i] = -r.d[i];
+    return r;
+}
+
+inline Dual operator*(const Dual &a, const Dual &b)
+{
+    Dual r = a;
+    r.value = a.value * b.value;
+    for (int i = 0; i < Dual::width; ++i)
+        r.d[i] = a.d[i] * b.value + a.value * b.d[i];
+    return r;
+}
+
+inline Dual operator/(const Dual &a, const Dual &b)
+{
+    Dual r = a;
+    r.value = a.value / b.value;
+    for (int i = 0; i < Dual::width; ++i)
+        r.d[i] = (a.d[i] - r.value * b.d[i]) / b.value;
+    return r;
+}
+
+//------------------------------------------------------------------------------
+// the operations of one reverse-mode evaluation, in order
+class Tape
+{
+public:
+    class Node // an operation's result: operands a and b (-1 for none) and its derivatives by them
+    {
+    public:
+        int a, b;
+        double da, db;
+    };
+    vector<Node> nodes;
+
+    int variable(); // a new node for an independent variable
+    vector<double> adjoints(int output) const; // d output / d node for every node
+
+    static inline thread_local Tape *current = nullptr; // where this thread's operations go
+};
+
+//------------------------------------------------------------------------------
+inline int Tape::variable()
+{
+    nodes.push_back(Node{-1, -1, 0, 0});
+    return nodes.size() - 1;
+}
+
+//------------------------------------------------------------------------------
+inline vector<double> Tape::adjoints(int output) const
+{
+    vector<double> adjoint(nodes.size());
+    adjoint[output] = 1;
+    for (int i = output; 0 <= i; --i) // operands are always older than their results
+    {
+        const Node &n = nodes[i];
+        if (0 <= n.a)
+            adjoint[n.a] += adjoint[i] * n.da;
+        if (0 <= n.b)
+            adjoint[n.b] += adjoint[i] * n.db;
+    }
+    return adjoint;
+}
+
+//------------------------------------------------------------------------------
+class Adjoint // a value and its node on Tape::current; node -1 for a constant
+{
+public:
+    double value;
+    int node;
+    Adjoint(double v = 0, int n = -1) : value(v), node(n) {}
+};
+
+// the result value of an operation on a and b with derivatives da and db
+inline Adjoint record(double value, const Adjoint &a, double da, const Adjoint &b, double db)
+{
+    if (a.node < 0 && b.node < 0) // constants stay off the tape
+        return Adjoint(value);
+    Tape &t = *Tape::current;
+    t.nodes.push_back(Tape::Node{a.node, b.node, da, db});
+    return Adjoint(value, t.nodes.size() - 1);
+}
+
+inline Adjoint operator+(const Adjoint &a, const Adjoint &b) { return record(a.value + b.value, a, 1, b, 1); }
+inline Adjoint operator-(const Adjoint &a, const Adjoint &b) { return record(a.value - b.value, a, 1, b, -1); }
+inline Adjoint operator-(const Adjoint &a) { return record(-a.value, a, -1, Adjoint(), 0); }
+inline Adjoint operator*(const Adjoint &a, const Adjoint &b) { return record(a.value * b.value, a, b.value, b, a.value); }
+
+inline Adjoint operator/(const Adjoint &a, const Adjoint &b)
+{
+    double q = a.value / b.value;
+    return record(q, a, 1 / b.value, b, -q / b.value);
+}
+
+//------------------------------------------------------------------------------
+// what run() needs of its value type, for Dual and Adjoint
+inline double scalar(const Dual &d) { return d.value; }
+inline double scalar(const Adjoint &a) { return a.value; }
+inline void charge_product(const Dual &, const Dual &) {}
+inline void charge_product(const Adjoint &, const Adjoint &) {}
+inline bool memo_key(string &, int, const Dual *, int) { return false; } // derivatives aren't remembered
+inline bool memo_key(string &, int, const Adjoint *, int) { return false; }
+inline bool is_number(const Dual &) { return true; }
+inline bool is_number(const Adjoint &) { return true; }
+
+inline vector<double> scalar_slots(const Code_view &, const Call_site &, const Dual *)
+{
+    error("integrate() and solve() can't be differentiated");
+}
+
+inline vector<double> scalar_slots(const Code_view &, const Call_site &, const Adjoint *)
+{
+    error("integrate() and solve() can't be differentiated");
+}
+
+//------------------------------------------------------------------------------
+class Gradient
+{
+public:
+    double value;
+    vector<double> partials; // one for each variable asked for
+    long tape_nodes = 0;     // reverse mode: the memory it took
+};
+
+//------------------------------------------------------------------------------
+// the value of code for slot values values, and its derivatives with respect
+// to the slots wrt, computed with Duals
+inline Gradient forward_gradient(const Code &code, const vector<double> &values, const vector<int> &wrt)
+{
+    if (code.uses_matrices)
+        error("matrices can't be differentiated");
+    if (max_duals < wrt.size())
+        error("forward mode differentiates with respect to at most ", max_duals);
+    Dual::width = wrt.size();
+    vector<Dual> slots(values.begin(), values.end());
+    for (int k = 0; k < int(wrt.size()); ++k)
+        slots[wrt[k]].d[k] = 1;
+    Dual r = run(code, 0, slots.data());
+    return Gradient{r.value, vector<double>(r.d, r.d + wrt.size())};
+}
+
+//------------------------------------------------------------------------------
+// like forward_gradient(), but with a Tape
+inline Gradient reverse_gradient(const Code &code, const vector<double> &values, const vector<int> &wrt)
+{
+    if (code.uses_matrices)
+        error("matrices can't be differentiated");
+    Tape tape;
+    Tape *previous = Tape::current;
+    Tape::current = &tape;
+    vector<Adjoint> slots(values.begin(), values.end());
+    for (int slot : wrt)
+        slots[slot].node = tape.variable();
+    Adjoint r;
+    try
+    {
+        r = run(code, 0, slots.data());
+    }
+    catch (...)
+    {
+        Tape::current = previous;
+        throw;
+    }
+    Tape::current = previous;
+
+    Gradient g{r.value, vector<double>(wrt.size()), long(tape.nodes.size())};
+    if (0 <= r.node) // else the value doesn't depend on any variable
+    {
+        vector<double> adjoint = tape.adjoints(r.node);
+        for (int k = 0; k < int(wrt.size()); ++k)
+            g.partials[k] = adjoint[slots[wrt[k]].node];
+    }
+    return g;
+}
+
+#endif // AUTODIFF_H
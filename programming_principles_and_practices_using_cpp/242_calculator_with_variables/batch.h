@@ -0,0 +1,198 @@
+/*
+    batch.h
+
+    One expression evaluated at many points, a batch of points at a time:
+    each instruction is run for all the points of the batch before the next
+    one, in loops over contiguous arrays that the compiler turns into SIMD
+    instructions. So the cost of interpreting an instruction is shared by
+    width points, and the arithmetic uses every lane of a vector register.
+
+    Batch_evaluator<float> is the reduced-precision mode (calculator --sweep
+    ... --float): a register holds twice as many floats as doubles, so a
+    batch (a row of the same number of bytes) has twice as many points, and
+    each instruction is interpreted once for all of them. Every step is
+    rounded to float, so the results differ from those of run(), which
+    computes in double; calculator --compare-float measures by how much for
+    a corpus of expressions.
+
+    Only straight-line arithmetic is run in batches. An expression using
+    integrate(), solve(), if, a user-defined function, or matrices is run
+    point by point, in double (see can_run()).
+*/
+
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include "compiled_expression.h"
+#include "std_lib_facilities.h" // after the standard headers: it #defines vector
+
+//------------------------------------------------------------------------------
+// evaluates code at up to width points at a time, computing in F (float or double)
+template <class F>
+class Batch_evaluator
+{
+public:
+    static constexpr int width = 512 / sizeof(F); // points per batch: rows of 512 bytes, a multiple of any SIMD width
+
+    explicit Batch_evaluator(const Code &c);
+    static bool can_run(const Code &code); // only arithmetic on numbers?
+
+    // out[p] = the value at point p (p < n <= width), where the value of slot s
+    // is columns[s][p]; NaN where it can't be evaluated (e.g. divide by zero).
+    // out has room for width values; those past n are garbage. Returns the
+    // number of points that can't be evaluated
+    long run(const F *const *columns, int n, F *out);
+
+private:
+    const Code &code;
+    vector<F> stack;  // code.max_depth rows of width values
+    vector<F> failed; // for each point, 1 if it can't be evaluated: an F, so that its loops vectorize with the rest
+};
+
+//------------------------------------------------------------------------------
+template <class F>
+bool Batch_evaluator<F>::can_run(const Code &code)
+{
+    if (code.uses_matrices)
+        return false;
+    for (const Instruction &in : code.instructions)
+        switch (in.op)
+        {
+        case Opcode::constant:
+        case Opcode::load:
+        case Opcode::add:
+        case Opcode::subtract:
+        case Opcode::multiply:
+        case Opcode::divide:
+        case Opcode::modulo:
+        case Opcode::negate:
+        case Opcode::end:
+            break;
+        default:
+            return false;
+        }
+    return true;
+}
+
+//------------------------------------------------------------------------------
+template <class F>
+Batch_evaluator<F>::Batch_evaluator(const Code &c)
+    : code(c), stack(max(c.max_depth, 1) * width), failed(width)
+{
+    if (!can_run(code))
+        error("batch evaluation needs an expression of plain arithmetic");
+}
+
+//------------------------------------------------------------------------------
+// a[i] = op(a[i], b[i]) for a row of width values; __restrict tells the
+// compiler that the rows don't overlap, so it needn't check before vectorizing
+template <class F, int width, class Op>
+inline void combine(F *__restrict a, const F *__restrict b, Op op)
+{
+    for (int i = 0; i < width; ++i)
+        a[i] = op(a[i], b[i]);
+}
+
+// fail[i] = 1 where b[i] is 0, for a row of width values
+template <class F, int width>
+inline void flag_zeros(F *__restrict fail, const F *__restrict b)
+{
+    for (int i = 0; i < width; ++i)
+        fail[i] = b[i] == 0 ? F(1) : fail[i];
+}
+
+// out[i] = result[i], or NaN where fail[i] is set, for a row of width values
+template <class F, int width>
+inline void results(F *__restrict out, const F *__restrict result, const F *__restrict fail)
+{
+    const F nan = numeric_limits<F>::quiet_NaN();
+    for (int i = 0; i < width; ++i) {
+        out[i] = result[i]; // read unconditionally, so that the select needs no branch
+        out[i] = fail[i] == 0 ? out[i] : nan;
+    }
+}
+
+//------------------------------------------------------------------------------
+// the loops have a constant trip count and no branches, so that they vectorize
+template <class F>
+long Batch_evaluator<F>::run(const F *const *columns, int n, F *out)
+{
+    Checked_span<F> fail = checked_span(failed, 0, width); // checked once, not in every loop
+    fill(fail.begin(), fail.end(), F(0));
+    bool may_fail = false; // has a division or modulo run?
+    int top = 0; // rows in use
+    auto row = [&](int r) { return stack.data() + r * width; };
+    for (const Instruction &in : code.instructions) // straight-line code: no jumps
+    {
+        // for a binary operator, a and b are the operands; the result replaces a
+        F *a = top < 2 ? nullptr : row(top - 2);
+        F *b = top < 1 ? nullptr : row(top - 1);
+        switch (in.op)
+        {
+        case Opcode::constant:
+        {
+            F c = F(code.constants[in.arg]);
+            F *r = row(top++);
+            for (int i = 0; i < width; ++i)
+                r[i] = c;
+            break;
+        }
+        case Opcode::load:
+        {
+            F *r = row(top++);
+            copy(columns[in.arg], columns[in.arg] + n, r);
+            fill(r + n, r + width, F(1)); // unused lanes; 1 can't divide by zero
+            break;
+        }
+        case Opcode::add:
+            combine<F, width>(a, b, [](F x, F y) { return x + y; });
+            --top;
+            break;
+        case Opcode::subtract:
+            combine<F, width>(a, b, [](F x, F y) { return x - y; });
+            --top;
+            break;
+        case Opcode::multiply:
+            combine<F, width>(a, b, [](F x, F y) { return x * y; });
+            --top;
+            break;
+        case Opcode::divide:
+            flag_zeros<F, width>(fail.begin(), b);
+            may_fail = true;
+            combine<F, width>(a, b, [](F x, F y) { return x / y; });
+            --top;
+            break;
+        case Opcode::modulo: // on ints, like run(); rare enough to do point by point
+            for (int i = 0; i < n; ++i)
+            {
+                const F limit = F(2147483648.0); // 2^31: what fits in an int
+                if (!(abs(a[i]) < limit && abs(b[i]) < limit) || F(int(a[i])) != a[i] ||
+                    F(int(b[i])) != b[i] || int(b[i]) == 0)
+                    fail[i] = 1;
+                else
+                    a[i] = F(int(a[i]) % int(b[i]));
+            }
+            may_fail = true;
+            --top;
+            break;
+        case Opcode::negate:
+            for (int i = 0; i < width; ++i)
+                b[i] = -b[i];
+            break;
+        default: // Opcode::end
+            break;
+        }
+    }
+
+    results<F, width>(out, row(0), fail.begin());
+    long errors = 0;
+    if (may_fail)
+        for (int i = 0; i < n; ++i)
+            errors += fail[i] != 0;
+    return errors;
+}
+
+#endif // BATCH_H
@@ -0,0 +1,153 @@
+/*
+    budget.h
+
+    Limits on how much work one statement may cause. When the calculator
+    serves several users, one statement with absurd nesting, a matrix of a
+    billion elements, or an integrand that keeps integrate() busy for hours
+    must not stall everybody else: it is stopped with an error, and the
+    session goes on with the next statement.
+
+    A Statement_budget is created for each statement; while it exists, it is
+    the budget of its thread. The parser checks the number of tokens and the
+    nesting depth; run() counts the instructions it executes (once per call,
+    not once per instruction) and the work of matrix products; the clock is
+    read only once every few thousand steps. Tasks that integrate() hands to
+    other threads take the budget along (see Budget_scope).
+
+    Without a Statement_budget (as in sweeps) nothing is checked.
+*/
+
+#ifndef BUDGET_H
+#define BUDGET_H
+
+#include <atomic>
+#include <chrono>
+#include "instruments.h"
+#include "std_lib_facilities.h" // after the standard headers: it #defines vector
+
+//------------------------------------------------------------------------------
+// thrown when a statement has used up its budget; unlike an error at one point
+// of a sweep (say, divide by zero), it isn't skipped: the statement is over
+class Budget_exceeded : public runtime_error
+{
+public:
+    explicit Budget_exceeded(const string &s) : runtime_error("statement stopped: " + s) {}
+};
+
+//------------------------------------------------------------------------------
+class Budget // the limits for one statement
+{
+public:
+    long tokens = 1000000;     // tokens in an expression
+    int depth = 256;           // nesting of parentheses, signs, calls, and matrices
+    double steps = 1e9;        // instructions run, counting each run of an integrand, and matrix work
+    double seconds = 10;       // wall-clock time
+    double elements = 1e7;     // elements of any one matrix
+};
+
+//------------------------------------------------------------------------------
+class Statement_budget // what one statement has used of its Budget
+{
+public:
+    explicit Statement_budget(const Budget &b);
+    ~Statement_budget() { current = previous; }
+    Statement_budget(const Statement_budget &) = delete;
+    Statement_budget &operator=(const Statement_budget &) = delete;
+
+    const Budget limits;
+    atomic<long> steps{0}; // may be charged from several threads
+    int depth = 0;         // current nesting; only the parsing thread changes it
+
+    void charge(long n); // n more steps; error if the steps or the time are used up
+
+    static inline thread_local Statement_budget *current = nullptr; // the budget of this thread
+
+private:
+    chrono::steady_clock::time_point deadline;
+    Statement_budget *previous;
+};
+
+//------------------------------------------------------------------------------
+inline Statement_budget::Statement_budget(const Budget &b)
+    : limits(b), deadline(chrono::steady_clock::now() + chrono::duration_cast<chrono::steady_clock::duration>(
+                                                            chrono::duration<double>(b.seconds))),
+      previous(current)
+{
+    current = this;
+}
+
+//------------------------------------------------------------------------------
+inline void Statement_budget::charge(long n)
+{
+    long before = steps.fetch_add(n, memory_order_relaxed);
+    if (limits.steps < before + n)
+        throw Budget_exceeded("it needs more evaluation steps than its budget");
+    const int check_every = 14; // look at the clock every 2^14 steps
+    if ((before >> check_every) != ((before + n) >> check_every) &&
+        deadline < chrono::steady_clock::now())
+        throw Budget_exceeded("it takes longer than its time budget");
+}
+
+//------------------------------------------------------------------------------
+// checks against the budget of the current statement, if there is one
+inline void charge_steps(long n)
+{
+    if (Statement_budget *b = Statement_budget::current)
+        b->charge(n);
+}
+
+inline void check_tokens(long n)
+{
+    Statement_budget *b = Statement_budget::current;
+    if (b && b->limits.tokens < n)
+        throw Budget_exceeded("more tokens than its budget allows");
+}
+
+inline void check_elements(double n) // double: rows*cols may not fit in a long
+{
+    Statement_budget *b = Statement_budget::current;
+    if (b && b->limits.elements < n)
+        throw Budget_exceeded("a matrix larger than its budget allows");
+}
+
+//------------------------------------------------------------------------------
+// counts one level of nesting while it exists; put one in each recursive grammar function
+class Nesting
+{
+public:
+    Nesting() : b(Statement_budget::current)
+    {
+        if (b && b->limits.depth < ++b->depth)
+        {
+            --b->depth;
+            throw Budget_exceeded("nested deeper than its budget allows");
+        }
+        if (b && instrumented)
+            instruments().depth(b->depth);
+    }
+    ~Nesting()
+    {
+        if (b)
+            --b->depth;
+    }
+
+private:
+    Statement_budget *b;
+};
+
+//------------------------------------------------------------------------------
+// makes b the budget of this thread while it exists: for tasks run on other threads
+class Budget_scope
+{
+public:
+    explicit Budget_scope(Statement_budget *b) : previous(Statement_budget::current)
+    {
+        Statement_budget::current = b;
+    }
+    ~Budget_scope() { Statement_budget::current = previous; }
+
+private:
+    Statement_budget *previous;
+};
+
+#endif // BUDGET_H
@@ -15,6 +15,9 @@
     The grammar for input is:
 
     Statement:
+        Declaration
+        Definition
+        Assignment
         Expression
         Print
         Quit
@@ -25,6 +28,19 @@
     Quit:
         q 
 
+    Declaration:
+        "let" Name "=" Expression
+
+    Definition:
+        Name ( Parameters ) "=" Expression
+        "memo" Name ( Parameters ) "=" Expression
+    Parameters:
+        Name
+        Parameters , Name
+
+    Assignment:
+        Name "=" Expression
+
     Expression:
         Term
         Expression + Term
@@ -36,25 +52,105 @@
         Term % Primary
     Primary:
         Number
+        Name
+        Call
+        Matrix
         ( Expression )
         - Primary
         + Primary
+        Primary '
+    Call:
+        integrate ( Expression , Name , Expression , Expression , Expression )
+        solve ( Expression , Name , Expression , Expression )
+        zeros ( Expression , Expression )
+        identity ( Expression )
+        if ( Condition , Expression , Expression )
+        Name ( Arguments )
+    Arguments:
+        Expression
+        Arguments , Expression
+    Condition:
+        Expression
+        Expression Relation Expression
+    Relation:
+        < <= > >= == !=
+    Matrix:
+        [ Elements ]
+        [ Rows ]
+    Rows:
+        [ Elements ]
+        Rows , [ Elements ]
+    Elements:
+        Expression
+        Elements , Expression
     Number:
         floating-point-literal
 
+        A Primary followed by ' is its transpose. [1, 2] is a column vector;
+        [[1, 2]] is a row vector; [[1, 2], [3, 4]] is a 2 by 2 matrix.
+
+        A Definition makes a function, e.g. f(x) = x*x + 3*x, that
+        Name ( Arguments ) calls. A condition that isn't a comparison is
+        true unless it is 0; only the chosen Expression of an if is run, so
+        a function may call itself: fib(n) = if(n < 2, n, fib(n-1) + fib(n-2)).
+        A small function is compiled in place of each call whose arguments
+        are plain numbers or names. A "memo" function, which may use no
+        variables but its parameters, remembers its results, so that
+        memo fib(n) = ... takes linear time.
+
 
         Input comes from cin through the Token_stream called ts.
+
+        The grammar functions don't compute values; they compile a statement
+        into a Code (see compiled_expression.h), which is then run. That way
+        the integrand of integrate() and solve() is read only once.
+
+        Compiled expressions are kept in a Plan_cache (see plan_cache.h), so
+        an expression that differs from an earlier one only in its numbers
+        is not parsed again.
+
+        Each statement runs under a Budget (see budget.h): one that would take
+        too many tokens, too deep a nesting, too many steps, too much time, or
+        too large a matrix is stopped with an error, and the next statement is
+        read as usual.
 */
 
+#include <filesystem>        // before std_lib_facilities.h, which #defines vector
+#include <functional>
 #include "std_lib_facilities.h"
+#include "compiled_expression.h"
+#include "integrate.h"
+#include "persistent_map.h"
+#include "plan_cache.h"
+#include "coordinator.h"
+#include "wire.h"
+#include "shm_ring.h"
+#include "script_cache.h"
+#include "snapshot.h"
+#include "monte_carlo.h"
+#include "autodiff.h"
+#include "instruments.h"
+#include "perf_counters.h"
+#include "number_format.h"
+#include "csv_pipeline.h"
+#include "input_buffer.h"
 
 //------------------------------------------------------------------------------
 // variables and names
-const string prompt = "> "; // used to indicate the program is waiting for input
-const string result = "= "; // used to indicate that what follows is a result
-const char number = '8';    // t.kind == number means that t is a number token
-const char quit = 'q';      // t.kind == quit means that t is a quit token
-const char print = ';';     // t.kind == print means that t is a print token
+const string prompt = "> ";   // used to indicate the program is waiting for input
+const string result = "= ";   // used to indicate that what follows is a result
+const char number = '8';      // t.kind == number means that t is a number token
+const char quit = 'q';        // t.kind == quit means that t is a quit token
+const char print = ';';       // t.kind == print means that t is a print token
+const char name = 'a';        // t.kind == name means that t is a name token
+const char let = 'L';         // t.kind == let means that t is a declaration token
+const string declkey = "let"; // declaration keyword
+const char memo = 'M';        // t.kind == memo means that t is a memo token
+const string memokey = "memo"; // keyword for functions that remember their results
+const char less_eq = 'l';     // <=
+const char greater_eq = 'g';  // >=
+const char equals = 'e';      // ==
+const char not_equals = 'n';  // !=
 
 //------------------------------------------------------------------------------
 class Token
@@ -62,6 +158,8 @@ class Token
 public:
     char kind;     // what kind of token
     double value;  // for numbers: a value
+    string name;   // for names: the name itself
+    int place = -1; // for numbers: which number of the statement compile() read it as
     Token(char ch) // make a Token from a char
         : kind(ch), value(0)
     {
@@ -70,69 +168,104 @@ public:
         : kind(ch), value(val)
     {
     }
+    Token(char ch, string n) // make a Token from a char and a name
+        : kind(ch), value(0), name(n)
+    {
+    }
 };
 
 //------------------------------------------------------------------------------
 class Token_stream
 {
 public:
-    Token_stream();        // make a Token_stream that reads from cin
+    Token_stream(istream &is = cin); // make a Token_stream that reads from is
+    ~Token_stream() { in.rdbuf(input.source()); }
+    Token_stream(const Token_stream &) = delete;
+    Token_stream &operator=(const Token_stream &) = delete;
+
     Token get();           // get a Token (get() is defined elsewhere)
     void putback(Token t); // put a Token back
-    void ignore(char c);   // discard characters up to and including a c
+    Skipped_span ignore(char c); // discard characters up to and including a c
+    Text_position position() { return input.position(); } // of the next character
 private:
-    bool full;    // is there a Token in the buffer?
-    Token buffer; // here is where we keep a Token put back using putback()
+    istream &in;          // where the characters come from
+    Input_buffer input;   // in reads through it (see input_buffer.h)
+    vector<Token> buffer; // Tokens put back using putback(); the last one comes out first
+    char last = 0;        // the kind of the Token get() returned last
+
+    Token read(); // get() without the buffer
 };
 
 //------------------------------------------------------------------------------
-// The constructor just sets full to indicate that the buffer is empty:
-Token_stream::Token_stream()
-    : full(false), buffer(0) // no Token in buffer
+// The constructor puts an Input_buffer in front of the input stream's buffer;
+// the Token buffer starts out empty
+Token_stream::Token_stream(istream &is)
+    : in(is), input(is.rdbuf())
 {
+    in.rdbuf(&input);
 }
 
 //------------------------------------------------------------------------------
-// The putback() member function puts its argument back into the Token_stream's buffer:
+// The putback() member function puts its argument back into the Token_stream's buffer.
+// More than one Token may be put back: statement() needs two to tell an
+// assignment from an expression that starts with a name.
 void Token_stream::putback(Token t)
 {
-    if (full)
-        error("putback() into a full buffer");
-    buffer = t;  // copy t to buffer
-    full = true; // buffer is now full
+    if (instrumented)
+        instruments().putbacks.fetch_add(1, memory_order_relaxed);
+    buffer.push_back(t);
 }
 
 //------------------------------------------------------------------------------
 // c represents the kind of Token
-void Token_stream::ignore(char c)
+Skipped_span Token_stream::ignore(char c)
 {
+    Skipped_span skipped;
     // first look in buffer
-    if (full && c == buffer.kind)
+    if (buffer.empty() && last == c)
+        return skipped; // the error was at the c itself, as in 1+; and it's gone already
+    while (!buffer.empty())
     {
-        full = false;
-        return;
+        char kind = buffer.back().kind;
+        buffer.pop_back();
+        if (kind == c)
+            return skipped;
     }
-    full = false;
 
-    // now search input:
-    char ch = 0;
-    while (cin >> ch)
-        if (ch == c)
-            return;
+    // now search input, a buffer at a time:
+    if (!input.skip_past(c, skipped))
+        in.setstate(ios_base::eofbit | ios_base::failbit); // as in >> ch at the end of the input
+    if (instrumented)
+        instruments().skipped.fetch_add(skipped.characters, memory_order_relaxed);
+    return skipped;
 }
 
 //------------------------------------------------------------------------------
 Token Token_stream::get()
 {
-    if (full)
+    last = 0; // until we know what it is
+    if (!buffer.empty())
     { // do we already have a Token ready?
         // remove token from buffer
-        full = false;
-        return buffer;
+        Token t = buffer.back();
+        buffer.pop_back();
+        last = t.kind;
+        return t;
     }
+    Token t = read();
+    last = t.kind;
+    return t;
+}
 
+//------------------------------------------------------------------------------
+// the next Token from the input
+Token Token_stream::read()
+{
     char ch;
-    cin >> ch; // note that >> skips whitespace (space, newline, tab, etc.)
+    if (!(in >> ch)) // note that >> skips whitespace (space, newline, tab, etc.)
+        return Token(quit); // end of input
+    if (instrumented)
+        instruments().tokens.fetch_add(1, memory_order_relaxed);
 
     switch (ch)
     {
@@ -144,7 +277,25 @@ Token Token_stream::get()
     case '-':
     case '*':
     case '/':
+    case '%':
+    case ',':
+    case '[':
+    case ']':
+    case '\'':
         return Token(ch); // let each character represent itself
+    case '=':
+    case '<':
+    case '>':
+    case '!':
+    {
+        char next = 0;
+        if (in.get(next) && next == '=') // ==, <=, >=, !=
+            return Token(ch == '=' ? equals : ch == '<' ? less_eq : ch == '>' ? greater_eq : not_equals);
+        in.putback(next);
+        if (ch == '!')
+            error("Bad token");
+        return Token(ch);
+    }
     case '.':
     case '0':
     case '1':
@@ -157,73 +308,460 @@ Token Token_stream::get()
     case '8':
     case '9':
     {
-        cin.putback(ch); // put digit back into the input stream
+        in.putback(ch); // put digit back into the input stream
         double val;
-        cin >> val;                // read a floating-point number
+        in >> val;                // read a floating-point number
         return Token(number, val); //  represent "a number"
     }
     default:
+        if (isalpha(ch))
+        {
+            string s;
+            s += ch;
+            while (in.get(ch) && (isalpha(ch) || isdigit(ch) || ch == '_'))
+                s += ch;
+            in.putback(ch);
+            if (s == declkey)
+                return Token(let); // declaration keyword
+            if (s == memokey)
+                return Token(memo);
+            return Token(name, s);
+        }
         error("Bad token");
     }
 }
 
 //------------------------------------------------------------------------------
-class Variable
+// cin reads through a buffer of its own, not C's stdin one character at a time,
+// so that ts's Input_buffer gets what has been typed or piped in a block at a time
+const bool cin_unsynced = (ios_base::sync_with_stdio(false), true);
+
+Token_stream ts; // provides get() and putback()
+
+// The variables, by name. A Persistent_map is never changed in place: defining
+// or assigning a variable makes a new map that shares all but a few nodes with
+// the old one. So saving a copy of var_table (a "scenario" to come back to or
+// to vary, as calculator --scenarios does) costs O(1), however many variables
+// there are.
+// Like the functions and the plans below, the variables are per thread: a
+// thread of calculator --batch runs one script at a time, from start to end
+// (see batch() and reset_engine()).
+thread_local Persistent_map<Value> var_table;
+
+// The variables of an earlier session (see snapshot.h), if it was restored;
+// those in var_table take precedence.
+thread_local unique_ptr<Snapshot> restored;
+
+//------------------------------------------------------------------------------
+bool find_value(const string &s, Value &v) // v = the value of s, if there is a Variable named s
+{
+    if (const Value *p = var_table.find(s))
+    {
+        v = *p;
+        return true;
+    }
+    return restored && restored->find(s, v);
+}
+
+//------------------------------------------------------------------------------
+Value get_value(string s) // return the value of the Variable named s
+{
+    Value v;
+    if (!find_value(s, v))
+        error("get: undefined variable ", s);
+    return v;
+}
+
+//------------------------------------------------------------------------------
+bool is_declared(string var) // is var already in var_table (or the restored snapshot)?
+{
+    return var_table.find(var) != nullptr || (restored && restored->contains(var));
+}
+
+//------------------------------------------------------------------------------
+void set_value(string s, Value v) // set the Variable named s to v
+{
+    if (!is_declared(s))
+        error("set: undefined variable ", s);
+    var_table = var_table.set(s, v);
+}
+
+//------------------------------------------------------------------------------
+Value define_name(string var, Value val) // add (var,val) to var_table
+{
+    if (is_declared(var))
+        error(var, " declared twice");
+    var_table = var_table.set(var, val);
+    return val;
+}
+
+//------------------------------------------------------------------------------
+class Function // a user-defined function
 {
 public:
-    string name;
-    double value;
+    vector<string> params;
+    vector<Token> body; // the tokens of its Expression
+    bool memo = false;  // remember results?
+    bool inlined = false; // small enough to be compiled in place of a call
 };
 
+// The functions, by name. A function's body is compiled into each Code that
+// calls it, so a definition makes every Code in the Plan_cache stale.
+thread_local map<string, Function> function_table;
+
 //------------------------------------------------------------------------------
-Token_stream ts; // provides get() and putback()
-vector<Variable> var_table;
+void expression(Token_stream &ts, Code &code); // declaration so that primary() can call expression()
+
+//------------------------------------------------------------------------------
+void expect(Token_stream &ts, char kind, const string &what) // read a token that must be of kind
+{
+    Token t = ts.get();
+    if (t.kind != kind)
+        error(what, " expected");
+}
+
+//------------------------------------------------------------------------------
+// deal with integrate(expr, var, a, b, tol) and solve(expr, var, lo, hi);
+// the '(' has already been read
+void integrand_call(Token_stream &ts, Code &code, const string &fname)
+{
+    Opcode op = fname == "integrate" ? Opcode::integrate : Opcode::solve;
+    int bounds = fname == "integrate" ? 3 : 2; // number of expressions after the variable
+
+    // the integrand is compiled once, in line, and skipped when the statement runs;
+    // integrate() and solve() run it for each sample
+    int skip = code.emit(Opcode::jump);
+    int body = code.size();
+    expression(ts, code);
+    code.emit(Opcode::end);
+    code.patch(skip, code.size());
+
+    expect(ts, ',', "','");
+    Token t = ts.get();
+    if (t.kind != name)
+        error("variable name expected in ", fname);
+    int var = code.slot(t.name);
+    for (int i = 0; i < bounds; ++i)
+    {
+        expect(ts, ',', "','");
+        expression(ts, code);
+    }
+    expect(ts, ')', "')'");
+    code.emit(op, code.add_call(body, var));
+}
+
+//------------------------------------------------------------------------------
+// deal with Condition: push 1 or 0 for a Relation, or the value of the Expression
+void condition(Token_stream &ts, Code &code)
+{
+    expression(ts, code);
+    Token t = ts.get();
+    Relation r;
+    switch (t.kind)
+    {
+    case '<':
+        r = Relation::less;
+        break;
+    case less_eq:
+        r = Relation::less_equal;
+        break;
+    case '>':
+        r = Relation::greater;
+        break;
+    case greater_eq:
+        r = Relation::greater_equal;
+        break;
+    case equals:
+        r = Relation::equal;
+        break;
+    case not_equals:
+        r = Relation::not_equal;
+        break;
+    default:
+        ts.putback(t);
+        return;
+    }
+    expression(ts, code);
+    code.emit(Opcode::compare, int(r));
+}
+
+//------------------------------------------------------------------------------
+// deal with if(condition, a, b); the '(' has already been read. Only one of
+// a and b is run
+void if_call(Token_stream &ts, Code &code)
+{
+    condition(ts, code);
+    expect(ts, ',', "','");
+    int branch = code.emit(Opcode::branch);
+    expression(ts, code);
+    expect(ts, ',', "','");
+    int skip = code.emit(Opcode::skip);
+    code.depth -= 1; // the else pushes the value instead of the then
+    code.patch(branch, code.size());
+    expression(ts, code);
+    expect(ts, ')', "')'");
+    code.patch(skip, code.size());
+}
+
+//------------------------------------------------------------------------------
+// the Function_site of user-defined function fname in code; its body is
+// compiled into code the first time code calls fname, with the parameters
+// renamed to the slots of the site
+int function_site(Code &code, const string &fname)
+{
+    string pseudo = fname + "()"; // can't be the name of a variable
+    for (int i = 0; i < int(code.functions.size()); ++i)
+        if (code.names[code.functions[i].slot] == pseudo)
+            return i; // already there: a recursive call, or another call in the same statement
+
+    const Function &f = function_table[fname];
+    int slot = code.slot(pseudo);
+    for (const string &p : f.params)
+        code.slot(fname + '.' + p); // new names: right after pseudo
+    int skip = code.emit(Opcode::jump);
+    int site = code.add_function(code.size(), slot, f.params.size(), f.memo);
+
+    istringstream none;
+    Token_stream body(none);
+    body.putback(Token(print));
+    for (int i = f.body.size() - 1; 0 <= i; --i)
+    {
+        Token t = f.body[i];
+        bool called = i + 1 < int(f.body.size()) && f.body[i + 1].kind == '(';
+        if (t.kind == name && !called && find(f.params.begin(), f.params.end(), t.name) != f.params.end())
+            t.name = fname + '.' + t.name;
+        body.putback(t);
+    }
+    expression(body, code);
+    if (body.get().kind != print)
+        error("bad definition of ", fname);
+    code.emit(Opcode::end);
+    code.patch(skip, code.size());
+    return site;
+}
+
+//------------------------------------------------------------------------------
+void primary(Token_stream &ts, Code &code); // declaration so that function_call() can call primary()
+
+//------------------------------------------------------------------------------
+// deal with a call of user-defined function fname; the '(' has already been read
+void function_call(Token_stream &ts, Code &code, const string &fname)
+{
+    const Function &f = function_table[fname];
+    if (f.inlined) // with plain arguments, the body is read in place of the call
+    {
+        vector<Token> read; // each argument and the ',' or ')' after it
+        bool plain = true;
+        for (int i = 0; plain && i < int(f.params.size()); ++i)
+        {
+            Token arg = ts.get();
+            Token after = ts.get();
+            read.push_back(arg);
+            read.push_back(after);
+            plain = (arg.kind == number || arg.kind == name) && after.kind == (i + 1 < int(f.params.size()) ? ',' : ')');
+        }
+        if (plain)
+        {
+            ts.putback(Token(')'));
+            for (int i = f.body.size() - 1; 0 <= i; --i)
+            {
+                Token t = f.body[i];
+                auto p = find(f.params.begin(), f.params.end(), t.name);
+                if (t.kind == name && p != f.params.end())
+                    t = read[2 * (p - f.params.begin())];
+                ts.putback(t);
+            }
+            ts.putback(Token('('));
+            primary(ts, code);
+            return;
+        }
+        for (int i = read.size() - 1; 0 <= i; --i)
+            ts.putback(read[i]);
+    }
+
+    int site = function_site(code, fname);
+    for (int i = 0; i < int(f.params.size()); ++i)
+    {
+        if (i)
+            expect(ts, ',', "','");
+        expression(ts, code);
+    }
+    expect(ts, ')', "')'");
+    code.emit(Opcode::call, site);
+}
+
+//------------------------------------------------------------------------------
+// deal with a call of a function; the '(' has already been read
+void call(Token_stream &ts, Code &code, const string &fname)
+{
+    if (fname == "integrate" || fname == "solve")
+    {
+        integrand_call(ts, code, fname);
+        return;
+    }
+    if (fname == "if")
+    {
+        if_call(ts, code);
+        return;
+    }
+    if (function_table.count(fname))
+    {
+        function_call(ts, code, fname);
+        return;
+    }
+
+    Opcode op;
+    int args; // number of arguments
+    if (fname == "zeros")
+    {
+        op = Opcode::zeros;
+        args = 2;
+    }
+    else if (fname == "identity")
+    {
+        op = Opcode::identity;
+        args = 1;
+    }
+    else
+        error("unknown function ", fname);
+
+    for (int i = 0; i < args; ++i)
+    {
+        if (i)
+            expect(ts, ',', "','");
+        expression(ts, code);
+    }
+    expect(ts, ')', "')'");
+    code.emit(op);
+}
+
+//------------------------------------------------------------------------------
+// read Elements up to and including the closing ']'; return how many there were
+// the matrix being filled in is on top of the stack; count elements are already in it
+int elements(Token_stream &ts, Code &code, int count)
+{
+    int n = 0;
+    while (true)
+    {
+        expression(ts, code);
+        code.emit(Opcode::element, count + n);
+        ++n;
+        Token t = ts.get();
+        if (t.kind == ']')
+            return n;
+        if (t.kind != ',')
+            error("',' or ']' expected in matrix");
+    }
+}
 
 //------------------------------------------------------------------------------
-double get_value(string s) // return the value of the Variable named s
+// deal with a matrix literal; the first '[' has already been read
+void matrix_literal(Token_stream &ts, Code &code)
 {
-    for (const Variable &v : var_table)
+    int shape = code.shapes.size();
+    code.shapes.push_back(Shape{0, 0}); // filled in when we know the size
+    code.emit(Opcode::matrix, shape);
+
+    Token t = ts.get();
+    if (t.kind != '[') // [ Elements ]: a column vector
+    {
+        ts.putback(t);
+        int n = elements(ts, code, 0);
+        code.shapes[shape] = Shape{n, 1};
+        return;
+    }
+
+    int rows = 0;
+    int cols = 0;
+    while (true) // [ Rows ]: t is the '[' of a row
     {
-        if (v.name == s)
-            return v.value;
+        int n = elements(ts, code, rows * cols);
+        if (rows == 0)
+            cols = n;
+        else if (n != cols)
+            error("all rows of a matrix must have the same number of elements");
+        ++rows;
+
+        t = ts.get();
+        if (t.kind == ']')
+            break;
+        if (t.kind != ',')
+            error("',' or ']' expected in matrix");
+        expect(ts, '[', "'['");
     }
-    error("get: undefined variable ", s);
+    code.shapes[shape] = Shape{rows, cols};
 }
 
 //------------------------------------------------------------------------------
-double expression(); // declaration so that primary() can call expression()
+void postfix(Token_stream &ts, Code &code); // declaration so that primary() can call postfix()
 
 //------------------------------------------------------------------------------
-// deal with numbers and parentheses
-double primary()
+// deal with numbers, names, calls, matrices, and parentheses
+void primary(Token_stream &ts, Code &code)
 {
+    Nesting level; // every kind of nesting goes through here: stop runaway recursion
     Token t = ts.get();
     switch (t.kind)
     {
     case '(': // handle '(' expression ')'
     {
-        double d = expression();
+        expression(ts, code);
         t = ts.get();
         if (t.kind != ')')
             error("')' expected");
-        return d;
+        postfix(ts, code);
+        return;
     }
     case number:
-        return t.value; // return the number's value
+        code.emit_constant(t.value, t.place); // the number's value
+        return;
+    case name:
+    {
+        Token next = ts.get();
+        if (next.kind == '(')
+            call(ts, code, t.name);
+        else
+        {
+            ts.putback(next);
+            code.emit(Opcode::load, code.slot(t.name)); // the variable's value
+        }
+        postfix(ts, code);
+        return;
+    }
+    case '[':
+        matrix_literal(ts, code);
+        postfix(ts, code);
+        return;
     case '-':
-        return -primary();
+        primary(ts, code);
+        code.emit(Opcode::negate);
+        return;
     case '+':
-        return primary();
+        primary(ts, code);
+        return;
     default:
         error("primary expected");
     }
 }
 
+//------------------------------------------------------------------------------
+// deal with ' (transpose) after a primary
+void postfix(Token_stream &ts, Code &code)
+{
+    Token t = ts.get();
+    while (t.kind == '\'')
+    {
+        code.emit(Opcode::transpose);
+        t = ts.get();
+    }
+    ts.putback(t);
+}
+
 //------------------------------------------------------------------------------
 // deal with *, /, and %
-double term()
+void term(Token_stream &ts, Code &code)
 {
-    double left = primary();
+    primary(ts, code);
     Token t = ts.get(); // get the next token from token stream
 
     while (true)
@@ -231,99 +769,2032 @@ double term()
         switch (t.kind)
         {
         case '*':
-            left *= primary();
+            primary(ts, code);
+            code.emit(Opcode::multiply);
             t = ts.get();
             break;
         case '/':
-        {
-            double d = primary();
-            if (d == 0)
-                error("divide by zero");
-            left /= d;
+            primary(ts, code);
+            code.emit(Opcode::divide);
             t = ts.get();
             break;
-        }
         case '%':
-        {
-            int i1 = narrow_cast<int>(left);
-            int i2 = narrow_cast<int>(primary());
-            if (i2 == 0)
-                error("%: divide by zero");
-            left = i1 % i2;
+            primary(ts, code);
+            code.emit(Opcode::modulo);
             t = ts.get();
             break;
-        }
         default:
             ts.putback(t); // put t back into the token stream
-            return left;
+            return;
         }
     }
 }
 
 //------------------------------------------------------------------------------
 // deal with + and -
-double expression()
+void expression(Token_stream &ts, Code &code)
 {
-    double left = term(); // read and evaluate a Term
-    Token t = ts.get();   // get the next token from token stream
+    term(ts, code);         // read and compile a Term
+    Token t = ts.get(); // get the next token from token stream
 
     while (true)
     {
         switch (t.kind)
         {
         case '+':
-            left += term(); // evaluate Term and add
+            term(ts, code); // compile Term and add
+            code.emit(Opcode::add);
             t = ts.get();
             break;
         case '-':
-            left -= term(); // evaluate Term and subtract
+            term(ts, code); // compile Term and subtract
+            code.emit(Opcode::subtract);
             t = ts.get();
             break;
         default:
             ts.putback(t); // put t back into the token stream
-            return left;   // finally: no more + or -: return the answer
+            return;        // finally: no more + or -
         }
     }
 }
 
 //------------------------------------------------------------------------------
-// expression evaluation loop function
-void clean_up_mess()
+// write how often the statement just run called each function of code
+void report_calls(const Code_view &code)
 {
-    ts.ignore(print);
+    for (int i = 0; i < code.function_count; ++i)
+    {
+        const Function_state::Counts &c = code.state->counts[i];
+        string fname = code.name(code.functions[i].slot);
+        cerr << fname.substr(0, fname.size() - 2) << ": " << c.calls << " calls"; // without the "()"
+        if (code.functions[i].memo)
+        {
+            long lookups = c.hits + c.misses;
+            cerr << "; memo: " << c.hits << " hits, " << c.misses << " misses ("
+                 << (lookups ? 100.0 * c.hits / lookups : 0) << "% hit rate)";
+        }
+        cerr << '\n';
+    }
 }
+
 //------------------------------------------------------------------------------
-// expression evaluation loop function
-void calculate()
+// run a compiled expression, taking the values of its names from var_table;
+// the expression is run with plain doubles unless a matrix is involved
+Value evaluate(const Code_view &code)
 {
-    while (cin)
-        try
+    if (code.state)
+        for (Function_state::Counts &c : code.state->counts)
         {
-            cout << prompt;
-            Token t = ts.get();
+            c.calls = 0;
+            c.hits = 0;
+            c.misses = 0;
+        }
 
-            //see if there is a quit after print
-            while (t.kind == print)
-                t = ts.get();
+    vector<Value> slots(code.slots);
+    bool matrices = code.uses_matrices;
+    for (int i = 0; i < code.slots; ++i)
+    {
+        if (find_value(code.name(i), slots[i]))
+            ;
+        else if (!code.is_bound(i)) // the variable of integrate() or solve() gets its value there
+            error("get: undefined variable ", code.name(i));
+        if (slots[i].is_matrix())
+            matrices = true;
+    }
+    Value v;
+    if (matrices)
+        v = run(code, 0, slots.data());
+    else
+    {
+        vector<double> numbers(slots.size());
+        for (int i = 0; i < int(slots.size()); ++i)
+            numbers[i] = slots[i].number;
+        v = run(code, 0, numbers.data());
+    }
+    if (builtin_reports && code.state)
+        report_calls(code);
+    return v;
+}
 
-            // quit
-            if (t.kind == quit)
-            {
-                return;
-            }
-            ts.putback(t);
-            cout << result << expression() << endl;
-        }
-        catch (const std::exception &e)
+//------------------------------------------------------------------------------
+thread_local Plan_cache plans; // compiled expressions, by the shape of their tokens
+
+//------------------------------------------------------------------------------
+// compile an expression, reusing a Code from cache if an expression of the same
+// shape has been compiled before; the print or quit ending the expression is
+// left in ts
+shared_ptr<Code> compile(Token_stream &ts, Plan_cache &cache)
+{
+    static thread_local vector<Token> tokens; // reused from call to call: no allocation on a hit
+    static thread_local vector<double> numbers;
+    static thread_local string shape;
+    tokens.clear();
+    numbers.clear();
+    shape.clear();
+    Token t = ts.get();
+    for (; t.kind != print && t.kind != quit; t = ts.get())
+    {
+        shape += t.kind;
+        if (t.kind == number)
         {
-            cerr << e.what() << endl; // write error message
-            clean_up_mess();
+            t.place = numbers.size();
+            numbers.push_back(t.value);
         }
+        else if (t.kind == name)
+            shape += t.name + ' '; // ' ' can't be part of a name
+        tokens.push_back(t);
+        check_tokens(tokens.size());
+    }
+    ts.putback(t);
+
+    shared_ptr<Code> code = cache.find(shape);
+    if (code)
+    {
+        for (int i = 0; i < int(code->places.size()); ++i) // the numbers are all that differ
+            if (0 <= code->places[i])
+                code->constants[i] = numbers[code->places[i]];
+        return code;
+    }
+
+    for (int i = tokens.size() - 1; 0 <= i; --i) // read them again, this time parsing
+        ts.putback(tokens[i]);
+    code = make_shared<Code>();
+    expression(ts, *code);
+    code->emit(Opcode::end);
+
+    Token next = ts.get();
+    ts.putback(next);
+    // the expression may end before the print (as in "1 2;"); then the shape
+    // describes more than the Code, and the Code must not be reused
+    if (next.kind == print || next.kind == quit)
+        cache.insert(shape, code);
+    return code;
+}
+
+//------------------------------------------------------------------------------
+// compile and run an expression
+Value expression(Token_stream &ts)
+{
+    return evaluate(*compile(ts, plans));
+}
+
+//------------------------------------------------------------------------------
+// assume we have seen "let"
+// handle: name = expression
+// declare a variable called "name" with the initial value "expression"
+Value declaration(Token_stream &ts)
+{
+    Token t = ts.get();
+    if (t.kind != name)
+        error("name expected in declaration");
+    string var_name = t.name;
+
+    Token t2 = ts.get();
+    if (t2.kind != '=')
+        error("= missing in declaration of ", var_name);
+
+    Value d = expression(ts);
+    define_name(var_name, d);
+    return d;
+}
+
+//------------------------------------------------------------------------------
+// assume we have seen "name ="
+// handle: expression
+// give the existing variable called "name" the value "expression"
+Value assignment(Token_stream &ts, string var_name)
+{
+    if (!is_declared(var_name))
+        error(var_name, " has not been declared"); // before evaluating: the message is clearer
+    Value d = expression(ts);
+    set_value(var_name, d);
+    return d;
+}
+
+//------------------------------------------------------------------------------
+Value statement(Token_stream &ts)
+{
+    Token t = ts.get();
+    switch (t.kind)
+    {
+    case let:
+        return declaration(ts);
+    case name:
+    {
+        Token t2 = ts.get();
+        if (t2.kind == '=')
+            return assignment(ts, t.name);
+        ts.putback(t2); // not an assignment: an expression that starts with a name
+        ts.putback(t);
+        return expression(ts);
+    }
+    default:
+        ts.putback(t);
+        return expression(ts);
+    }
 }
 
 //------------------------------------------------------------------------------
-int main() try
+// compile function fname on its own, as a call would; a memo function must
+// not use any variable but its parameters, or its results could change
+void check_function(const string &fname)
 {
+    Code code;
+    function_site(code, fname);
+    if (function_table[fname].memo)
+        for (int i = 0; i < int(code.names.size()); ++i)
+            if (!code.is_bound(i))
+                error("memo function " + fname + " uses variable ", code.names[i]);
+}
+
+//------------------------------------------------------------------------------
+// handle: [memo] name ( parameters ) = expression
+// define a function; false (with nothing read) if the statement isn't a definition
+bool definition(Token_stream &ts)
+{
+    vector<Token> head; // the tokens up to the '=', to put back if this isn't a definition
+    auto put_back = [&] {
+        for (int i = head.size() - 1; 0 <= i; --i)
+            ts.putback(head[i]);
+        return false;
+    };
+    head.push_back(ts.get());
+    Function f;
+    f.memo = head[0].kind == memo;
+    if (f.memo)
+        head.push_back(ts.get());
+    if (head.back().kind != name)
+        return f.memo ? error("function name expected after memo"), false : put_back();
+    string fname = head.back().name;
+    head.push_back(ts.get());
+    if (head.back().kind != '(')
+        return f.memo ? error("'(' expected after memo ", fname), false : put_back();
+    int first = head.size(); // of the parameters
+    for (int nesting = 1; nesting;) // to the matching ')': a call may look the same so far
+    {
+        head.push_back(ts.get());
+        if (head.back().kind == '(')
+            ++nesting;
+        else if (head.back().kind == ')')
+            --nesting;
+        else if (head.back().kind == print || head.back().kind == quit)
+        {
+            ts.putback(head.back()); // the end of the statement
+            head.pop_back();
+            return f.memo ? error("')' expected in definition of ", fname), false : put_back();
+        }
+    }
+    head.push_back(ts.get());
+    if (head.back().kind != '=')
+        return f.memo ? error("= missing in definition of ", fname), false : put_back();
+
+    int last = head.size() - 2; // the ')'
+    for (int i = first; i < last; i += 2)
+    {
+        if (head[i].kind != name)
+            error("parameter name expected in definition of ", fname);
+        if (find(f.params.begin(), f.params.end(), head[i].name) != f.params.end())
+            error(head[i].name + " is a parameter of ", fname + " twice");
+        f.params.push_back(head[i].name);
+        if (i + 1 < last && (head[i + 1].kind != ',' || i + 2 == last))
+            error("',' expected between the parameters of ", fname);
+    }
+    if (f.params.empty())
+        error(fname, " needs a parameter");
+    if (fname == "integrate" || fname == "solve" || fname == "zeros" || fname == "identity" || fname == "if")
+        error(fname, " is a built-in function");
+
+    Token t = ts.get();
+    for (; t.kind != print && t.kind != quit; t = ts.get())
+    {
+        f.body.push_back(t);
+        check_tokens(head.size() + f.body.size());
+    }
+    ts.putback(t);
+    if (f.body.empty())
+        error("expression expected in definition of ", fname);
+    const int inline_tokens = 32; // what counts as small
+    f.inlined = !f.memo && f.body.size() <= inline_tokens;
+    for (int i = 0; f.inlined && i + 1 < int(f.body.size()); ++i)
+        if (f.body[i].kind == name && f.body[i + 1].kind == '(') // no calls: no control flow, no recursion
+            f.inlined = false;
+
+    map<string, Function> old = function_table;
+    function_table[fname] = f;
+    try
+    {
+        for (const auto &g : function_table) // a memo function may call fname
+            if (g.first == fname || g.second.memo)
+                check_function(g.first);
+    }
+    catch (...)
+    {
+        function_table = old;
+        throw;
+    }
+    plans.clear(); // compiled with the old definition, or with "unknown function"
+    return true;
+}
+
+//------------------------------------------------------------------------------
+// compile an expression given as a string, e.g. on the command line
+Code compile(const string &s)
+{
+    istringstream is(s);
+    Token_stream tokens(is);
+    Code code = *compile(tokens, plans);
+    Token t = tokens.get();
+    if (t.kind != print && t.kind != quit) // quit: end of the string
+        error("unexpected input after the expression: ", s);
+    return code;
+}
+
+//------------------------------------------------------------------------------
+// expression evaluation loop function
+void clean_up_mess()
+{
+    Skipped_span s = ts.ignore(print);
+    if (s.text.find_first_not_of(" \t\r\n") == string::npos && s.characters == long(s.text.size()))
+        return; // nothing but space
+    for (char &ch : s.text)
+        if (isspace(ch))
+            ch = ' '; // on one line
+    cerr << "skipped " << s.characters << " characters from line " << s.from.line << ", column "
+         << s.from.column << " to line " << s.to.line << ", column " << s.to.column << ": " << s.text
+         << (long(s.text.size()) < s.characters ? "..." : "") << endl;
+}
+//------------------------------------------------------------------------------
+Budget statement_limits; // what a statement may use before it is stopped (see budget.h)
+
+//------------------------------------------------------------------------------
+Number_formatter result_format; // how results are written (see number_format.h)
+
+// "= value" on a line of its own; not flushed: cin and cerr are tied to cout,
+// so it is written out before the next input is read or an error is reported
+void write_result(const Value &v, ostream &os = cout, Number_formatter &format = result_format)
+{
+    os << result;
+    format.write(os, v);
+    os << '\n';
+}
+
+//------------------------------------------------------------------------------
+// expression evaluation loop function
+void calculate()
+{
+    while (cin)
+    {
+        Statement_clock clock; // restarted when the statement's first token is there
+        try
+        {
+            cout << prompt;
+            Token t = ts.get();
+
+            //see if there is a quit after print
+            while (t.kind == print)
+                t = ts.get();
+
+            // quit
+            if (t.kind == quit)
+            {
+                return;
+            }
+            ts.putback(t);
+            clock = Statement_clock();
+            Statement_budget budget(statement_limits);
+            if (definition(ts))
+            {
+                clock.stop("definition");
+                continue; // nothing to write
+            }
+            Value d = statement(ts); // before writing result: integrate() and solve() report to cerr
+            write_result(d);
+            clock.stop(t.kind == let ? "declaration" : "statement");
+        }
+        catch (const std::exception &e)
+        {
+            cerr << e.what() << endl; // write error message
+            if (instrumented)
+                instruments().error(e.what());
+            clean_up_mess();
+            clock.stop("error");
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+// the value following option args[i]
+string option_value(const vector<string> &args, int &i)
+{
+    if (int(args.size()) <= i + 1)
+        error("value expected after ", args[i]);
+    return args[++i];
+}
+
+//------------------------------------------------------------------------------
+// the options shared by --sweep and --distribute
+class Sweep_options
+{
+public:
+    string expression;
+    Grid grid;
+    string output; // file name; empty for cout
+    bool binary = false;
+    int threads = 0;        // --sweep: 0 for one per core (the main thread writes, and helps)
+    long block_size = 4096; // --sweep: points per task
+    Evaluation evaluation = Evaluation::point; // --sweep: --batch or --float
+    Distributed_sweep job;  // --distribute
+};
+
+//------------------------------------------------------------------------------
+Sweep_options sweep_options(const vector<string> &args)
+{
+    Sweep_options o;
+    for (int i = 1; i < int(args.size()); ++i)
+    {
+        if (args[i] == "--output")
+            o.output = option_value(args, i);
+        else if (args[i] == "--binary")
+            o.binary = true;
+        else if (args[i] == "--threads")
+            o.threads = stoi(option_value(args, i));
+        else if (args[i] == "--block-size")
+            o.block_size = stol(option_value(args, i));
+        else if (args[i] == "--batch")
+            o.evaluation = Evaluation::batch_double;
+        else if (args[i] == "--float")
+            o.evaluation = Evaluation::batch_float;
+        else if (args[i] == "--workers")
+            o.job.local_workers = stoi(option_value(args, i));
+        else if (args[i] == "--shard-size")
+            o.job.shard_size = stol(option_value(args, i));
+        else if (args[i] == "--listen")
+            o.job.address = option_value(args, i);
+        else if (args[i] == "--crash-after")
+            o.job.crash_after = stoi(option_value(args, i));
+        else if (o.expression.empty())
+            o.expression = args[i];
+        else
+            o.grid.ranges.push_back(parse_range(args[i]));
+    }
+    if (o.expression.empty() || o.grid.ranges.empty())
+        error("usage: calculator " + args[0], " expression var=from:to:step...");
+    if (o.block_size < 1 || o.job.shard_size < 1 || o.threads < 0)
+        error("block size, shard size and threads must be positive");
+    return o;
+}
+
+//------------------------------------------------------------------------------
+// the file (or cout) and the writer for the results of a sweep
+class Sweep_output
+{
+public:
+    explicit Sweep_output(const Sweep_options &o);
+    Sweep_writer &writer() { return *w; }
+
+private:
+    ofstream file;
+    unique_ptr<Sweep_writer> w;
+};
+
+//------------------------------------------------------------------------------
+Sweep_output::Sweep_output(const Sweep_options &o)
+{
+    if (!o.output.empty())
+    {
+        file.open(o.output, o.binary ? ios_base::binary : ios_base::out);
+        if (!file)
+            error("can't open output file ", o.output);
+    }
+    ostream &os = o.output.empty() ? cout : file;
+    if (o.binary)
+        w = make_unique<Binary_writer>(os, o.grid, o.evaluation == Evaluation::batch_float);
+    else
+        w = make_unique<Csv_writer>(os, o.grid);
+}
+
+//------------------------------------------------------------------------------
+// calculator --sweep expression range... [--threads n] [--block-size n]
+//            [--output file] [--binary] [--batch | --float]
+// evaluate expression at every point of the grid given by the ranges
+// (var=from:to:step), on a pool of threads; write a CSV table (or with
+// --binary the values as doubles, see Binary_writer) to file (default: cout).
+// --batch evaluates batches of points (see batch.h); --float does so in float,
+// and --binary then writes floats
+int sweep(const vector<string> &args)
+{
+    Sweep_options o = sweep_options(args);
+    Code code = compile(o.expression);
+    unique_ptr<Work_stealing_pool> own_pool;
+    if (o.threads)
+        own_pool = make_unique<Work_stealing_pool>(o.threads);
+    Work_stealing_pool &pool = own_pool ? *own_pool : default_pool();
+    Sweep_output out(o);
+
+    Sweep_statistics stats = run_sweep(code, o.grid, pool, o.block_size, out.writer(), o.evaluation);
+    cerr << stats.points << " points in " << stats.blocks << " blocks on " << pool.size()
+         << " threads, " << stats.seconds << " s, " << stats.points / stats.seconds
+         << " points/s; " << stats.errors << " points with errors\n";
+    return 0;
+}
+
+//------------------------------------------------------------------------------
+// calculator --csv expression input [--output file] [--column name] [--chunk-size bytes]
+// evaluate expression for each row of the CSV file input, whose header names
+// the columns that give the variables their values; write a column of the
+// values, headed name (default: value), to file (default: cout). See csv_pipeline.h
+int csv(const vector<string> &args)
+{
+    string expression;
+    string input;
+    string output;
+    string column = "value";
+    long chunk_size = 1 << 20;
+    for (int i = 1; i < int(args.size()); ++i)
+        if (args[i] == "--output")
+            output = option_value(args, i);
+        else if (args[i] == "--column")
+            column = option_value(args, i);
+        else if (args[i] == "--chunk-size")
+            chunk_size = stol(option_value(args, i));
+        else if (expression.empty())
+            expression = args[i];
+        else if (input.empty())
+            input = args[i];
+        else
+            error("unknown option ", args[i]);
+    if (input.empty())
+        error("usage: calculator --csv expression input [--output file] [--column name] [--chunk-size bytes]");
+    if (chunk_size < 1)
+        error("the chunk size must be positive");
+
+    Code code = compile(expression);
+    Csv_chunk_reader in(input, chunk_size);
+    ofstream file;
+    if (!output.empty())
+    {
+        file.open(output);
+        if (!file)
+            error("can't open output file ", output);
+    }
+    Csv_pipeline_result r = run_csv_pipeline(code, in, output.empty() ? cout : file, column);
+    cerr << r.rows << " rows, " << r.bytes / 1e6 << " MB in " << r.seconds << " s, " << r.rows / r.seconds
+         << " rows/s, " << r.bytes / r.seconds / 1e6 << " MB/s; " << r.errors << " rows with errors\n";
+    return 0;
+}
+
+//------------------------------------------------------------------------------
+// how far float evaluation of one expression strays from double
+class Float_error
+{
+public:
+    double max_absolute = 0;
+    double max_relative = 0; // where the double value isn't 0
+    long worst = -1;         // the point with the largest relative error
+    long nan_mismatches = 0; // points that are NaN in one precision only
+    double seconds[3] = {0, 0, 0}; // for each Evaluation
+};
+
+//------------------------------------------------------------------------------
+// compare the float and double values of code at every point of grid,
+// evaluating in blocks so that memory use doesn't depend on the size of the grid
+Float_error float_error(const Code &code, const Grid &grid)
+{
+    Float_error e;
+    const Evaluation modes[3] = {Evaluation::point, Evaluation::batch_double, Evaluation::batch_float};
+    const long block = 1 << 14;
+    vector<vector<double>> values(2, vector<double>(block)); // point by point, and double batches
+    vector<float> floats(block);                             // float batches keep their floats
+    long points = grid.size();
+    for (long first = 0; first < points; first += block)
+    {
+        long n = min(block, points - first);
+        for (int m = 0; m < 3; ++m)
+        {
+            auto start = chrono::steady_clock::now();
+            Sweep sweep(code, grid, modes[m]);
+            if (modes[m] == Evaluation::batch_float)
+                sweep.evaluate(first, n, floats.data());
+            else
+                sweep.evaluate(first, n, values[m].data());
+            chrono::duration<double> t = chrono::steady_clock::now() - start;
+            e.seconds[m] += t.count();
+        }
+        for (long i = 0; i < n; ++i)
+        {
+            double d = values[0][i];
+            double f = floats[i];
+            if (isnan(d) != isnan(f))
+                ++e.nan_mismatches;
+            if (isnan(d) || isnan(f) || isinf(d))
+                continue;
+            double absolute = abs(f - d);
+            e.max_absolute = max(e.max_absolute, absolute);
+            if (d != 0 && e.max_relative < absolute / abs(d))
+            {
+                e.max_relative = absolute / abs(d);
+                e.worst = first + i;
+            }
+        }
+    }
+    return e;
+}
+
+//------------------------------------------------------------------------------
+// calculator --compare-float corpus range...
+// for each expression in the file corpus (one per line; # starts a comment
+// line), evaluate it at every point of the grid in double and in float, and
+// report the largest error of float and the speed of each kind of evaluation
+int compare_float(const vector<string> &args)
+{
+    if (args.size() < 3)
+        error("usage: calculator --compare-float corpus var=from:to:step...");
+    ifstream corpus(args[1]);
+    if (!corpus)
+        error("can't open ", args[1]);
+    Grid grid;
+    for (int i = 2; i < int(args.size()); ++i)
+        grid.ranges.push_back(parse_range(args[i]));
+    long points = grid.size();
+
+    double max_absolute = 0;
+    double max_relative = 0;
+    vector<double> point(grid.ranges.size());
+    for (string line; getline(corpus, line);)
+    {
+        if (line.empty() || line[0] == '#')
+            continue;
+        try
+        {
+            Code code = compile(line);
+            Float_error e = float_error(code, grid);
+            max_absolute = max(max_absolute, e.max_absolute);
+            max_relative = max(max_relative, e.max_relative);
+            cout << line << ": max absolute error " << e.max_absolute << ", max relative error "
+                 << e.max_relative;
+            if (0 <= e.worst)
+            {
+                grid.point(e.worst, point.data());
+                cout << " at";
+                for (int r = 0; r < int(grid.ranges.size()); ++r)
+                    cout << ' ' << grid.ranges[r].var << '=' << point[r];
+            }
+            if (e.nan_mismatches)
+                cout << ", " << e.nan_mismatches << " points NaN in one precision only";
+            cout << "; points/s: " << points / e.seconds[0] << " (double), " << points / e.seconds[1]
+                 << " (double batches), " << points / e.seconds[2] << " (float batches)"
+                 << (Batch_evaluator<float>::can_run(code) ? "" : " (not batchable: all point by point)")
+                 << '\n';
+        }
+        catch (exception &x)
+        {
+            cout << line << ": " << x.what() << '\n';
+        }
+    }
+    cout << "corpus: max absolute error " << max_absolute << ", max relative error " << max_relative
+         << " (float epsilon " << numeric_limits<float>::epsilon() << ")\n";
+    return 0;
+}
+
+//------------------------------------------------------------------------------
+// calculator --monte-carlo expression variable... [--samples n] [--seed s] [--threads n]
+// estimate the mean of expression when its variables are random
+// (var=uniform:a:b, var=normal:mean:sd, or var=value; see monte_carlo.h)
+int monte_carlo(const vector<string> &args)
+{
+    string expression;
+    vector<Random_variable> variables;
+    long samples = 1000000;
+    uint64_t seed = 1;
+    int threads = 0; // 0 for one per core
+    for (int i = 1; i < int(args.size()); ++i)
+    {
+        if (args[i] == "--samples")
+            samples = stol(option_value(args, i));
+        else if (args[i] == "--seed")
+            seed = stoull(option_value(args, i));
+        else if (args[i] == "--threads")
+            threads = stoi(option_value(args, i));
+        else if (expression.empty())
+            expression = args[i];
+        else
+            variables.push_back(parse_random_variable(args[i]));
+    }
+    if (expression.empty())
+        error("usage: calculator --monte-carlo expression var=uniform:a:b|normal:mean:sd...");
+    if (threads < 0)
+        error("threads must be positive");
+
+    Code code = compile(expression);
+    unique_ptr<Work_stealing_pool> own_pool;
+    if (threads)
+        own_pool = make_unique<Work_stealing_pool>(threads);
+    Work_stealing_pool &pool = own_pool ? *own_pool : default_pool();
+    Monte_carlo_result r = run_monte_carlo(code, variables, samples, seed, pool);
+
+    const Moments &m = r.moments;
+    cout << setprecision(numeric_limits<double>::max_digits10) // to compare runs exactly
+         << "mean " << m.mean << "\nvariance " << m.variance() << "\n95% confidence interval ["
+         << m.mean - r.half_width() << ", " << m.mean + r.half_width() << "]\n";
+    cerr << m.n << " samples on " << pool.size() << " threads, " << r.seconds << " s, "
+         << m.n / r.seconds << " samples/s; " << r.errors << " samples with errors\n";
+    return 0;
+}
+
+//------------------------------------------------------------------------------
+// calculator --gradient expression var=value... [--wrt var,var...] [--reverse]
+// the value of expression and its partial derivatives with respect to the
+// variables given after --wrt (default: all of them), in forward mode or,
+// with --reverse, in reverse mode (see autodiff.h)
+int gradient(const vector<string> &args)
+{
+    string expression;
+    vector<pair<string, double>> point;
+    vector<string> wrt;
+    bool reverse = false;
+    for (int i = 1; i < int(args.size()); ++i)
+    {
+        if (args[i] == "--reverse")
+            reverse = true;
+        else if (args[i] == "--wrt")
+        {
+            istringstream names(option_value(args, i));
+            for (string n; getline(names, n, ',');)
+                if (find(wrt.begin(), wrt.end(), n) == wrt.end())
+                    wrt.push_back(n);
+        }
+        else if (expression.empty())
+            expression = args[i];
+        else
+        {
+            size_t eq = args[i].find('=');
+            if (eq == string::npos || eq == 0)
+                error("var=value expected: ", args[i]);
+            point.push_back(make_pair(args[i].substr(0, eq), stod(args[i].substr(eq + 1))));
+        }
+    }
+    if (expression.empty())
+        error("usage: calculator --gradient expression var=value... [--wrt var,...] [--reverse]");
+    if (wrt.empty())
+        for (const auto &p : point)
+            wrt.push_back(p.first);
+
+    Code code = compile(expression);
+    vector<double> values(code.names.size());
+    for (int i = 0; i < int(code.names.size()); ++i)
+    {
+        auto p = find_if(point.begin(), point.end(), [&](const pair<string, double> &v) { return v.first == code.names[i]; });
+        if (p != point.end())
+            values[i] = p->second;
+        else if (!code.is_bound(i))
+            error("no value given for variable ", code.names[i]);
+    }
+    vector<int> slots;
+    for (const string &n : wrt)
+    {
+        int i = find(code.names.begin(), code.names.end(), n) - code.names.begin();
+        if (i == int(code.names.size()))
+            error(n, " is not a variable of the expression");
+        slots.push_back(i);
+    }
+
+    auto start = chrono::steady_clock::now();
+    Gradient g = reverse ? reverse_gradient(code, values, slots) : forward_gradient(code, values, slots);
+    chrono::duration<double, micro> t = chrono::steady_clock::now() - start;
+    cout << setprecision(numeric_limits<double>::max_digits10) << "value " << g.value << '\n';
+    for (int k = 0; k < int(wrt.size()); ++k)
+        cout << "d/d" << wrt[k] << ' ' << g.partials[k] << '\n';
+    cerr << (reverse ? "reverse" : "forward") << " mode, " << wrt.size() << " variables, " << t.count() << " us";
+    if (reverse)
+        cerr << ", tape of " << g.tape_nodes << " nodes";
+    cerr << '\n';
+    return 0;
+}
+
+//------------------------------------------------------------------------------
+// calculator --distribute expression range... [--workers n] [--shard-size n]
+//            [--listen address] [--output file] [--binary] [--crash-after n]
+// like --sweep, but using worker processes, which may be on other hosts
+int distribute(const vector<string> &args, const string &program)
+{
+    Sweep_options o = sweep_options(args);
+    Distributed_sweep &job = o.job;
+    job.program = program;
+    job.expression = o.expression;
+    job.grid = o.grid;
+    Code code = compile(job.expression); // find mistakes before starting any workers
+    Sweep check(code, job.grid);
+    Sweep_output out(o);
+
+    run_coordinator(job, [&](long first, const double *values, long n) {
+        out.writer().write(first, values, n);
+    });
+
+    long points = job.grid.size();
+    cerr << points << " points in " << job.shards << " shards, " << job.seconds << " s, "
+         << points / job.seconds << " points/s; " << job.requeued << " shards requeued, "
+         << job.errors << " points with errors\n";
+    return 0;
+}
+
+//------------------------------------------------------------------------------
+// the tokens of an expression, up to the print or quit that ends it
+vector<Token> tokenize(const string &s)
+{
+    istringstream is(s);
+    Token_stream tokens(is);
+    vector<Token> v;
+    for (Token t = tokens.get(); t.kind != print && t.kind != quit; t = tokens.get())
+        v.push_back(t);
+    return v;
+}
+
+//------------------------------------------------------------------------------
+void put_tokens(Message &m, const vector<Token> &tokens)
+{
+    m.put(uint32_t(tokens.size()));
+    for (const Token &t : tokens)
+    {
+        m.put(t.kind);
+        if (t.kind == number)
+            m.put(t.value);
+        else if (t.kind == name)
+            m.put_string(t.name);
+    }
+}
+
+//------------------------------------------------------------------------------
+// read tokens (see put_tokens()) into ts, ready to be read by the grammar functions
+void get_tokens(Message_reader &r, Token_stream &ts)
+{
+    uint32_t n = r.get<uint32_t>();
+    vector<Token> tokens;
+    for (uint32_t i = 0; i < n; ++i)
+    {
+        char kind = r.get<char>();
+        if (kind == number)
+            tokens.push_back(Token(kind, r.get<double>()));
+        else if (kind == name)
+            tokens.push_back(Token(kind, r.get_string()));
+        else
+            tokens.push_back(Token(kind));
+    }
+    ts.putback(Token(print)); // the buffer is a stack: the last token goes in first
+    for (int i = tokens.size() - 1; 0 <= i; --i)
+        ts.putback(tokens[i]);
+}
+
+//------------------------------------------------------------------------------
+// run code once for each row of b; names that b doesn't bind come from var_table
+Message evaluate_rows(const Code &code, const Bindings &b)
+{
+    int n = code.names.size();
+    int columns = b.names.size();
+    vector<int> column(n, -1); // where slot i gets its value: a column of b, or -1 for var_table
+    vector<Value> slots(n);
+    bool matrices = code.uses_matrices;
+    for (int i = 0; i < n; ++i)
+    {
+        for (int c = 0; c < columns; ++c)
+            if (b.names[c] == code.names[i])
+                column[i] = c;
+        if (0 <= column[i])
+            continue;
+        if (is_declared(code.names[i]))
+            slots[i] = get_value(code.names[i]);
+        else if (!code.is_bound(i))
+            error("get: undefined variable ", code.names[i]);
+        if (slots[i].is_matrix())
+            matrices = true;
+    }
+
+    vector<double> numbers(n);
+    for (int i = 0; i < n; ++i)
+        numbers[i] = slots[i].number;
+    vector<double> values(b.rows);
+    int64_t errors = 0;
+    for (long row = 0; row < b.rows; ++row)
+    {
+        const double *bound = b.values.data() + row * columns;
+        try
+        {
+            if (matrices)
+            {
+                for (int i = 0; i < n; ++i)
+                    if (0 <= column[i])
+                        slots[i] = bound[column[i]];
+                values[row] = run(code, 0, slots.data()).scalar();
+            }
+            else
+            {
+                for (int i = 0; i < n; ++i)
+                    if (0 <= column[i])
+                        numbers[i] = bound[column[i]];
+                values[row] = run(code, 0, numbers.data());
+            }
+        }
+        catch (Budget_exceeded &)
+        {
+            throw; // the whole request is over
+        }
+        catch (exception &)
+        {
+            ++errors; // e.g. divide by zero in this row
+            values[row] = numeric_limits<double>::quiet_NaN();
+        }
+    }
+
+    Message reply;
+    reply.type = values_reply;
+    reply.put(uint32_t(b.rows));
+    reply.put(errors);
+    reply.put_bytes(values.data(), values.size() * sizeof(double));
+    return reply;
+}
+
+//------------------------------------------------------------------------------
+// answer a request (see wire.h) of the given type; r reads its payload
+Message answer(char type, Message_reader &r)
+try
+{
+    Statement_budget budget(statement_limits);
+    Code bytecode;
+    shared_ptr<Code> compiled;
+    if (type == text_request || type == tokens_request)
+    {
+        istringstream is(type == text_request ? r.get_string() : string());
+        Token_stream tokens(is);
+        if (type == tokens_request)
+            get_tokens(r, tokens);
+        compiled = compile(tokens, plans);
+        Token t = tokens.get();
+        if (t.kind != print && t.kind != quit)
+            error("unexpected input after the expression");
+    }
+    else if (type == bytecode_request)
+        bytecode = get_code(r);
+    else
+        error("unknown request");
+
+    Bindings b = get_bindings(r);
+    if (!r.at_end())
+        error("request too long");
+    return evaluate_rows(compiled ? *compiled : bytecode, b);
+}
+catch (exception &e)
+{
+    Message reply;
+    reply.type = error_reply;
+    reply.put_string(e.what());
+    return reply;
+}
+
+Message answer(const Message &request)
+{
+    Message_reader r(request);
+    return answer(request.type, r);
+}
+
+//------------------------------------------------------------------------------
+// calculator --serve address
+// answer requests (see wire.h) from clients connecting to address
+int serve(const vector<string> &args)
+{
+    if (args.size() != 2)
+        error("usage: calculator --serve address");
+    Channel listener(listen_at(args[1]));
+    serve(listener.fd(), [](const Message &m) { return answer(m); });
+    if (args[1].compare(0, 5, "unix:") == 0)
+        unlink(args[1].substr(5).c_str());
+    return 0;
+}
+
+//------------------------------------------------------------------------------
+// calculator --wire-benchmark [requests]
+// send the same requests as text, as tokens, and as bytecode to a server on a
+// Unix socket and report requests/s; then bytecode with many rows per request
+int wire_benchmark(const vector<string> &args)
+{
+    long requests = 1 < args.size() ? stol(args[1]) : 100000;
+    const long window = 32; // requests sent before waiting for answers
+    const string text = "price*(1+rate)-fee*2.5+price/12";
+    const vector<Token> tokens = tokenize(text);
+    const Code bytecode = compile(text); // before the server starts: it uses plans too
+
+    string address = "unix:/tmp/calculator-wire-" + to_string(getpid()) + ".sock";
+    Channel listener(listen_at(address));
+    thread server([&] { serve(listener.fd(), [](const Message &m) { return answer(m); }); });
+    Channel channel(connect_to(address));
+
+    Bindings b;
+    b.names = {"price", "rate", "fee"};
+    auto request = [&](char type, long i, long rows) {
+        Message m;
+        m.type = type;
+        if (type == text_request)
+            m.put_string(text);
+        else if (type == tokens_request)
+            put_tokens(m, tokens);
+        else
+            put_code(m, bytecode);
+        b.rows = rows;
+        b.values.resize(rows * 3);
+        for (long r = 0; r < rows; ++r)
+        {
+            b.values[3 * r] = 100 + (i + r) % 100;
+            b.values[3 * r + 1] = 0.01 * ((i + r) % 7);
+            b.values[3 * r + 2] = (i + r) % 3;
+        }
+        put_bindings(m, b);
+        return m;
+    };
+    auto time = [&](const string &label, char type, long count, long rows) {
+        auto start = chrono::steady_clock::now();
+        double sum = 0;
+        long sent = 0;
+        long in_flight = max(1L, window / rows); // big requests one at a time: the socket buffers are small
+        Message m;
+        for (long done = 0; done < count; ++done)
+        {
+            while (sent < count && sent < done + in_flight)
+                if (!channel.send(request(type, sent++ * rows, rows)))
+                    error("server gone");
+            if (!channel.receive(m) || m.type != values_reply)
+                error("bad answer from server");
+            Message_reader r(m);
+            uint32_t n = r.get<uint32_t>();
+            r.get<int64_t>();
+            for (uint32_t k = 0; k < n; ++k)
+                sum += r.get<double>();
+        }
+        chrono::duration<double> t = chrono::steady_clock::now() - start;
+        cout << label << count / t.count() << " requests/s, " << count * rows / t.count()
+             << " evaluations/s, " << t.count() / count * 1e6 << " us/request (sum "
+             << setprecision(15) << sum << setprecision(6) << ")\n";
+    };
+
+    cout << requests << " requests of " << text << " over " << address << "\n";
+    time("text:               ", text_request, requests, 1);
+    time("tokens:             ", tokens_request, requests, 1);
+    time("bytecode:           ", bytecode_request, requests, 1);
+    time("bytecode, 1000 rows:", bytecode_request, requests / 1000, 1000);
+
+    Message stop;
+    stop.type = stop_request;
+    channel.send(stop);
+    server.join();
+    unlink(address.substr(5).c_str());
+    return 0;
+}
+
+//------------------------------------------------------------------------------
+// calculator --serve-shared name
+// answer requests (see wire.h) from one client on this host through the
+// shared memory region name (say /calculator; see shm_ring.h)
+int serve_shared(const vector<string> &args)
+{
+    if (args.size() != 2)
+        error("usage: calculator --serve-shared name");
+    Shared_region region(args[1], true);
+    serve(region, [](char type, Message_reader &r) { return answer(type, r); });
+    return 0;
+}
+
+//------------------------------------------------------------------------------
+// calculator --shm-benchmark [requests]
+// round trips of one bytecode request at a time, through a Unix socket and
+// through shared memory: median, 99th percentile, and mean latency; then
+// shared memory with many requests in flight, answered in batches
+int shm_benchmark(const vector<string> &args)
+{
+    long requests = 1 < args.size() ? stol(args[1]) : 100000;
+    const long window = 32; // requests in flight for the batches
+    const string text = "price*(1+rate)-fee*2.5+price/12";
+    const Code bytecode = compile(text); // before the servers start: they use plans too
+
+    vector<Message> samples(64); // made beforehand: we time the transport, not put_code()
+    Bindings b;
+    b.names = {"price", "rate", "fee"};
+    b.rows = 1;
+    for (int i = 0; i < int(samples.size()); ++i)
+    {
+        samples[i].type = bytecode_request;
+        put_code(samples[i], bytecode);
+        b.values = {100.0 + i, 0.01 * (i % 7), double(i % 3)};
+        put_bindings(samples[i], b);
+    }
+    auto value = [](char type, const char *p, uint32_t n) {
+        if (type != values_reply)
+            error("bad answer from server");
+        Message_reader r(p, n);
+        r.get<uint32_t>();
+        r.get<int64_t>();
+        return r.get<double>();
+    };
+    auto report = [](const string &label, vector<double> &us, double sum) {
+        sort(us.begin(), us.end());
+        double total = 0;
+        for (double t : us)
+            total += t;
+        cout << label << "median " << us[us.size() / 2] << " us, 99% " << us[us.size() * 99 / 100]
+             << " us, mean " << total / us.size() << " us (sum " << setprecision(15) << sum
+             << setprecision(6) << ")\n";
+    };
+    vector<double> us(requests);
+    cout << requests << " round trips of " << text << "\n";
+
+    string address = "unix:/tmp/calculator-shm-" + to_string(getpid()) + ".sock";
+    {
+        Channel listener(listen_at(address));
+        thread server([&] { serve(listener.fd(), [](const Message &m) { return answer(m); }); });
+        Channel channel(connect_to(address));
+        double sum = 0;
+        Message m;
+        for (long i = 0; i < requests; ++i)
+        {
+            auto start = chrono::steady_clock::now();
+            if (!channel.send(samples[i % samples.size()]) || !channel.receive(m))
+                error("server gone");
+            us[i] = chrono::duration<double, micro>(chrono::steady_clock::now() - start).count();
+            sum += value(m.type, m.payload.data(), m.payload.size());
+        }
+        Message stop;
+        stop.type = stop_request;
+        channel.send(stop);
+        server.join();
+        unlink(address.substr(5).c_str());
+        report("unix socket:   ", us, sum);
+    }
+
+    string name = "/calculator-" + to_string(getpid());
+    Shared_region region(name, true);
+    thread server([&] { serve(region, [](char type, Message_reader &r) { return answer(type, r); }); });
+    Shared_region client(name, false); // a mapping of its own, as another process would have
+    Ring to_server = client.requests();
+    Ring from_server = client.replies();
+    auto send = [&](long i) {
+        const Message &m = samples[i % samples.size()];
+        to_server.write(m.type, m.payload.data(), m.payload.size());
+    };
+    auto receive = [&] {
+        from_server.wait();
+        char type = 0;
+        uint32_t n = 0;
+        const char *p = from_server.next(type, n);
+        double d = value(type, p, n);
+        from_server.consume();
+        return d;
+    };
+
+    double sum = 0;
+    for (long i = 0; i < requests; ++i)
+    {
+        auto start = chrono::steady_clock::now();
+        send(i);
+        sum += receive();
+        us[i] = chrono::duration<double, micro>(chrono::steady_clock::now() - start).count();
+    }
+    report("shared memory: ", us, sum);
+
+    auto start = chrono::steady_clock::now();
+    sum = 0;
+    long sent = 0;
+    for (long done = 0; done < requests; ++done)
+    {
+        while (sent < requests && sent < done + window)
+            send(sent++);
+        sum += receive();
+    }
+    chrono::duration<double> t = chrono::steady_clock::now() - start;
+    cout << "shared memory, " << window << " in flight: " << requests / t.count() << " requests/s, "
+         << t.count() / requests * 1e6 << " us/request (sum " << setprecision(15) << sum
+         << setprecision(6) << ")\n";
+
+    to_server.write(stop_request, "", 0);
+    server.join();
+    return 0;
+}
+
+//------------------------------------------------------------------------------
+// statements of a few shapes with different numbers, and now and then one of a
+// shape not seen before: traffic in which the plan cache mostly hits
+string plan_traffic(long statements)
+{
+    const vector<string> shapes = {
+        "price*#;", "price*(1+#);", "price*rate*#-#;", "(price-#)/(rate+#);",
+        "price*#+rate*#+#;", "-(price*#)/(rate+#);", "[price*#, rate+#]'*[#, #];", "integrate(x*#, x, 0, #, 1);",
+    };
+    ostringstream os;
+    unsigned seed = 12345;
+    auto next_number = [&] { seed = seed * 1103515245 + 12345; return (seed >> 8) % 10000 / 100.0 + 1; };
+    for (long i = 0; i < statements; ++i)
+    {
+        string shape = shapes[i % shapes.size()];
+        if (i % 50 == 49) // a new shape: a sum of a length we haven't had yet
+        {
+            shape = "(price";
+            for (long k = 0; k < i / 50 % 40 + 1; ++k)
+                shape += "+#";
+            shape += ")" + string(i / 2000, '\'') + ";";
+        }
+        for (char c : shape)
+            if (c == '#')
+                os << next_number();
+            else
+                os << c;
+        os << '\n';
+    }
+    return os.str();
+}
+
+//------------------------------------------------------------------------------
+// a number to add up to compare results: a number, or the first element of a matrix
+double checksum(const Value &v)
+{
+    return v.is_matrix() ? (*v.matrix)(0, 0) : v.number;
+}
+
+//------------------------------------------------------------------------------
+// compile every statement in text, with cache (or without, if cache is null), and
+// run it unless compile_only; return the sum of the values, to compare results
+double run_traffic(const string &text, Plan_cache *cache, bool compile_only)
+{
+    istringstream is(text);
+    Token_stream tokens(is);
+    double sum = 0;
+    while (true)
+    {
+        Token t = tokens.get();
+        if (t.kind == quit)
+            return sum;
+        tokens.putback(t);
+        shared_ptr<Code> code;
+        if (cache)
+            code = compile(tokens, *cache);
+        else
+        {
+            code = make_shared<Code>();
+            expression(tokens, *code);
+            code->emit(Opcode::end);
+        }
+        sum += compile_only ? code->constants.size() : checksum(evaluate(*code));
+        expect(tokens, print, "';'");
+    }
+}
+
+//------------------------------------------------------------------------------
+// calculator --plan-benchmark [statements]
+// compile (and then compile and run) the same traffic without a plan cache, with
+// one, and with one that is too small for all the shapes; reading the characters
+// is the same in all cases, so only the part spent parsing can be saved
+int plan_benchmark(const vector<string> &args)
+{
+    long statements = 1 < args.size() ? stol(args[1]) : 200000;
+    define_name("price", 19.99);
+    define_name("rate", 3); // not qty: a q starts the quit token
+    string text = plan_traffic(statements);
+
+    auto time = [&](const string &label, Plan_cache *cache) {
+        auto start = chrono::steady_clock::now();
+        run_traffic(text, cache, true);
+        chrono::duration<double> compiling = chrono::steady_clock::now() - start;
+        if (cache) // count the second pass only
+            cache->hits = cache->misses = cache->evictions = 0;
+        perf_counters().start();
+        start = chrono::steady_clock::now();
+        double sum = run_traffic(text, cache, false);
+        chrono::duration<double> t = chrono::steady_clock::now() - start;
+        Perf_sample counts = perf_counters().stop();
+        cout << label << statements / compiling.count() << " compiled/s, "
+             << statements / t.count() << " compiled and run/s";
+        if (cache)
+            cout << "; " << cache->hits << " hits, " << cache->misses << " misses ("
+                 << 100.0 * cache->hits / (cache->hits + cache->misses) << "% hits), "
+                 << cache->evictions << " evictions, " << cache->size() << " plans in "
+                 << cache->bytes() << " of " << cache->max_bytes << " bytes";
+        cout << " (sum " << setprecision(15) << sum << setprecision(6) << ")\n";
+        if (perf_counters().available()) // per statement compiled and run
+            cout << "                " << counts.report(statements) << '\n';
+    };
+
+    cout << statements << " statements, " << text.size() << " characters\n" << perf_counters().status() << '\n';
+    time("no cache:      ", nullptr);
+    Plan_cache big;
+    time("cache (1 MB):  ", &big);
+    Plan_cache small(16 * 1024);
+    time("cache (16 KB): ", &small);
+    return 0;
+}
+
+//------------------------------------------------------------------------------
+// calculator --budget limit=value...
+// the ordinary calculator, with other limits for each statement (see budget.h):
+// tokens, depth, steps, seconds, elements
+int limited(const vector<string> &args)
+{
+    for (int i = 1; i < int(args.size()); ++i)
+    {
+        istringstream is(args[i]);
+        string limit;
+        double value;
+        if (!getline(is, limit, '=') || !(is >> value) || value <= 0)
+            error("limit=value expected: ", args[i]);
+        if (limit == "tokens")
+            statement_limits.tokens = value;
+        else if (limit == "depth")
+            statement_limits.depth = value;
+        else if (limit == "steps")
+            statement_limits.steps = value;
+        else if (limit == "seconds")
+            statement_limits.seconds = value;
+        else if (limit == "elements")
+            statement_limits.elements = value;
+        else
+            error("unknown limit ", limit);
+    }
+    calculate();
+    return 0;
+}
+
+//------------------------------------------------------------------------------
+// compile one statement into image; like statement(), but nothing is run
+void compile_statement(Token_stream &ts, Image_writer &image)
+{
+    if (definition(ts)) // the statements after it need it to compile
+    {
+        image.add(Statement_kind::definition, "", nullptr);
+        return;
+    }
+    Token t = ts.get();
+    if (t.kind == let)
+    {
+        Token n = ts.get();
+        if (n.kind != name)
+            error("name expected in declaration");
+        if (ts.get().kind != '=')
+            error("= missing in declaration of ", n.name);
+        image.add(Statement_kind::declaration, n.name, compile(ts, plans).get());
+        return;
+    }
+    if (t.kind == name)
+    {
+        Token t2 = ts.get();
+        if (t2.kind == '=')
+        {
+            image.add(Statement_kind::assignment, t.name, compile(ts, plans).get());
+            return;
+        }
+        ts.putback(t2);
+    }
+    ts.putback(t);
+    image.add(Statement_kind::expression, "", compile(ts, plans).get());
+}
+
+//------------------------------------------------------------------------------
+// compile a whole script into an image (see script_cache.h), reading it
+// statement by statement as calculate() would
+string compile_script(const string &text, uint64_t hash)
+{
+    istringstream is(text);
+    Token_stream ts(is);
+    Image_writer image(hash);
+    while (is)
+        try
+        {
+            Token t = ts.get();
+            while (t.kind == print)
+                t = ts.get();
+            if (t.kind == quit)
+                return image.finish(true);
+            ts.putback(t);
+            Statement_budget budget(statement_limits); // for the tokens and the nesting
+            compile_statement(ts, image);
+        }
+        catch (const std::exception &e)
+        {
+            image.add(Statement_kind::failed, e.what(), nullptr); // reported when the script runs
+            ts.ignore(print);
+        }
+    return image.finish(false);
+}
+
+//------------------------------------------------------------------------------
+// run statement i of image, which isn't a definition
+Value run_statement(const Script_image &image, int i, bool redeclare = false)
+{
+    if (image.kind(i) == Statement_kind::failed)
+        error(image.text(i));
+    Code_view code = image.code(i);
+    Function_state calls(code.function_count); // the image has nowhere to keep counts and memos
+    code.state = &calls;
+    switch (image.kind(i))
+    {
+    case Statement_kind::declaration:
+    {
+        Value d = evaluate(code);
+        if (redeclare) // run again in a scenario, see scenarios()
+        {
+            set_value(image.text(i), d);
+            return d;
+        }
+        return define_name(image.text(i), d);
+    }
+    case Statement_kind::assignment:
+    {
+        if (!is_declared(image.text(i)))
+            error(image.text(i), " has not been declared");
+        Value d = evaluate(code);
+        set_value(image.text(i), d);
+        return d;
+    }
+    default:
+        return evaluate(code);
+    }
+}
+
+//------------------------------------------------------------------------------
+// run a compiled script, writing what calculate() would write for its text
+// (results to out, errors to err); after an error, the script goes on with
+// the next statement. Returns the number of statements that failed
+int run_script(const Script_image &image, ostream &out = cout, ostream &err = cerr,
+               Number_formatter &format = result_format)
+{
+    int errors = 0;
+    for (int i = 0; i < image.size(); ++i)
+        try
+        {
+            out << prompt;
+            if (image.kind(i) == Statement_kind::definition)
+                continue; // compiled into the statements that call it
+            Statement_budget budget(statement_limits);
+            Value d = run_statement(image, i);
+            write_result(d, out, format);
+        }
+        catch (const std::exception &e)
+        {
+            err << e.what() << endl;
+            ++errors;
+        }
+    if (image.final_prompt())
+        out << prompt;
+    return errors;
+}
+
+//------------------------------------------------------------------------------
+// where compiled scripts are kept unless --cache says otherwise
+string default_cache_directory()
+{
+    if (const char *xdg = getenv("XDG_CACHE_HOME"))
+        return string(xdg) + "/calculator";
+    if (const char *home = getenv("HOME"))
+        return string(home) + "/.calculator-cache";
+    return "";
+}
+
+//------------------------------------------------------------------------------
+// the image of the script in path: from cache if it has one; else compiled,
+// and stored in cache for the next run
+unique_ptr<Script_image> load_script(const string &path, Script_cache *cache)
+{
+    string text;
+    uint64_t hash = 0;
+    if (cache)
+    {
+        if (unique_ptr<Script_image> image = cache->find(path, text, hash))
+            return image;
+    }
+    else
+    {
+        text = file_text(path);
+        hash = fnv1a(text.data(), text.size());
+    }
+    string compiled = compile_script(text, hash);
+    if (cache)
+        cache->store(hash, compiled);
+    return make_unique<Script_image>(move(compiled));
+}
+
+//------------------------------------------------------------------------------
+// calculator --run script [--cache directory | --no-cache]
+// run a script as if it were typed, starting from its compiled image
+int run_script(const vector<string> &args)
+{
+    if (args.size() < 2)
+        error("usage: calculator --run script [--cache directory | --no-cache]");
+    string directory = default_cache_directory();
+    for (int i = 2; i < int(args.size()); ++i)
+        if (args[i] == "--cache")
+            directory = option_value(args, i);
+        else if (args[i] == "--no-cache")
+            directory.clear();
+        else
+            error("unknown option ", args[i]);
+    unique_ptr<Script_cache> cache;
+    if (!directory.empty())
+        cache = make_unique<Script_cache>(directory);
+    run_script(*load_script(args[1], cache.get()));
+    return 0;
+}
+
+//------------------------------------------------------------------------------
+// calculator --scenarios script scenarios
+// what-if runs of a script: run it once, as --run does; then for each line of
+// the file scenarios, such as "price=12 rate=0.3", go back to the variables
+// the script left (an O(1) copy of var_table), set those named on the line,
+// and run the script again. This time its declarations assign their variables,
+// except the ones the line set, so all that is computed from those follows
+int scenarios(const vector<string> &args)
+{
+    if (args.size() != 3)
+        error("usage: calculator --scenarios script scenarios");
+    unique_ptr<Script_image> image = load_script(args[1], nullptr);
+    ifstream lines(args[2]);
+    if (!lines)
+        error("can't open scenarios ", args[2]);
+
+    cout << "base:\n";
+    int errors = run_script(*image);
+    const Persistent_map<Value> base = var_table; // every scenario starts from here
+    int count = 0;
+    for (string line; getline(lines, line);)
+    {
+        istringstream is(line);
+        map<string, double> changes; // the scenario's values
+        for (string a; is >> a;)
+        {
+            size_t eq = a.find('=');
+            if (eq == string::npos || eq == 0)
+                error("var=value expected: ", a);
+            changes[a.substr(0, eq)] = stod(a.substr(eq + 1));
+        }
+        if (changes.empty())
+            continue;
+
+        cout << "\nscenario " << ++count << ':';
+        for (const auto &v : changes)
+            cout << ' ' << v.first << '=' << v.second;
+        cout << '\n';
+        var_table = base;
+        try
+        {
+            for (const auto &v : changes)
+                set_value(v.first, v.second);
+        }
+        catch (const std::exception &e)
+        {
+            cerr << e.what() << endl; // not a variable of the script: skip the scenario
+            ++errors;
+            continue;
+        }
+        for (int i = 0; i < image->size(); ++i)
+            try
+            {
+                cout << prompt;
+                if (image->kind(i) == Statement_kind::definition)
+                    continue;
+                if (image->kind(i) == Statement_kind::declaration && changes.count(image->text(i)))
+                {
+                    write_result(get_value(image->text(i))); // the scenario's value
+                    continue;
+                }
+                Statement_budget budget(statement_limits);
+                write_result(run_statement(*image, i, true));
+            }
+            catch (const std::exception &e)
+            {
+                cerr << e.what() << endl;
+                ++errors;
+            }
+        if (image->final_prompt())
+            cout << prompt;
+    }
+    return errors ? 1 : 0;
+}
+
+//------------------------------------------------------------------------------
+// give this thread a new engine: no variables, no functions, and no plans
+// compiled for the functions of another script
+void reset_engine()
+{
+    var_table = Persistent_map<Value>();
+    restored.reset();
+    function_table.clear();
+    plans.clear();
+}
+
+//------------------------------------------------------------------------------
+class Batch_job // one script of calculator --batch
+{
+public:
+    string script;
+    string output;
+    int statements = 0;
+    int errors = 0;      // statements that failed
+    string failure;      // why the script couldn't be run at all, if it couldn't
+    double seconds = 0;
+};
+
+//------------------------------------------------------------------------------
+// the scripts named by args: files, the files of directories, and the lines of
+// --list files; options are skipped (i is the index of an option with a value)
+vector<string> batch_scripts(const vector<string> &args)
+{
+    vector<string> scripts;
+    auto add = [&](const string &path) {
+        if (!filesystem::is_directory(path))
+        {
+            scripts.push_back(path);
+            return;
+        }
+        vector<string> files;
+        for (const filesystem::directory_entry &e : filesystem::directory_iterator(path))
+            if (e.is_regular_file())
+                files.push_back(e.path().string());
+        sort(files.begin(), files.end()); // directory order is arbitrary
+        scripts.insert(scripts.end(), files.begin(), files.end());
+    };
+    for (int i = 1; i < int(args.size()); ++i)
+        if (args[i] == "--list")
+        {
+            ifstream list(option_value(args, i));
+            if (!list)
+                error("can't open list ", args[i]);
+            for (string line; getline(list, line);)
+                if (!line.empty())
+                    add(line);
+        }
+        else if (args[i] == "--output-dir" || args[i] == "--threads")
+            ++i;
+        else
+            add(args[i]);
+    return scripts;
+}
+
+//------------------------------------------------------------------------------
+// calculator --batch script-or-directory... [--list file] [--output-dir dir] [--threads n]
+// run many scripts, each as --run would run it but in an engine of its own
+// (see reset_engine()), on a pool of threads of their own (default: one per
+// core); small and large scripts balance as idle threads steal waiting
+// scripts. The
+// results and errors of script x go to dir/x.out (default dir: batch-output);
+// then a summary of each script's time and errors is written to cout
+int batch(const vector<string> &args)
+{
+    string directory = "batch-output";
+    int threads = 0;
+    for (int i = 1; i < int(args.size()); ++i)
+        if (args[i] == "--output-dir")
+            directory = option_value(args, i);
+        else if (args[i] == "--threads")
+            threads = stoi(option_value(args, i));
+        else if (args[i] == "--list")
+            ++i;
+    vector<string> scripts = batch_scripts(args);
+    if (scripts.empty())
+        error("usage: calculator --batch script-or-directory... [--list file] [--output-dir dir] [--threads n]");
+    if (threads < 0)
+        error("the number of threads must be positive");
+    filesystem::create_directories(directory);
+
+    vector<Batch_job> jobs(scripts.size());
+    map<string, int> outputs; // the script that writes each output, to catch two scripts named x
+    for (int i = 0; i < int(jobs.size()); ++i)
+    {
+        jobs[i].script = scripts[i];
+        jobs[i].output = directory + "/" + filesystem::path(scripts[i]).filename().string() + ".out";
+        if (!outputs.insert({jobs[i].output, i}).second)
+            error("two scripts would write ", jobs[i].output);
+    }
+
+    // not default_pool(): a script that waits for its integrate() runs other
+    // tasks of that pool meanwhile, and if one were a script, its reset_engine()
+    // would take this thread's variables and functions from under the first
+    Work_stealing_pool pool(threads ? threads : int(thread::hardware_concurrency()));
+    auto start = chrono::steady_clock::now();
+    Task_group group(pool);
+    for (Batch_job &job : jobs)
+        group.run([&job] {
+            auto start = chrono::steady_clock::now();
+            try
+            {
+                reset_engine();
+                ofstream out(job.output);
+                if (!out)
+                    error("can't open output file ", job.output);
+                unique_ptr<Script_image> image = load_script(job.script, nullptr);
+                Number_formatter format = result_format; // its buffer is this script's
+                for (int i = 0; i < image->size(); ++i)
+                    job.statements += image->kind(i) != Statement_kind::definition;
+                job.errors = run_script(*image, out, out, format);
+            }
+            catch (const std::exception &e)
+            {
+                job.failure = e.what();
+            }
+            job.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        });
+    group.wait();
+    chrono::duration<double> wall = chrono::steady_clock::now() - start;
+
+    long statements = 0, errors = 0, failures = 0;
+    double busy = 0;
+    cout << "  statements  errors        ms  script\n";
+    for (const Batch_job &job : jobs)
+    {
+        cout << setw(12) << job.statements << setw(8) << job.errors << setw(10) << job.seconds * 1e3 << "  "
+             << job.script;
+        if (!job.failure.empty())
+            cout << ": " << job.failure;
+        cout << '\n';
+        statements += job.statements;
+        errors += job.errors;
+        failures += !job.failure.empty();
+        busy += job.seconds;
+    }
+    cout << jobs.size() << " scripts (" << failures << " could not be run), " << statements << " statements, "
+         << errors << " errors; " << wall.count() << " s on " << pool.size() << " threads ("
+         << busy << " s of scripts), " << jobs.size() / wall.count() << " scripts/s\n";
+    return failures ? 1 : 0;
+}
+
+//------------------------------------------------------------------------------
+// calculator --script-benchmark [statements]
+// the time from starting a script until its first statement can run: without
+// a cache, compiling into an empty cache, and with the image in the cache;
+// for scripts of growing size
+int script_benchmark(const vector<string> &args)
+{
+    long largest = 1 < args.size() ? stol(args[1]) : 100000;
+    string directory = "/tmp/calculator-scripts-" + to_string(getpid());
+    string path = directory + ".txt";
+    auto startup = [&](Script_cache *cache, int &statements, Perf_sample &counts) {
+        plans.clear(); // a new process would start without plans
+        perf_counters().start();
+        auto start = chrono::steady_clock::now();
+        unique_ptr<Script_image> image = load_script(path, cache);
+        chrono::duration<double, milli> t = chrono::steady_clock::now() - start;
+        counts = perf_counters().stop();
+        statements = image->size();
+        return t.count();
+    };
+
+    cout << perf_counters().status() << '\n';
+    cout << "statements   bytes    no cache ms   first run ms   cached ms\n";
+    for (long n = 1000; n <= largest; n *= 10)
+    {
+        string text = "let price = 10; let rate = 0.25;\n" + plan_traffic(n);
+        write_file(path, text);
+        Script_cache cache(directory);
+        int statements = 0;
+        Perf_sample uncached_counts, first_counts, cached_counts;
+        double uncached = startup(nullptr, statements, uncached_counts);
+        double first = startup(&cache, statements, first_counts);
+        double cached = startup(&cache, statements, cached_counts);
+        cout << setw(10) << statements << setw(9) << text.size() << setw(14) << uncached << setw(15) << first
+             << setw(12) << cached << '\n';
+        if (perf_counters().available()) // per statement
+            cout << "    no cache: " << uncached_counts.report(statements) << "\n    cached:   "
+                 << cached_counts.report(statements) << '\n';
+    }
+    remove(path.c_str());
+    filesystem::remove_all(directory);
+    return 0;
+}
+
+//------------------------------------------------------------------------------
+// every variable, for a snapshot: those of var_table, and those of the
+// restored snapshot that var_table doesn't override
+vector<pair<string, Value>> all_variables()
+{
+    vector<pair<string, Value>> v;
+    var_table.for_each([&](const string &name, const Value &value) { v.push_back({name, value}); });
+    if (restored)
+        restored->for_each([&](const string &name, const Value &value) {
+            if (!var_table.find(name))
+                v.push_back({name, value});
+        });
+    return v;
+}
+
+//------------------------------------------------------------------------------
+// calculator [--restore file] [--snapshot file]
+// a session that starts with the variables of a snapshot, and/or saves its
+// variables in a snapshot when it ends (the same file may be given for both)
+int session(const vector<string> &args)
+{
+    string restore;
+    string snapshot;
+    for (int i = 0; i < int(args.size()); ++i)
+        if (args[i] == "--restore")
+            restore = option_value(args, i);
+        else if (args[i] == "--snapshot")
+            snapshot = option_value(args, i);
+        else
+            error("unknown option ", args[i]);
+    if (!restore.empty())
+        restored = make_unique<Snapshot>(restore);
+    calculate();
+    if (!snapshot.empty())
+        write_snapshot(snapshot, all_variables());
+    return 0;
+}
+
+//------------------------------------------------------------------------------
+// calculator --snapshot-benchmark [variables]
+// for tables of growing size: the time to write a snapshot, and the time
+// until a restarted session can look up a variable, by restoring the
+// snapshot and by replaying the definitions
+int snapshot_benchmark(const vector<string> &args)
+{
+    long largest = 1 < args.size() ? stol(args[1]) : 1000000;
+    string path = "/tmp/calculator-snapshot-" + to_string(getpid());
+    auto ms = [](chrono::steady_clock::time_point start) {
+        return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    };
+
+    cout << perf_counters().status() << '\n';
+    cout << "variables     bytes   write ms   restore ms   replay ms\n";
+    for (long n = 1000; n <= largest; n *= 10)
+    {
+        var_table = Persistent_map<Value>();
+        restored.reset();
+        for (long i = 0; i < n; ++i)
+            define_name("v" + to_string(i), i % 100 ? Value(i * 0.5) : Value(identity(3)));
+
+        auto start = chrono::steady_clock::now();
+        write_snapshot(path, all_variables());
+        double write = ms(start);
+
+        var_table = Persistent_map<Value>(); // a new session
+        perf_counters().start();
+        start = chrono::steady_clock::now();
+        restored = make_unique<Snapshot>(path);
+        double check = get_value("v" + to_string(n - 1)).number + get_value("v100").matrix->rows();
+        double restore = ms(start);
+        Perf_sample restore_counts = perf_counters().stop();
+
+        restored.reset();
+        perf_counters().start();
+        start = chrono::steady_clock::now();
+        for (long i = 0; i < n; ++i) // what replaying the history would cost at the least
+            define_name("v" + to_string(i), i % 100 ? Value(i * 0.5) : Value(identity(3)));
+        check -= get_value("v" + to_string(n - 1)).number + get_value("v100").matrix->rows();
+        double replay = ms(start);
+        Perf_sample replay_counts = perf_counters().stop();
+
+        if (check != 0)
+            error("snapshot_benchmark: restored the wrong values");
+        ifstream file(path, ios_base::binary | ios_base::ate);
+        cout << setw(9) << n << setw(10) << file.tellg() << setw(11) << write << setw(13) << restore
+             << setw(12) << replay << '\n';
+        if (perf_counters().available()) // per variable
+            cout << "    restore: " << restore_counts.report(n) << "\n    replay:  " << replay_counts.report(n)
+                 << '\n';
+    }
+    restored.reset();
+    remove(path.c_str());
+    return 0;
+}
+
+//------------------------------------------------------------------------------
+// calculator --format-benchmark [numbers]
+// write the same doubles with operator<< and with Number_formatters, in
+// numbers/s and MB/s, and check that they agree: general:6 with operator<<
+// as cout is set up, shortest with what operator<< writes with max_digits10
+// when read back
+int format_benchmark(const vector<string> &args)
+{
+    long count = 1 < args.size() ? stol(args[1]) : 1000000;
+    vector<double> numbers; // results look like this: whole numbers, decimals, tiny and huge ones
+    for (long i = 0; i < count; ++i)
+        switch (i % 4)
+        {
+        case 0:
+            numbers.push_back(randint(-100000, 100000));
+            break;
+        case 1:
+            numbers.push_back(randint(0, 1000000) / 100.0);
+            break;
+        case 2:
+            numbers.push_back(randint(1, 1000000) / 7.0);
+            break;
+        default:
+            numbers.push_back(pow(10.0, randint(-300, 300)) * (randint(1, 999999) / 3.0));
+        }
+
+    auto time = [&](const string &label, const function<void(ostream &, double)> &write) {
+        ostringstream os;
+        auto start = chrono::steady_clock::now();
+        for (double x : numbers)
+        {
+            write(os, x);
+            os << '\n';
+        }
+        chrono::duration<double> t = chrono::steady_clock::now() - start;
+        cout << label << setw(12) << long(count / t.count()) << " numbers/s, " << setw(7)
+             << os.str().size() / t.count() / 1e6 << " MB/s, " << os.str().size() / double(count)
+             << " bytes per number\n";
+        return os.str();
+    };
+
+    cout << count << " numbers\n";
+    string stream6 = time("operator<<:             ", [](ostream &os, double x) { os << x; });
+    string stream17 = time("operator<<, 17 digits:  ", [](ostream &os, double x) {
+        os << setprecision(numeric_limits<double>::max_digits10) << x;
+    });
+    Number_formatter general;
+    string general6 = time("general:6:              ", [&](ostream &os, double x) { general.write(os, x); });
+    Number_formatter shortest(Number_formatter::shortest);
+    string shortest_text = time("shortest:               ", [&](ostream &os, double x) { shortest.write(os, x); });
+    Number_formatter fixed2(Number_formatter::fixed, 2);
+    time("fixed:2:                ", [&](ostream &os, double x) { fixed2.write(os, x); });
+
+    if (general6 != stream6)
+        error("format_benchmark: general:6 differs from operator<<");
+    istringstream exact(stream17);
+    istringstream short_one(shortest_text);
+    for (double a, b; exact >> a && short_one >> b;)
+        if (a != b)
+            error("format_benchmark: shortest doesn't read back as the same number");
+    cout << "general:6 writes what operator<< writes; shortest reads back exactly\n";
+    return 0;
+}
+
+//------------------------------------------------------------------------------
+// the calculator with arguments runs in one of these modes instead of reading cin
+int run_mode(const vector<string> &args, const string &program)
+{
+    if (args[0] == "--format") // goes with any mode: how results are written
+    {
+        if (args.size() < 2)
+            error("usage: calculator --format general:N|shortest|fixed:N [mode]");
+        result_format = Number_formatter(args[1]);
+        if (args.size() == 2)
+        {
+            calculate();
+            return 0;
+        }
+        return run_mode(vector<string>(args.begin() + 2, args.end()), program);
+    }
+    if (args[0] == "--budget")
+        return limited(args);
+    if (args[0] == "--run")
+        return run_script(args); // integrate() reports as when the script is typed
+    if (args[0] == "--scenarios")
+        return scenarios(args);
+    if (args[0] == "--restore" || args[0] == "--snapshot")
+        return session(args);
+    builtin_reports = false; // no integrate() statistics for every point of a sweep
+    if (args[0] == "--worker" && 2 <= args.size())
+    {
+        int crash_after = 0;
+        if (args.size() == 4 && args[2] == "--crash-after")
+            crash_after = stoi(args[3]);
+        run_worker(args[1], [](const string &s) { return compile(s); }, crash_after);
+        return 0;
+    }
+    if (args[0] == "--sweep")
+        return sweep(args);
+    if (args[0] == "--compare-float")
+        return compare_float(args);
+    if (args[0] == "--csv")
+        return csv(args);
+    if (args[0] == "--batch")
+        return batch(args);
+    if (args[0] == "--monte-carlo")
+        return monte_carlo(args);
+    if (args[0] == "--gradient")
+        return gradient(args);
+    if (args[0] == "--plan-benchmark")
+        return plan_benchmark(args);
+    if (args[0] == "--script-benchmark")
+        return script_benchmark(args);
+    if (args[0] == "--snapshot-benchmark")
+        return snapshot_benchmark(args);
+    if (args[0] == "--format-benchmark")
+        return format_benchmark(args);
+    if (args[0] == "--serve")
+        return serve(args);
+    if (args[0] == "--wire-benchmark")
+        return wire_benchmark(args);
+    if (args[0] == "--serve-shared")
+        return serve_shared(args);
+    if (args[0] == "--shm-benchmark")
+        return shm_benchmark(args);
+    if (args[0] == "--distribute")
+        return distribute(args, program);
+    error("unknown mode ", args[0]);
+}
+
+//------------------------------------------------------------------------------
+int main(int argc, char *argv[]) try
+{
+    start_instruments(); // before any thread starts
+    if (1 < argc)
+    {
+        ifstream self("/proc/self/exe"); // the surest way to find ourselves, where it exists
+        return run_mode(vector<string>(argv + 1, argv + argc), self ? "/proc/self/exe" : argv[0]);
+    }
     calculate();
     keep_window_open();
     return 0;
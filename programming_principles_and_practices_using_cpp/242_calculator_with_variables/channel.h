@@ -0,0 +1,301 @@
+/*
+    channel.h
+
+    Messages over stream sockets, for talking to calculator processes.
+
+    An address is either
+        unix:/path/to/socket    a Unix domain socket (processes on this host)
+        tcp:host:port           a TCP socket (processes on any host)
+    so the same programs work on one machine and across machines.
+
+    A message is a 4-byte length, a 1-byte type, and length bytes of payload.
+    Numbers are sent in the byte order of the machine, so all hosts taking
+    part must agree on it (all the usual ones are little-endian).
+
+    Only for POSIX systems (Linux, macOS); elsewhere the functions throw.
+*/
+
+#ifndef CHANNEL_H
+#define CHANNEL_H
+
+#include <cstdint>
+#include <cstring>
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#define CHANNEL_POSIX 1
+#endif
+#include "std_lib_facilities.h" // after the standard headers: it #defines vector
+
+//------------------------------------------------------------------------------
+class Message
+{
+public:
+    char type = 0;
+    vector<char> payload;
+
+    // append to the payload
+    template <class T>
+    void put(const T &x) // x must be a plain number
+    {
+        const char *p = reinterpret_cast<const char *>(&x);
+        payload.insert(payload.end(), p, p + sizeof x);
+    }
+    void put_string(const string &s)
+    {
+        put(uint32_t(s.size()));
+        payload.insert(payload.end(), s.begin(), s.end());
+    }
+    void put_bytes(const void *p, size_t n)
+    {
+        const char *b = static_cast<const char *>(p);
+        payload.insert(payload.end(), b, b + n);
+    }
+};
+
+//------------------------------------------------------------------------------
+// reads the payload of a Message from the front
+class Message_reader
+{
+public:
+    explicit Message_reader(const Message &m) : p(m.payload.data()), end(p + m.payload.size()) {}
+    Message_reader(const char *payload, size_t n) : p(payload), end(p + n) {} // a payload where it is
+
+    template <class T>
+    T get()
+    {
+        T x;
+        memcpy(&x, take(sizeof x), sizeof x);
+        return x;
+    }
+    string get_string()
+    {
+        uint32_t n = get<uint32_t>();
+        const char *s = take(n);
+        return string(s, n);
+    }
+    const char *take(size_t n) // the next n bytes
+    {
+        if (size_t(end - p) < n)
+            error("message too short");
+        const char *s = p;
+        p += n;
+        return s;
+    }
+    bool at_end() const { return p == end; }
+
+private:
+    const char *p;
+    const char *end;
+};
+
+#ifdef CHANNEL_POSIX
+
+//------------------------------------------------------------------------------
+// a connected socket; closes it when destroyed
+class Channel
+{
+public:
+    explicit Channel(int fd) : sock(fd) {}
+    ~Channel()
+    {
+        if (0 <= sock)
+            close(sock);
+    }
+    Channel(const Channel &) = delete;
+    Channel &operator=(const Channel &) = delete;
+
+    int fd() const { return sock; }
+    bool send(const Message &m);  // false if the other end has gone
+    bool receive(Message &m);     // false at end of file or on error
+
+private:
+    int sock;
+    bool write_all(const void *p, size_t n);
+    bool read_all(void *p, size_t n);
+};
+
+//------------------------------------------------------------------------------
+inline bool Channel::write_all(const void *p, size_t n)
+{
+    const char *b = static_cast<const char *>(p);
+    while (n)
+    {
+        ssize_t k = ::send(sock, b, n, MSG_NOSIGNAL); // a dead peer is an error, not SIGPIPE
+        if (k <= 0)
+            return false;
+        b += k;
+        n -= k;
+    }
+    return true;
+}
+
+//------------------------------------------------------------------------------
+inline bool Channel::read_all(void *p, size_t n)
+{
+    char *b = static_cast<char *>(p);
+    while (n)
+    {
+        ssize_t k = ::recv(sock, b, n, 0);
+        if (k <= 0)
+            return false;
+        b += k;
+        n -= k;
+    }
+    return true;
+}
+
+//------------------------------------------------------------------------------
+inline bool Channel::send(const Message &m)
+{
+    char header[5];
+    uint32_t n = m.payload.size();
+    memcpy(header, &n, 4);
+    header[4] = m.type;
+    return write_all(header, sizeof header) && write_all(m.payload.data(), n);
+}
+
+//------------------------------------------------------------------------------
+inline bool Channel::receive(Message &m)
+{
+    const uint32_t max_message = 1 << 30;
+    char header[5];
+    if (!read_all(header, sizeof header))
+        return false;
+    uint32_t n;
+    memcpy(&n, header, 4);
+    if (max_message < n)
+        return false; // garbage: treat it like a broken connection
+    m.type = header[4];
+    m.payload.resize(n);
+    return read_all(m.payload.data(), n);
+}
+
+//------------------------------------------------------------------------------
+// keep fd from being inherited by programs we start (e.g. worker processes):
+// a worker holding a copy of another worker's socket would hide its death
+inline int close_on_exec(int fd)
+{
+    if (0 <= fd)
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+    return fd;
+}
+
+//------------------------------------------------------------------------------
+// split "tcp:host:port" into host and port
+inline void split_tcp_address(const string &address, string &host, string &port)
+{
+    size_t colon = address.rfind(':');
+    if (colon == string::npos || colon < 4)
+        error("bad address (tcp:host:port expected): ", address);
+    host = address.substr(4, colon - 4);
+    port = address.substr(colon + 1);
+}
+
+//------------------------------------------------------------------------------
+// a socket that listens at address
+inline int listen_at(const string &address)
+{
+    int fd = -1;
+    if (address.compare(0, 5, "unix:") == 0)
+    {
+        string path = address.substr(5);
+        sockaddr_un a{};
+        a.sun_family = AF_UNIX;
+        if (sizeof a.sun_path <= path.size())
+            error("socket path too long: ", path);
+        strcpy(a.sun_path, path.c_str());
+        unlink(path.c_str()); // left over from an earlier run
+        fd = close_on_exec(socket(AF_UNIX, SOCK_STREAM, 0));
+        if (fd < 0 || bind(fd, reinterpret_cast<sockaddr *>(&a), sizeof a) < 0)
+            error("can't bind to ", address);
+    }
+    else if (address.compare(0, 4, "tcp:") == 0)
+    {
+        string host, port;
+        split_tcp_address(address, host, port);
+        addrinfo hints{};
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_PASSIVE;
+        addrinfo *info = nullptr;
+        if (getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &info) != 0)
+            error("can't resolve ", address);
+        fd = close_on_exec(socket(info->ai_family, info->ai_socktype, 0));
+        int yes = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof yes);
+        int r = fd < 0 ? -1 : bind(fd, info->ai_addr, info->ai_addrlen);
+        freeaddrinfo(info);
+        if (r < 0)
+            error("can't bind to ", address);
+    }
+    else
+        error("address must start with unix: or tcp: ", address);
+
+    if (listen(fd, 64) < 0)
+        error("can't listen at ", address);
+    return fd;
+}
+
+//------------------------------------------------------------------------------
+// a socket connected to address
+inline int connect_to(const string &address)
+{
+    int fd = -1;
+    if (address.compare(0, 5, "unix:") == 0)
+    {
+        string path = address.substr(5);
+        sockaddr_un a{};
+        a.sun_family = AF_UNIX;
+        if (sizeof a.sun_path <= path.size())
+            error("socket path too long: ", path);
+        strcpy(a.sun_path, path.c_str());
+        fd = close_on_exec(socket(AF_UNIX, SOCK_STREAM, 0));
+        if (fd < 0 || connect(fd, reinterpret_cast<sockaddr *>(&a), sizeof a) < 0)
+            error("can't connect to ", address);
+    }
+    else if (address.compare(0, 4, "tcp:") == 0)
+    {
+        string host, port;
+        split_tcp_address(address, host, port);
+        addrinfo hints{};
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo *info = nullptr;
+        if (getaddrinfo(host.c_str(), port.c_str(), &hints, &info) != 0)
+            error("can't resolve ", address);
+        fd = close_on_exec(socket(info->ai_family, info->ai_socktype, 0));
+        int r = fd < 0 ? -1 : connect(fd, info->ai_addr, info->ai_addrlen);
+        freeaddrinfo(info);
+        if (r < 0)
+            error("can't connect to ", address);
+        int yes = 1; // small request/reply messages: don't wait to fill packets
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof yes);
+    }
+    else
+        error("address must start with unix: or tcp: ", address);
+    return fd;
+}
+
+#else // not POSIX
+
+inline int listen_at(const string &address)
+{
+    error("sockets are not supported on this system");
+    return -1;
+}
+
+inline int connect_to(const string &address)
+{
+    error("sockets are not supported on this system");
+    return -1;
+}
+
+#endif // CHANNEL_POSIX
+
+#endif // CHANNEL_H
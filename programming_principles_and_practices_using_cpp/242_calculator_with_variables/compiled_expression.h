@@ -0,0 +1,643 @@
+/*
+    compiled_expression.h
+
+    The grammar functions in calculator.cpp no longer compute a value while they
+    read tokens. Instead they translate a statement into a Code: a small program
+    for a stack machine. run() then executes that program.
+
+    A Code can be executed as often as we like without going back through the
+    Token_stream. integrate() and solve() depend on that: they evaluate their
+    first argument (the integrand) hundreds or thousands of times.
+
+    Every distinct name used in a statement gets a slot. Before a Code is run the
+    caller fills the slots with values; integrate() and solve() overwrite the slot
+    of their bound variable for each sample.
+
+    run() is a template on the type of value it computes with: double for
+    ordinary expressions, Value (see matrix.h) for expressions that involve
+    matrices. Code::uses_matrices tells which one a Code needs.
+
+    run() charges the instructions it executes, and the work of matrix
+    products, to the budget of the statement (see budget.h).
+
+    run() works on a Code_view: pointers to the arrays of a Code, wherever
+    they are. Usually that is a Code (the conversion is implicit), but it may
+    also be a compiled script mapped from a file (see script_cache.h).
+
+    A user-defined function that isn't inlined is compiled into each Code
+    that calls it, once, as a body like that of an integrand. Opcode::call
+    runs the body with a copy of the slots in which the function's
+    parameters are set to the arguments. A memoized function (one that
+    depends on nothing but its arguments) first looks for the arguments in
+    the memo of the Code's Function_state.
+*/
+
+#ifndef COMPILED_EXPRESSION_H
+#define COMPILED_EXPRESSION_H
+
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <unordered_map>
+#include "budget.h"
+#include "matrix.h"
+#include "std_lib_facilities.h"
+
+//------------------------------------------------------------------------------
+enum class Opcode : char
+{
+    constant,  // push constants[arg]
+    load,      // push slots[arg]
+    add,       // pop two values, push their sum
+    subtract,  // pop two values, push their difference
+    multiply,  // pop two values, push their product
+    divide,    // pop two values, push their quotient
+    modulo,    // pop two values, push their integer remainder
+    negate,    // replace the top value by its negation
+    jump,      // continue at instruction arg (skips the body of an integrand)
+    integrate, // pop a, b, tol; push the integral of the body described by calls[arg]
+    solve,     // pop lo, hi; push a root of the body described by calls[arg]
+    matrix,    // push a matrix of zeros of size shapes[arg]
+    element,   // pop a number into element arg (counted row by row) of the matrix on top
+    transpose, // replace the top value by its transpose
+    zeros,     // pop rows, cols; push a rows by cols matrix of zeros
+    identity,  // pop n; push the n by n identity matrix
+    compare,   // pop two values, push 1 if they are in Relation arg, else 0
+    branch,    // pop a value; if it is 0, continue at instruction arg (the else of an if)
+    skip,      // continue at instruction arg (past the else of an if)
+    call,      // pop the arguments of functions[arg]; push its value for them
+    end        // stop; the top value is the result
+};
+
+//------------------------------------------------------------------------------
+enum class Relation
+{
+    less,
+    less_equal,
+    greater,
+    greater_equal,
+    equal,
+    not_equal
+};
+
+inline bool compare(double a, double b, Relation r)
+{
+    switch (r)
+    {
+    case Relation::less:
+        return a < b;
+    case Relation::less_equal:
+        return a <= b;
+    case Relation::greater:
+        return a > b;
+    case Relation::greater_equal:
+        return a >= b;
+    case Relation::equal:
+        return a == b;
+    default:
+        return a != b;
+    }
+}
+
+//------------------------------------------------------------------------------
+struct Instruction
+{
+    Opcode op;
+    int arg; // meaning depends on op
+};
+
+//------------------------------------------------------------------------------
+// integrate() and solve() run a body (an expression ending in Opcode::end)
+// with one slot, var, set to each sample point in turn
+struct Call_site
+{
+    int body; // index of the first instruction of the body
+    int var;  // slot of the bound variable
+};
+
+//------------------------------------------------------------------------------
+struct Shape
+{
+    int rows;
+    int cols;
+};
+
+//------------------------------------------------------------------------------
+// a user-defined function f, compiled into the Code that calls it: slot is
+// named "f()" and is never loaded; the parameters x, y, ... have the next
+// slots, named "f.x", "f.y", ...
+struct Function_site
+{
+    int body;   // index of the first instruction of the body
+    int slot;
+    int params; // number of parameters
+    int memo;   // 1 if results are remembered
+};
+
+//------------------------------------------------------------------------------
+// what the calls of a Code's functions leave behind; shared by copies of the Code
+class Function_state
+{
+public:
+    class Counts
+    {
+    public:
+        atomic<long> calls{0};
+        atomic<long> hits{0}; // of the memo
+        atomic<long> misses{0};
+    };
+    deque<Counts> counts; // one per Function_site
+
+    mutex m; // protects memo
+    unordered_map<string, double> memo; // by site and arguments (their bytes)
+    static const size_t max_memo = 1 << 20; // entries; then the memo starts over
+
+    explicit Function_state(int sites = 0)
+    {
+        for (int i = 0; i < sites; ++i)
+            counts.emplace_back();
+    }
+};
+
+//------------------------------------------------------------------------------
+const int max_stack = 256; // the deepest stack run() can handle
+
+//------------------------------------------------------------------------------
+class Code
+{
+public:
+    vector<Instruction> instructions;
+    vector<double> constants;
+    vector<int> places;   // places[i]: which number of the statement constants[i] is, or -1 (see plan_cache.h)
+    vector<string> names; // names[i] is the name of slot i
+    vector<Call_site> calls;
+    vector<Shape> shapes;       // of matrix literals
+    vector<Function_site> functions;
+    shared_ptr<Function_state> state; // if there are functions
+    int depth = 0;              // stack depth after the last emitted instruction
+    int max_depth = 0;          // deepest stack needed by any instruction
+    bool uses_matrices = false; // does the Code have to be run with Values?
+
+    int emit(Opcode op, int arg = 0); // append an instruction; return its index
+    int emit_constant(double d, int place = -1); // append Opcode::constant for d
+    int slot(const string& name);     // the slot of name; one is added if needed
+    int add_call(int body, int var);  // append a Call_site; return its index
+    int add_function(int body, int slot, int params, bool memo); // append a Function_site; return its index
+    void patch(int jump, int target) { instructions[jump].arg = target; }
+    int size() const { return instructions.size(); }
+    bool is_bound(int slot) const;             // does slot get its value from integrate(), solve(), or a call?
+    bool loads(const Call_site &c, int slot) const; // does the body of c (or a function it calls) use slot?
+};
+
+//------------------------------------------------------------------------------
+// what run() needs of a Code; it owns nothing
+class Code_view
+{
+public:
+    Code_view(const Code &c); // look at c, which must outlive the view
+    Code_view() {}
+
+    const Instruction *instructions = nullptr;
+    const double *constants = nullptr;
+    const Call_site *calls = nullptr;
+    const Shape *shapes = nullptr;
+    const Function_site *functions = nullptr;
+    int size = 0; // of instructions
+    int call_count = 0;
+    int function_count = 0;
+    Function_state *state = nullptr; // nullptr: no counts, no memo
+    int slots = 0; // number of names
+    bool uses_matrices = false;
+
+    // the names: strings of a Code, or NUL-terminated at offsets from strings
+    const string *names = nullptr;
+    const char *strings = nullptr;
+    const uint32_t *name_offsets = nullptr;
+
+    const char *name(int slot) const { return names ? names[slot].c_str() : strings + name_offsets[slot]; }
+    bool is_bound(int slot) const;
+    bool loads(const Call_site &c, int slot) const;
+
+private:
+    bool loads(int first, int end, int slot, vector<int> &seen) const;
+};
+
+//------------------------------------------------------------------------------
+inline Code_view::Code_view(const Code &c)
+    : instructions(c.instructions.data()), constants(c.constants.data()), calls(c.calls.data()),
+      shapes(c.shapes.data()), functions(c.functions.data()), size(c.instructions.size()),
+      call_count(c.calls.size()), function_count(c.functions.size()), state(c.state.get()),
+      slots(c.names.size()), uses_matrices(c.uses_matrices), names(c.names.data())
+{
+}
+
+//------------------------------------------------------------------------------
+inline bool Code_view::is_bound(int slot) const
+{
+    for (int i = 0; i < call_count; ++i)
+        if (calls[i].var == slot)
+            return true;
+    for (int i = 0; i < function_count; ++i)
+        if (functions[i].slot <= slot && slot <= functions[i].slot + functions[i].params)
+            return true;
+    return false;
+}
+
+//------------------------------------------------------------------------------
+inline bool Code_view::loads(const Call_site &c, int slot) const
+{
+    vector<int> seen(function_count); // functions whose bodies we have looked at
+    return loads(c.body, instructions[c.body - 1].arg, slot, seen); // up to the jump over the body
+}
+
+inline bool Code_view::loads(int first, int end, int slot, vector<int> &seen) const
+{
+    for (int pc = first; pc < end; ++pc)
+    {
+        const Instruction &in = instructions[pc];
+        if (in.op == Opcode::load && in.arg == slot)
+            return true;
+        if (in.op == Opcode::call && !seen[in.arg])
+        {
+            seen[in.arg] = 1;
+            int body = functions[in.arg].body;
+            if (loads(body, instructions[body - 1].arg, slot, seen))
+                return true;
+        }
+    }
+    return false;
+}
+
+//------------------------------------------------------------------------------
+inline int Code::emit(Opcode op, int arg)
+{
+    switch (op) // keep track of how deep the stack gets
+    {
+    case Opcode::constant:
+    case Opcode::load:
+        ++depth;
+        break;
+    case Opcode::add:
+    case Opcode::subtract:
+    case Opcode::multiply:
+    case Opcode::divide:
+    case Opcode::modulo:
+    case Opcode::solve:
+    case Opcode::end:
+        --depth;
+        break;
+    case Opcode::integrate:
+        depth -= 2;
+        break;
+    case Opcode::matrix:
+        ++depth;
+        uses_matrices = true;
+        break;
+    case Opcode::element:
+    case Opcode::zeros:
+        --depth;
+        uses_matrices = true;
+        break;
+    case Opcode::transpose:
+    case Opcode::identity:
+        uses_matrices = true;
+        break;
+    case Opcode::compare:
+    case Opcode::branch:
+        --depth;
+        break;
+    case Opcode::call:
+        depth += 1 - functions[arg].params;
+        break;
+    default:
+        break;
+    }
+    if (max_depth < depth)
+        max_depth = depth;
+    if (max_stack < max_depth)
+        error("expression too complex");
+
+    instructions.push_back(Instruction{op, arg});
+    return instructions.size() - 1;
+}
+
+//------------------------------------------------------------------------------
+inline int Code::emit_constant(double d, int place)
+{
+    constants.push_back(d);
+    places.push_back(place);
+    return emit(Opcode::constant, constants.size() - 1);
+}
+
+//------------------------------------------------------------------------------
+inline int Code::slot(const string &name)
+{
+    for (int i = 0; i < int(names.size()); ++i)
+        if (names[i] == name)
+            return i;
+    names.push_back(name);
+    return names.size() - 1;
+}
+
+//------------------------------------------------------------------------------
+inline int Code::add_call(int body, int var)
+{
+    calls.push_back(Call_site{body, var});
+    return calls.size() - 1;
+}
+
+//------------------------------------------------------------------------------
+inline int Code::add_function(int body, int slot, int params, bool memo)
+{
+    functions.push_back(Function_site{body, slot, params, memo});
+    if (!state)
+        state = make_shared<Function_state>();
+    state->counts.emplace_back();
+    return functions.size() - 1;
+}
+
+//------------------------------------------------------------------------------
+inline bool Code::is_bound(int slot) const
+{
+    return Code_view(*this).is_bound(slot);
+}
+
+//------------------------------------------------------------------------------
+inline bool Code::loads(const Call_site &c, int slot) const
+{
+    return Code_view(*this).loads(c, slot);
+}
+
+//------------------------------------------------------------------------------
+// the built-ins are defined in integrate.h
+double integrate(const Code_view &code, const Call_site &call, const double *slots,
+                 double a, double b, double tol);
+double solve(const Code_view &code, const Call_site &call, const double *slots,
+             double lo, double hi);
+
+//------------------------------------------------------------------------------
+// integrands are always run with doubles: get them from Values
+inline vector<double> scalar_slots(const Code_view &code, const Call_site &, const double *slots)
+{
+    return vector<double>(slots, slots + code.slots);
+}
+
+inline vector<double> scalar_slots(const Code_view &code, const Call_site &call, const Value *slots)
+{
+    vector<double> v(code.slots);
+    for (int i = 0; i < int(v.size()); ++i)
+    {
+        if (!slots[i].is_matrix())
+            v[i] = slots[i].number;
+        else if (code.loads(call, i))
+            error("the expression to integrate or solve must not use a matrix: ", code.name(i));
+    }
+    return v;
+}
+
+inline double scalar(double d) { return d; }
+inline double scalar(const Value &v) { return v.scalar(); }
+
+//------------------------------------------------------------------------------
+// the matrix instructions of run<Value>()
+inline void matrix_operation(const Code_view &code, Instruction in, Value *stack, int &top)
+{
+    switch (in.op)
+    {
+    case Opcode::matrix:
+        check_elements(double(code.shapes[in.arg].rows) * code.shapes[in.arg].cols);
+        stack[top++] = Matrix(code.shapes[in.arg].rows, code.shapes[in.arg].cols);
+        break;
+    case Opcode::element:
+    {
+        --top;
+        Matrix &m = *stack[top - 1].matrix; // only just made by Opcode::matrix: not shared
+        m(in.arg / m.cols(), in.arg % m.cols()) = stack[top].scalar();
+        break;
+    }
+    case Opcode::transpose:
+        stack[top - 1] = transpose(stack[top - 1]);
+        break;
+    case Opcode::zeros:
+        --top;
+        check_elements(stack[top - 1].scalar() * stack[top].scalar());
+        stack[top - 1] = Matrix(narrow_cast<int>(stack[top - 1].scalar()),
+                                narrow_cast<int>(stack[top].scalar()));
+        break;
+    case Opcode::identity:
+        check_elements(stack[top - 1].scalar() * stack[top - 1].scalar());
+        stack[top - 1] = identity(narrow_cast<int>(stack[top - 1].scalar()));
+        break;
+    default:
+        error("matrix_operation: not a matrix instruction");
+    }
+}
+
+//------------------------------------------------------------------------------
+// charge a product to the statement's budget before computing it
+inline void charge_product(double, double) {}
+
+inline void charge_product(const Value &a, const Value &b)
+{
+    if (!a.is_matrix() || !b.is_matrix())
+        return;
+    check_elements(double(a.matrix->rows()) * b.matrix->cols());
+    charge_steps(long(a.matrix->rows()) * a.matrix->cols() * b.matrix->cols());
+}
+
+//------------------------------------------------------------------------------
+// the key of a call in a memo: the site and the bytes of the arguments;
+// false if an argument is a matrix (those calls aren't remembered)
+inline bool memo_key(string &key, int site, const double *args, int n)
+{
+    key.assign(reinterpret_cast<const char *>(&site), sizeof site);
+    key.append(reinterpret_cast<const char *>(args), n * sizeof(double));
+    return true;
+}
+
+inline bool memo_key(string &key, int site, const Value *args, int n)
+{
+    key.assign(reinterpret_cast<const char *>(&site), sizeof site);
+    for (int i = 0; i < n; ++i)
+    {
+        if (args[i].is_matrix())
+            return false;
+        key.append(reinterpret_cast<const char *>(&args[i].number), sizeof(double));
+    }
+    return true;
+}
+
+inline bool is_number(double) { return true; }
+inline bool is_number(const Value &v) { return !v.is_matrix(); }
+
+//------------------------------------------------------------------------------
+template <class T>
+T run(const Code_view &code, int pc, const T *slots);
+
+inline thread_local int call_depth = 0; // of calls of user-defined functions on this thread
+const int max_call_depth = 500;         // each one takes a run() frame on the C++ stack
+const long call_stack_bytes = 4 << 20;  // and the run() frames of nested calls take no more than this
+
+//------------------------------------------------------------------------------
+// call function site of code with args; the caller's slots give the values
+// of the other names
+template <class T>
+T call_function(const Code_view &code, int site, const T *args, const T *slots)
+{
+    const Function_site &f = code.functions[site];
+    Function_state *state = code.state;
+    if (state)
+        ++state->counts[site].calls;
+    string key;
+    bool memo = f.memo && state && memo_key(key, site, args, f.params);
+    if (memo)
+    {
+        lock_guard<mutex> lock(state->m);
+        auto p = state->memo.find(key);
+        if (p != state->memo.end())
+        {
+            ++state->counts[site].hits;
+            return p->second;
+        }
+    }
+
+    if (max_call_depth <= call_depth || call_stack_bytes / long(sizeof(T) * max_stack) <= call_depth)
+        error(literal("functions call each other too deeply"));
+    vector<T> s(slots, slots + code.slots); // the callee gets parameters of its own
+    for (int i = 0; i < f.params; ++i)
+        s[f.slot + 1 + i] = args[i];
+    ++call_depth;
+    T result;
+    try
+    {
+        result = run(code, f.body, s.data());
+    }
+    catch (...)
+    {
+        --call_depth;
+        throw;
+    }
+    --call_depth;
+
+    if (memo && is_number(result))
+    {
+        ++state->counts[site].misses;
+        lock_guard<mutex> lock(state->m);
+        if (Function_state::max_memo <= state->memo.size())
+            state->memo.clear();
+        state->memo.emplace(key, scalar(result));
+    }
+    return result;
+}
+
+//------------------------------------------------------------------------------
+// execute code from instruction pc up to the matching Opcode::end
+template <class T>
+T run(const Code_view &code, int pc, const T *slots)
+{
+    const Instruction *ins = code.instructions; // no range checks in the inner loop
+    const double *constants = code.constants;
+    T stack[max_stack];
+    int top = 0; // number of values on the stack
+    const int first = pc;
+
+    for (;; ++pc)
+    {
+        switch (ins[pc].op)
+        {
+        case Opcode::constant:
+            stack[top++] = constants[ins[pc].arg];
+            break;
+        case Opcode::load:
+            stack[top++] = slots[ins[pc].arg];
+            break;
+        case Opcode::add:
+            --top;
+            stack[top - 1] = stack[top - 1] + stack[top];
+            break;
+        case Opcode::subtract:
+            --top;
+            stack[top - 1] = stack[top - 1] - stack[top];
+            break;
+        case Opcode::multiply:
+            --top;
+            charge_product(stack[top - 1], stack[top]);
+            stack[top - 1] = stack[top - 1] * stack[top];
+            break;
+        case Opcode::divide:
+            --top;
+            if (scalar(stack[top]) == 0)
+                error(literal("divide by zero"));
+            stack[top - 1] = stack[top - 1] / stack[top];
+            break;
+        case Opcode::modulo:
+        {
+            --top;
+            int i1 = narrow_cast<int>(scalar(stack[top - 1]));
+            int i2 = narrow_cast<int>(scalar(stack[top]));
+            if (i2 == 0)
+                error(literal("%: divide by zero"));
+            stack[top - 1] = i1 % i2;
+            break;
+        }
+        case Opcode::negate:
+            stack[top - 1] = -stack[top - 1];
+            break;
+        case Opcode::jump:
+            pc = ins[pc].arg - 1; // the loop increments pc
+            break;
+        case Opcode::integrate:
+        {
+            top -= 2;
+            const Call_site &call = code.calls[ins[pc].arg];
+            vector<double> s = scalar_slots(code, call, slots);
+            stack[top - 1] = integrate(code, call, s.data(), scalar(stack[top - 1]),
+                                       scalar(stack[top]), scalar(stack[top + 1]));
+            break;
+        }
+        case Opcode::solve:
+        {
+            --top;
+            const Call_site &call = code.calls[ins[pc].arg];
+            vector<double> s = scalar_slots(code, call, slots);
+            stack[top - 1] = solve(code, call, s.data(), scalar(stack[top - 1]), scalar(stack[top]));
+            break;
+        }
+        case Opcode::matrix:
+        case Opcode::element:
+        case Opcode::transpose:
+        case Opcode::zeros:
+        case Opcode::identity:
+            if constexpr (is_same<T, Value>::value)
+                matrix_operation(code, ins[pc], stack, top);
+            else
+                error("matrix in an expression that is run with numbers only");
+            break;
+        case Opcode::compare:
+            --top;
+            stack[top - 1] = compare(scalar(stack[top - 1]), scalar(stack[top]), Relation(ins[pc].arg)) ? 1.0 : 0.0;
+            break;
+        case Opcode::branch:
+            --top;
+            if (scalar(stack[top]) == 0)
+                pc = ins[pc].arg - 1; // the loop increments pc
+            break;
+        case Opcode::skip:
+            pc = ins[pc].arg - 1;
+            break;
+        case Opcode::call:
+        {
+            top -= code.functions[ins[pc].arg].params;
+            stack[top] = call_function(code, ins[pc].arg, stack + top, slots);
+            ++top;
+            break;
+        }
+        case Opcode::end:
+            // jumps only go forward, so no more than this many instructions were run
+            charge_steps(pc - first + 1);
+            return stack[top - 1];
+        }
+    }
+}
+
+#endif // COMPILED_EXPRESSION_H
@@ -0,0 +1,431 @@
+/*
+    coordinator.h
+
+    A sweep (see sweep.h) spread over worker processes.
+
+    The coordinator cuts the grid into shards of consecutive points, listens at
+    an address (see channel.h), and starts some local workers: copies of the
+    calculator started with --worker address. Workers on other hosts can be
+    started by hand with a tcp: address and join in the same way.
+
+    Each worker is kept busy with up to max_in_flight shards at a time. A worker
+    that disconnects, dies, or doesn't answer within shard_timeout seconds loses
+    its shards: they go back to the front of the queue for someone else. Dead
+    local workers are replaced (up to max_restarts times). A result that isn't
+    for one of the worker's shards, or hasn't that shard's number of points,
+    counts as the worker dying: nothing in it is used. However the sweep ends,
+    finished or failed, the local workers are stopped and the socket is removed.
+
+    Shards finish in any order; the coordinator keeps finished shards until all
+    shards before them are done, and hands the results to the sink in order.
+
+    The messages:
+        worker to coordinator:
+            hello     (no payload)
+            result    shard id, count, errors, count doubles
+            failed    shard id, message (the expression can't be compiled)
+        coordinator to worker:
+            shard     shard id, first point, count, expression, ranges
+            quit      (no payload)
+*/
+
+#ifndef COORDINATOR_H
+#define COORDINATOR_H
+
+#include <cerrno>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <thread>
+#if defined(__unix__) || defined(__APPLE__)
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+#endif
+#include "channel.h"
+#include "sweep.h"
+#include "std_lib_facilities.h" // after the standard headers: it #defines vector
+
+//------------------------------------------------------------------------------
+// message types
+const char hello_message = 'H';
+const char result_message = 'R';
+const char failed_message = 'F';
+const char shard_message = 'S';
+const char quit_message = 'Q';
+
+//------------------------------------------------------------------------------
+class Distributed_sweep
+{
+public:
+    string expression;
+    Grid grid;
+    long shard_size = 10000;     // points per shard
+    int local_workers = 4;       // worker processes to start on this host
+    string address;              // where workers connect; empty: a Unix socket in /tmp
+    string program;              // the calculator executable, to start local workers
+    int crash_after = 0;         // for testing: the first local worker dies after this many shards
+    double shard_timeout = 60;   // seconds to wait for a shard before giving it to someone else
+    int max_in_flight = 2;       // shards a worker has at once, so it needn't wait for the next
+    int max_restarts = 8;        // dead local workers that will be replaced
+
+    // statistics
+    long shards = 0;
+    long requeued = 0;
+    long errors = 0;
+    double seconds = 0;
+};
+
+//------------------------------------------------------------------------------
+// the number of points in shard id
+inline long shard_points(const Distributed_sweep &job, long id)
+{
+    return min(job.shard_size, job.grid.size() - id * job.shard_size);
+}
+
+inline Message shard_request(const Distributed_sweep &job, long id)
+{
+    long first = id * job.shard_size;
+    long count = shard_points(job, id);
+    Message m;
+    m.type = shard_message;
+    m.put(int64_t(id));
+    m.put(int64_t(first));
+    m.put(int64_t(count));
+    m.put_string(job.expression);
+    m.put(uint32_t(job.grid.ranges.size()));
+    for (const Range &r : job.grid.ranges)
+    {
+        m.put_string(r.var);
+        m.put(r.from);
+        m.put(r.step);
+        m.put(int64_t(r.count));
+    }
+    return m;
+}
+
+#if defined(__unix__) || defined(__APPLE__)
+
+//------------------------------------------------------------------------------
+// evaluate shards sent by the coordinator at address until told to quit;
+// compile turns expression text into a Code
+inline void run_worker(const string &address, function<Code(const string &)> compile,
+                       int crash_after = 0)
+{
+    Channel coordinator(connect_to(address));
+    Message m;
+    m.type = hello_message;
+    coordinator.send(m);
+
+    string expression; // the expression compiled last; usually the same every time
+    Code code;
+    int done = 0;
+    while (coordinator.receive(m) && m.type == shard_message)
+    {
+        Message_reader r(m);
+        int64_t id = r.get<int64_t>();
+        int64_t first = r.get<int64_t>();
+        int64_t count = r.get<int64_t>();
+        string e = r.get_string();
+        Grid grid;
+        uint32_t n = r.get<uint32_t>();
+        for (uint32_t i = 0; i < n; ++i)
+        {
+            Range range;
+            range.var = r.get_string();
+            range.from = r.get<double>();
+            range.step = r.get<double>();
+            range.count = r.get<int64_t>();
+            grid.ranges.push_back(range);
+        }
+
+        Message reply;
+        try
+        {
+            if (e != expression)
+            {
+                code = compile(e);
+                expression = e;
+            }
+            Sweep sweep(code, grid);
+            vector<double> values(count);
+            sweep.evaluate(first, count, values.data());
+
+            reply.type = result_message;
+            reply.put(id);
+            reply.put(count);
+            reply.put(int64_t(sweep.errors));
+            reply.put_bytes(values.data(), count * sizeof(double));
+        }
+        catch (exception &x)
+        {
+            reply = Message();
+            reply.type = failed_message;
+            reply.put(id);
+            reply.put_string(x.what());
+        }
+        if (!coordinator.send(reply))
+            return;
+        if (++done == crash_after)
+            _exit(3); // pretend to crash, to test the coordinator
+    }
+}
+
+//------------------------------------------------------------------------------
+// start a local worker process
+inline pid_t start_worker(const Distributed_sweep &job, bool crash)
+{
+    pid_t pid = fork();
+    if (pid < 0)
+        error("can't start a worker process");
+    if (pid == 0)
+    {
+        string n = to_string(job.crash_after);
+        if (crash)
+            execl(job.program.c_str(), job.program.c_str(), "--worker", job.address.c_str(),
+                  "--crash-after", n.c_str(), (char *)nullptr);
+        else
+            execl(job.program.c_str(), job.program.c_str(), "--worker", job.address.c_str(),
+                  (char *)nullptr);
+        _exit(127); // exec failed
+    }
+    return pid;
+}
+
+//------------------------------------------------------------------------------
+// a connected worker
+class Worker_connection
+{
+public:
+    unique_ptr<Channel> channel;
+    deque<long> in_flight; // shard ids, oldest first
+    chrono::steady_clock::time_point last_heard;
+};
+
+//------------------------------------------------------------------------------
+// what run_coordinator() has started; however it ends, done or failed, the
+// workers are told to quit (and killed if they don't) and the socket is removed
+class Coordinator_resources
+{
+public:
+    explicit Coordinator_resources(const string &a) : address(a) {}
+    ~Coordinator_resources();
+    Coordinator_resources(const Coordinator_resources &) = delete;
+    Coordinator_resources &operator=(const Coordinator_resources &) = delete;
+
+    vector<pid_t> children; // local worker processes
+    vector<unique_ptr<Worker_connection>> workers;
+
+private:
+    string address;
+};
+
+//------------------------------------------------------------------------------
+inline Coordinator_resources::~Coordinator_resources()
+{
+    Message quit;
+    quit.type = quit_message;
+    for (auto &w : workers)
+        if (w->channel)
+            w->channel->send(quit);
+    workers.clear(); // closing the connections stops any worker that missed the quit
+
+    const auto grace = chrono::seconds(2); // for a worker to finish its shard and go
+    auto deadline = chrono::steady_clock::now() + grace;
+    for (pid_t pid : children)
+        while (waitpid(pid, nullptr, WNOHANG) == 0) // still running
+        {
+            if (deadline < chrono::steady_clock::now())
+            {
+                kill(pid, SIGKILL); // hung, or still busy with shards it lost by timing out
+                waitpid(pid, nullptr, 0);
+                break;
+            }
+            this_thread::sleep_for(chrono::milliseconds(10));
+        }
+    if (address.compare(0, 5, "unix:") == 0)
+        unlink(address.substr(5).c_str());
+}
+
+//------------------------------------------------------------------------------
+// run the sweep; sink(first, values, n) receives the results in order of first
+inline void run_coordinator(Distributed_sweep &job,
+                            function<void(long, const double *, long)> sink)
+{
+    using clock = chrono::steady_clock;
+    auto start = clock::now();
+    long points = job.grid.size();
+    job.shards = (points + job.shard_size - 1) / job.shard_size;
+    if (job.address.empty())
+        job.address = "unix:/tmp/calculator-" + to_string(getpid()) + ".sock";
+
+    int listener = listen_at(job.address);
+    Channel listening(listener); // closes the socket when we're done
+    Coordinator_resources started(job.address); // stops the workers however we leave
+    vector<pid_t> &children = started.children;
+    vector<unique_ptr<Worker_connection>> &workers = started.workers;
+
+    for (int i = 0; i < job.local_workers; ++i)
+        children.push_back(start_worker(job, i == 0 && job.crash_after));
+    int restarts = 0;
+
+    deque<long> queue; // shards waiting for a worker
+    for (long id = 0; id < job.shards; ++id)
+        queue.push_back(id);
+    map<long, vector<double>> finished; // shards that can't be written yet
+    long next_to_write = 0;
+
+    auto lose = [&](Worker_connection &w) { // w is gone: put its shards back in the queue
+        for (auto p = w.in_flight.rbegin(); p != w.in_flight.rend(); ++p)
+            queue.push_front(*p);
+        job.requeued += w.in_flight.size();
+        w.in_flight.clear();
+        w.channel.reset();
+    };
+
+    while (next_to_write < job.shards)
+    {
+        // forget the connections that were lost (or timed out)
+        workers.erase(remove_if(workers.begin(), workers.end(),
+                                [](const unique_ptr<Worker_connection> &w) { return !w->channel; }),
+                      workers.end());
+
+        // hand out work
+        for (auto &w : workers)
+            while (w->channel && int(w->in_flight.size()) < job.max_in_flight && !queue.empty())
+            {
+                long id = queue.front();
+                queue.pop_front();
+                w->in_flight.push_back(id);
+                if (!w->channel->send(shard_request(job, id)))
+                {
+                    lose(*w);
+                    break;
+                }
+                w->last_heard = clock::now();
+            }
+
+        // wait for something to happen
+        vector<pollfd> fds{pollfd{listener, POLLIN, 0}};
+        for (auto &w : workers)
+            fds.push_back(pollfd{w->channel ? w->channel->fd() : -1, POLLIN, 0});
+        if (poll(fds.data(), fds.size(), 100) < 0 && errno != EINTR)
+            error("poll failed");
+
+        if (fds[0].revents & POLLIN)
+        {
+            int fd = close_on_exec(accept(listener, nullptr, nullptr));
+            if (0 <= fd)
+            {
+                workers.push_back(make_unique<Worker_connection>());
+                workers.back()->channel = make_unique<Channel>(fd);
+                workers.back()->last_heard = clock::now();
+            }
+        }
+
+        for (int i = 0; i + 1 < int(fds.size()); ++i) // not workers accepted just now
+        {
+            Worker_connection &w = *workers[i];
+            if (!w.channel || !(fds[i + 1].revents & (POLLIN | POLLHUP | POLLERR)))
+                continue;
+            Message m;
+            if (!w.channel->receive(m))
+            {
+                lose(w);
+                continue;
+            }
+            w.last_heard = clock::now();
+            if (m.type == hello_message)
+                continue;
+            Message_reader r(m);
+            if (m.type == failed_message)
+            {
+                r.get<int64_t>(); // the shard id
+                error("sweep failed: ", r.get_string());
+            }
+            if (m.type != result_message)
+                continue;
+
+            // check a result before using any of it: a worker may be another
+            // program on another host (--listen)
+            const size_t header = 3 * sizeof(int64_t); // id, count, errors
+            long id = m.payload.size() < header ? -1 : r.get<int64_t>();
+            auto p = find(w.in_flight.begin(), w.in_flight.end(), id);
+            long count = p == w.in_flight.end() ? 0 : shard_points(job, id);
+            long errors = 0;
+            if (p == w.in_flight.end() || m.payload.size() != header + count * sizeof(double) ||
+                r.get<int64_t>() != count || (errors = r.get<int64_t>()) < 0 || count < errors)
+            {
+                lose(w); // not the result of a shard it was sent
+                continue;
+            }
+            w.in_flight.erase(p);
+            job.errors += errors;
+            vector<double> values(count);
+            memcpy(values.data(), r.take(count * sizeof(double)), count * sizeof(double));
+            if (next_to_write <= id)
+                finished[id] = move(values);
+
+            // write whatever is now in order
+            for (auto q = finished.find(next_to_write); q != finished.end();
+                 q = finished.find(next_to_write))
+            {
+                sink(next_to_write * job.shard_size, q->second.data(), q->second.size());
+                finished.erase(q);
+                ++next_to_write;
+            }
+        }
+
+        // workers that take too long are treated as dead
+        for (auto &w : workers)
+            if (w->channel && !w->in_flight.empty())
+            {
+                chrono::duration<double> silent = clock::now() - w->last_heard;
+                if (job.shard_timeout < silent.count())
+                    lose(*w);
+            }
+
+        // replace local workers that died while there is still work
+        int status;
+        for (pid_t pid; 0 < (pid = waitpid(-1, &status, WNOHANG));)
+        {
+            auto p = find(children.begin(), children.end(), pid);
+            if (p == children.end())
+                continue; // not a worker
+            children.erase(p);
+            if (next_to_write < job.shards && restarts < job.max_restarts)
+            {
+                ++restarts;
+                children.push_back(start_worker(job, false));
+            }
+        }
+
+        bool anyone = !children.empty();
+        for (auto &w : workers)
+            if (w->channel)
+                anyone = true;
+        if (!anyone && job.local_workers)
+            error("all workers failed");
+    }
+
+    chrono::duration<double> t = clock::now() - start;
+    job.seconds = t.count();
+}
+
+#else // not POSIX
+
+inline void run_worker(const string &, function<Code(const string &)>, int = 0)
+{
+    error("worker processes are not supported on this system");
+}
+
+inline void run_coordinator(Distributed_sweep &, function<void(long, const double *, long)>)
+{
+    error("worker processes are not supported on this system");
+}
+
+#endif
+
+#endif // COORDINATOR_H
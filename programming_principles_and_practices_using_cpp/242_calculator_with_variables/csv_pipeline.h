@@ -0,0 +1,271 @@
+/*
+    csv_pipeline.h
+
+    One expression evaluated for every row of a CSV file (calculator --csv),
+    e.g. a*b-c/2 over a file whose header names columns a, b and c; the
+    values go to another file as a column of their own.
+
+    The file is read a chunk at a time into one buffer. Lines and fields are
+    string_views into that buffer, and the numbers of the columns the
+    expression uses are parsed in place with from_chars: nothing is copied,
+    and the other columns aren't converted at all. Rows are gathered into
+    blocks of one column per variable and evaluated a block at a time, in
+    batches (see batch.h) when the expression is plain arithmetic. The
+    output of a block is formatted into one string and written at once.
+    So memory use depends on the chunk size and the longest line, not on the
+    size of the file.
+
+    Fields may be quoted ("1.5"), but a quoted field may not contain a line
+    break. A row whose field for a variable isn't a number, or that is
+    missing the field, gets NaN and counts as an error, as does one at which
+    the expression can't be evaluated (e.g. divide by zero).
+*/
+
+#ifndef CSV_PIPELINE_H
+#define CSV_PIPELINE_H
+
+#include <charconv>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <string_view>
+#include "batch.h"
+#include "compiled_expression.h"
+#include "number_format.h"
+#include "std_lib_facilities.h" // after the standard headers: it #defines vector
+
+//------------------------------------------------------------------------------
+// the lines of a file, read a chunk at a time; a line is valid until the next call
+class Csv_chunk_reader
+{
+public:
+    explicit Csv_chunk_reader(const string &path, size_t chunk_size = 1 << 20);
+
+    bool next_line(string_view &line); // false at the end of the file
+    long bytes_read() const { return total; }
+
+private:
+    ifstream in;
+    vector<char> buffer; // grows only for a line longer than the chunk
+    size_t begin = 0;    // the unread part of the buffer is [begin, end)
+    size_t end = 0;
+    bool at_end = false;
+    long total = 0;
+
+    void refill(); // keep [begin, end), and read more after it
+};
+
+//------------------------------------------------------------------------------
+inline Csv_chunk_reader::Csv_chunk_reader(const string &path, size_t chunk_size)
+    : in(path, ios_base::binary), buffer(max(chunk_size, size_t(64)))
+{
+    if (!in)
+        error("can't open ", path);
+}
+
+//------------------------------------------------------------------------------
+inline void Csv_chunk_reader::refill()
+{
+    size_t rest = end - begin;
+    if (begin == 0 && end == buffer.size()) // a line longer than the buffer
+        buffer.resize(2 * buffer.size());
+    else
+        memmove(buffer.data(), buffer.data() + begin, rest);
+    begin = 0;
+    end = rest;
+    in.read(buffer.data() + end, buffer.size() - end);
+    end += in.gcount();
+    total += in.gcount();
+    if (!in)
+        at_end = true;
+}
+
+//------------------------------------------------------------------------------
+inline bool Csv_chunk_reader::next_line(string_view &line)
+{
+    for (;;)
+    {
+        const char *first = buffer.data() + begin;
+        const char *newline = static_cast<const char *>(memchr(first, '\n', end - begin));
+        if (newline || (at_end && begin < end)) // the last line may have no newline
+        {
+            const char *last = newline ? newline : buffer.data() + end;
+            begin = last - buffer.data() + (newline ? 1 : 0);
+            if (first < last && last[-1] == '\r')
+                --last;
+            line = string_view(first, last - first);
+            return true;
+        }
+        if (at_end)
+            return false;
+        refill();
+    }
+}
+
+//------------------------------------------------------------------------------
+// fields = the comma-separated fields of line; a quoted field keeps its quotes
+inline void split_fields(string_view line, vector<string_view> &fields)
+{
+    fields.clear();
+    size_t start = 0;
+    bool quoted = false;
+    for (size_t i = 0; i < line.size(); ++i)
+        if (line[i] == '"')
+            quoted = !quoted; // "" inside quotes toggles twice
+        else if (line[i] == ',' && !quoted)
+        {
+            fields.push_back(line.substr(start, i - start));
+            start = i + 1;
+        }
+    fields.push_back(line.substr(start));
+}
+
+//------------------------------------------------------------------------------
+// field without the spaces and the quotes around it
+inline string_view unquote(string_view field)
+{
+    auto trim = [&] {
+        while (!field.empty() && field.front() == ' ')
+            field.remove_prefix(1);
+        while (!field.empty() && field.back() == ' ')
+            field.remove_suffix(1);
+    };
+    trim();
+    if (2 <= field.size() && field.front() == '"' && field.back() == '"')
+    {
+        field = field.substr(1, field.size() - 2);
+        trim();
+    }
+    return field;
+}
+
+//------------------------------------------------------------------------------
+// the number that is all of field (spaces and quotes aside), in place
+inline bool parse_field(string_view field, double &x)
+{
+    field = unquote(field);
+    if (!field.empty() && field.front() == '+') // from_chars takes no +
+        field.remove_prefix(1);
+    const char *last = field.data() + field.size();
+    from_chars_result r = from_chars(field.data(), last, x);
+    return !field.empty() && r.ec == errc() && r.ptr == last;
+}
+
+//------------------------------------------------------------------------------
+class Csv_pipeline_result
+{
+public:
+    long rows = 0;
+    long errors = 0; // rows with NaN for a value
+    long bytes = 0;  // read
+    double seconds = 0;
+};
+
+//------------------------------------------------------------------------------
+// write column, then the value of code for each row of in to os; a header
+// line of in names the columns, which give the variables of code their values
+inline Csv_pipeline_result run_csv_pipeline(const Code &code, Csv_chunk_reader &in, ostream &os,
+                                            const string &column)
+{
+    auto start = chrono::steady_clock::now();
+    if (code.uses_matrices)
+        error("a CSV column needs an expression that yields a number");
+    string_view line;
+    vector<string_view> fields;
+    if (!in.next_line(line))
+        error("a CSV file needs a header line");
+    split_fields(line, fields);
+    vector<int> field_of_slot; // slot i gets field field_of_slot[i] of a row, or -1
+    for (int i = 0; i < int(code.names.size()); ++i)
+    {
+        int f = 0;
+        while (f < int(fields.size()) && unquote(fields[f]) != code.names[i])
+            ++f;
+        if (f == int(fields.size()) && !code.is_bound(i))
+            error("no column for variable ", code.names[i]);
+        field_of_slot.push_back(f < int(fields.size()) ? f : -1);
+    }
+
+    unique_ptr<Batch_evaluator<double>> batch;
+    if (Batch_evaluator<double>::can_run(code))
+        batch = make_unique<Batch_evaluator<double>>(code);
+    const int block = Batch_evaluator<double>::width; // rows evaluated together
+    const int count = code.names.size();
+    vector<double> columns(max(count, 1) * block);
+    vector<const double *> column_of_slot(count);
+    for (int i = 0; i < count; ++i)
+        column_of_slot[i] = columns.data() + i * block;
+    vector<double> slots(count);
+    double values[block];
+    bool bad[block]; // a field of the row isn't a number
+    Number_formatter shortest(Number_formatter::shortest);
+    string out;
+
+    Csv_pipeline_result r;
+    out = column + '\n';
+    os.write(out.data(), out.size());
+    for (bool more = true; more;)
+    {
+        int n = 0; // rows in this block
+        while (n < block && (more = in.next_line(line)))
+        {
+            if (line.empty())
+                continue;
+            split_fields(line, fields);
+            bad[n] = false;
+            for (int i = 0; i < count; ++i)
+            {
+                double &x = columns[i * block + n];
+                int f = field_of_slot[i];
+                if (0 <= f && !(f < int(fields.size()) && parse_field(fields[f], x)))
+                {
+                    bad[n] = true;
+                    x = 1; // not 0: that could make a batch divide by zero
+                }
+            }
+            ++n;
+        }
+
+        if (batch)
+            batch->run(column_of_slot.data(), n, values);
+        else
+            for (int p = 0; p < n; ++p)
+            {
+                values[p] = numeric_limits<double>::quiet_NaN();
+                if (bad[p])
+                    continue;
+                for (int i = 0; i < count; ++i)
+                    if (0 <= field_of_slot[i])
+                        slots[i] = columns[i * block + p];
+                try
+                {
+                    values[p] = run(code, 0, slots.data());
+                }
+                catch (exception &)
+                {
+                    // e.g. divide by zero in this row: NaN
+                }
+            }
+
+        out.clear();
+        for (int p = 0; p < n; ++p)
+        {
+            if (bad[p])
+                values[p] = numeric_limits<double>::quiet_NaN();
+            r.errors += values[p] != values[p];
+            out += shortest(values[p]);
+            out += '\n';
+        }
+        os.write(out.data(), out.size());
+        r.rows += n;
+    }
+    if (!os)
+        error("can't write the output");
+    r.bytes = in.bytes_read();
+    chrono::duration<double> t = chrono::steady_clock::now() - start;
+    r.seconds = t.count();
+    return r;
+}
+
+#endif // CSV_PIPELINE_H
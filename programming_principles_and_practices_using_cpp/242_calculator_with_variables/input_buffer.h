@@ -0,0 +1,158 @@
+/*
+    input_buffer.h
+
+    The buffer a Token_stream reads through, which it puts in front of the
+    buffer of its istream. Two things need the characters themselves
+    rather than one istream call per character:
+
+    skip_past(), the resynchronization after an error: it finds the next ;
+    with memchr over whatever has been read, a buffer at a time, instead of
+    cin >> ch for each character of a long malformed line.
+
+    position(), the line and column of the next character, for
+    diagnostics. Nothing is counted as characters are read; position()
+    counts the newlines (again with memchr) from where it last counted, and
+    a refill counts what it throws away first. So the position is right
+    however the characters were consumed: by >>, get(), or skip_past().
+
+    A refill takes the characters the source already has (in_avail()), and
+    waits for one only if there are none, so typing at a terminal works as
+    before: nothing waits for more input than a line.
+*/
+
+#ifndef INPUT_BUFFER_H
+#define INPUT_BUFFER_H
+
+#include <cstring>
+#include <streambuf>
+#include <string>
+#include "std_lib_facilities.h" // after the standard headers: it #defines vector
+
+//------------------------------------------------------------------------------
+class Text_position // of a character; both count from 1
+{
+public:
+    long line = 1;
+    long column = 1;
+};
+
+//------------------------------------------------------------------------------
+class Skipped_span // what an Input_buffer::skip_past() threw away
+{
+public:
+    Text_position from;   // the first character skipped
+    Text_position to;     // the character skipped past (or the end of the input)
+    long characters = 0;  // not counting the one skipped past
+    string text;          // the first max_shown of them
+    static const int max_shown = 40;
+};
+
+//------------------------------------------------------------------------------
+class Input_buffer : public streambuf
+{
+public:
+    explicit Input_buffer(streambuf *s) : src(s) { setg(nullptr, nullptr, nullptr); }
+    Input_buffer(const Input_buffer &) = delete;
+    Input_buffer &operator=(const Input_buffer &) = delete;
+
+    streambuf *source() const { return src; }
+    Text_position position(); // of the next character
+
+    // consume the characters up to and including the next c; false if the
+    // input ended first
+    bool skip_past(char c, Skipped_span &skipped);
+
+protected:
+    int_type underflow() override;
+
+private:
+    streambuf *src;
+    vector<char> buffer;
+    static constexpr size_t max_size = 1 << 16;
+    const char *mark = nullptr; // the characters before mark have been counted...
+    Text_position counted;      // ...so this is the position of the character at mark
+
+    void count_to(const char *p);
+};
+
+//------------------------------------------------------------------------------
+inline void Input_buffer::count_to(const char *p)
+{
+    if (!mark || p <= mark)
+        return;
+    const char *line_start = nullptr;
+    for (const char *q = mark; (q = static_cast<const char *>(memchr(q, '\n', p - q)));)
+    {
+        ++counted.line;
+        line_start = ++q;
+    }
+    counted.column = line_start ? 1 + (p - line_start) : counted.column + (p - mark);
+    mark = p;
+}
+
+inline Text_position Input_buffer::position()
+{
+    count_to(gptr());
+    return counted;
+}
+
+//------------------------------------------------------------------------------
+inline Input_buffer::int_type Input_buffer::underflow()
+{
+    if (gptr() < egptr())
+        return traits_type::to_int_type(*gptr());
+    count_to(egptr());
+    char last = 0;
+    size_t keep = 0; // the last character read stays, for putback()
+    if (eback() < egptr())
+    {
+        last = egptr()[-1];
+        keep = 1;
+    }
+    int_type first = src->sbumpc(); // wait for one character only if there is none yet
+    streamsize available = first == traits_type::eof() ? 0 : src->in_avail();
+    size_t more = available <= 0 ? 0 : min(size_t(available), max_size);
+    buffer.resize(keep + (first != traits_type::eof()) + more);
+    if (keep)
+        buffer[0] = last;
+    if (first != traits_type::eof())
+    {
+        buffer[keep] = traits_type::to_char_type(first);
+        buffer.resize(keep + 1 + src->sgetn(buffer.data() + keep + 1, more));
+    }
+    char *b = buffer.data();
+    setg(b, b + keep, b + buffer.size());
+    mark = gptr();
+    return gptr() < egptr() ? traits_type::to_int_type(*gptr()) : traits_type::eof();
+}
+
+//------------------------------------------------------------------------------
+inline bool Input_buffer::skip_past(char c, Skipped_span &skipped)
+{
+    skipped = Skipped_span();
+    skipped.from = position();
+    for (;;)
+    {
+        if (gptr() == egptr() && underflow() == traits_type::eof())
+        {
+            skipped.to = position();
+            return false;
+        }
+        char *first = gptr();
+        const char *hit = static_cast<const char *>(memchr(first, c, egptr() - first));
+        const char *last = hit ? hit : egptr();
+        size_t shown = min<size_t>(last - first, Skipped_span::max_shown - skipped.text.size());
+        skipped.text.append(first, shown);
+        skipped.characters += last - first;
+        if (hit)
+        {
+            setg(eback(), const_cast<char *>(hit), egptr());
+            skipped.to = position();
+            gbump(1);
+            return true;
+        }
+        setg(eback(), egptr(), egptr());
+    }
+}
+
+#endif // INPUT_BUFFER_H
@@ -0,0 +1,394 @@
+/*
+    instruments.h
+
+    Counters that show where a slow calculator spends its effort: tokens
+    lexed, tokens put back, characters skipped by Token_stream::ignore()
+    after an error, errors by message, how often parsing reaches each
+    nesting depth (of parentheses, signs, calls, and matrices; see Nesting
+    in budget.h), and the latency of statements by kind.
+
+    They are always compiled in, but off unless the environment variable
+    CALCULATOR_STATS names a file ("-" for cerr). Each counting point costs
+    one test of a bool when they are off; when they are on, a relaxed
+    atomic increment (errors, nesting and latencies take a mutex, but they
+    are counted once per statement). The counters are written as JSON to
+    the file when the program exits and, on POSIX systems, whenever the
+    process gets SIGUSR1 (kill -USR1 pid).
+
+    Latencies go into Hdr_histograms: log-linear buckets, as in Gil Tene's
+    HdrHistogram, that keep three significant digits of any value from a
+    nanosecond to an hour in a fixed array, and record a value with a few
+    bit operations. The JSON has some percentiles of each and its full
+    percentile distribution in HdrHistogram's text format, which the
+    HdrHistogram plotter reads.
+*/
+
+#ifndef INSTRUMENTS_H
+#define INSTRUMENTS_H
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#if defined(__unix__) || defined(__APPLE__)
+#include <pthread.h>
+#include <signal.h>
+#define INSTRUMENTS_POSIX 1
+#endif
+#include "std_lib_facilities.h" // after the standard headers: it #defines vector
+
+//------------------------------------------------------------------------------
+// counts of values (nanoseconds) with three significant digits, from 1 to an hour
+class Hdr_histogram
+{
+public:
+    Hdr_histogram();
+
+    void record(int64_t value);
+    int64_t count() const { return total; }
+    int64_t min() const { return total ? lowest : 0; }
+    int64_t max() const { return highest; }
+    double mean() const;
+    double stddev() const;
+    int64_t value_at_percentile(double percentile) const; // percentile in [0,100]
+
+    // HdrHistogram's percentile distribution, values divided by scale (e.g. 1000 for microseconds)
+    string percentile_distribution(double scale) const;
+
+private:
+    static constexpr int64_t highest_trackable = 3600LL * 1000000000; // an hour in ns
+    static constexpr int sub_bucket_half_magnitude = 10;               // 2048 sub-buckets: 3 digits
+    static constexpr int64_t sub_bucket_half_count = 1 << sub_bucket_half_magnitude;
+    static constexpr int64_t sub_bucket_mask = 2 * sub_bucket_half_count - 1;
+
+    int bucket_count;
+    vector<int64_t> counts;
+    int64_t total = 0;
+    int64_t lowest = numeric_limits<int64_t>::max();
+    int64_t highest = 0;
+
+    int index_of(int64_t value) const;
+    int64_t value_from_index(int index) const;       // the lowest value counted at index
+    int64_t highest_equivalent(int index) const;      // the highest value counted at index
+};
+
+//------------------------------------------------------------------------------
+inline Hdr_histogram::Hdr_histogram()
+{
+    bucket_count = 1;
+    for (int64_t smallest_untrackable = 2 * sub_bucket_half_count; smallest_untrackable <= highest_trackable;
+         smallest_untrackable <<= 1)
+        ++bucket_count;
+    counts = vector<int64_t>((bucket_count + 1) * sub_bucket_half_count);
+}
+
+//------------------------------------------------------------------------------
+inline int Hdr_histogram::index_of(int64_t value) const
+{
+    uint64_t v = uint64_t(value) | sub_bucket_mask;
+#if defined(__GNUC__)
+    int pow2ceiling = 64 - __builtin_clzll(v);
+#else
+    int pow2ceiling = 0;
+    while (v >> pow2ceiling)
+        ++pow2ceiling;
+#endif
+    int bucket = pow2ceiling - (sub_bucket_half_magnitude + 1);
+    int64_t sub_bucket = value >> bucket;
+    return ((bucket + 1) << sub_bucket_half_magnitude) + int(sub_bucket - sub_bucket_half_count);
+}
+
+inline int64_t Hdr_histogram::value_from_index(int index) const
+{
+    int bucket = (index >> sub_bucket_half_magnitude) - 1;
+    int64_t sub_bucket = (index & (sub_bucket_half_count - 1)) + sub_bucket_half_count;
+    if (bucket < 0)
+    {
+        sub_bucket -= sub_bucket_half_count;
+        bucket = 0;
+    }
+    return sub_bucket << bucket;
+}
+
+inline int64_t Hdr_histogram::highest_equivalent(int index) const
+{
+    int bucket = std::max((index >> sub_bucket_half_magnitude) - 1, 0);
+    return value_from_index(index) + (int64_t(1) << bucket) - 1;
+}
+
+//------------------------------------------------------------------------------
+inline void Hdr_histogram::record(int64_t value)
+{
+    value = std::max<int64_t>(1, std::min(value, highest_trackable)); // clamp rather than lose it
+    ++counts[index_of(value)];
+    ++total;
+    lowest = std::min(lowest, value);
+    highest = std::max(highest, value);
+}
+
+//------------------------------------------------------------------------------
+inline double Hdr_histogram::mean() const
+{
+    if (!total)
+        return 0;
+    double sum = 0;
+    for (int i = 0; i < int(counts.size()); ++i)
+        if (counts[i])
+            sum += double(counts[i]) * ((value_from_index(i) + highest_equivalent(i)) / 2);
+    return sum / total;
+}
+
+inline double Hdr_histogram::stddev() const
+{
+    if (!total)
+        return 0;
+    double m = mean();
+    double sum = 0;
+    for (int i = 0; i < int(counts.size()); ++i)
+        if (counts[i])
+        {
+            double d = (value_from_index(i) + highest_equivalent(i)) / 2 - m;
+            sum += d * d * counts[i];
+        }
+    return sqrt(sum / total);
+}
+
+//------------------------------------------------------------------------------
+inline int64_t Hdr_histogram::value_at_percentile(double percentile) const
+{
+    int64_t wanted = std::max<int64_t>(1, int64_t(ceil(std::min(percentile, 100.0) / 100 * total)));
+    int64_t seen = 0;
+    for (int i = 0; i < int(counts.size()); ++i)
+    {
+        seen += counts[i];
+        if (wanted <= seen)
+            return highest_equivalent(i);
+    }
+    return 0;
+}
+
+//------------------------------------------------------------------------------
+// the format of HdrHistogram's outputPercentileDistribution(), with 5 ticks
+// per halving of the distance to 100%
+inline string Hdr_histogram::percentile_distribution(double scale) const
+{
+    ostringstream os;
+    char line[128];
+    snprintf(line, sizeof line, "%12s %14s %10s %14s\n\n", "Value", "Percentile", "TotalCount", "1/(1-Percentile)");
+    os << line;
+    const int ticks_per_half_distance = 5;
+    double level = 0; // the next percentile to report
+    int64_t seen = 0;
+    for (int i = 0; i < int(counts.size()) && total; ++i)
+    {
+        if (!counts[i])
+            continue;
+        seen += counts[i];
+        double reached = 100.0 * seen / total;
+        while (level <= reached && 100 < (100 - level) * total) // down to a fraction of one count
+        {
+            snprintf(line, sizeof line, "%12.3f %2.12f %10lld %14.2f\n", highest_equivalent(i) / scale,
+                     level / 100, (long long)seen, 1 / (1 - level / 100));
+            os << line;
+            double half_distance = pow(2, floor(log2(100 / (100 - level))) + 1);
+            level += 100 / (ticks_per_half_distance * half_distance);
+        }
+        if (seen == total)
+        {
+            snprintf(line, sizeof line, "%12.3f %2.12f %10lld\n", highest_equivalent(i) / scale, 1.0,
+                     (long long)seen);
+            os << line;
+            break;
+        }
+    }
+    snprintf(line, sizeof line, "#[Mean    = %12.3f, StdDeviation   = %12.3f]\n", mean() / scale, stddev() / scale);
+    os << line;
+    snprintf(line, sizeof line, "#[Max     = %12.3f, Total count    = %12lld]\n", highest / scale, (long long)total);
+    os << line;
+    snprintf(line, sizeof line, "#[Buckets = %12d, SubBuckets     = %12lld]\n", bucket_count, (long long)(2 * sub_bucket_half_count));
+    os << line;
+    return os.str();
+}
+
+//------------------------------------------------------------------------------
+// the counters; see instruments()
+class Instruments
+{
+public:
+    atomic<long> tokens{0};   // lexed from input (not taken from the putback buffer)
+    atomic<long> putbacks{0};
+    atomic<long> skipped{0};  // characters ignore() threw away
+    static const int max_depth = 64;
+    atomic<long> nesting[max_depth + 1] = {}; // times a depth was reached; the last counts all deeper ones
+
+    void depth(int d) { nesting[d < max_depth ? d : max_depth].fetch_add(1, memory_order_relaxed); }
+    void error(const string &message);
+    void statement(const string &kind, chrono::steady_clock::duration latency);
+    string json();
+
+private:
+    mutex m; // protects the rest
+    map<string, long> errors;
+    map<string, Hdr_histogram> latency; // by kind of statement
+};
+
+inline bool instrumented = false; // is anybody counting? Test this before calling instruments()
+
+inline Instruments &instruments()
+{
+    static Instruments i;
+    return i;
+}
+
+//------------------------------------------------------------------------------
+inline void Instruments::error(const string &message)
+{
+    lock_guard<mutex> lock(m);
+    ++errors[message];
+}
+
+inline void Instruments::statement(const string &kind, chrono::steady_clock::duration t)
+{
+    lock_guard<mutex> lock(m);
+    latency[kind].record(chrono::duration_cast<chrono::nanoseconds>(t).count());
+}
+
+//------------------------------------------------------------------------------
+// times one statement, if anybody is counting
+class Statement_clock
+{
+public:
+    Statement_clock() : start(instrumented ? chrono::steady_clock::now() : chrono::steady_clock::time_point()) {}
+    void stop(const string &kind) // the statement was of this kind
+    {
+        if (instrumented)
+            instruments().statement(kind, chrono::steady_clock::now() - start);
+    }
+
+private:
+    chrono::steady_clock::time_point start;
+};
+
+//------------------------------------------------------------------------------
+inline string json_string(const string &s)
+{
+    string r = "\"";
+    for (char c : s)
+    {
+        if (c == '"' || c == '\\')
+            r += '\\';
+        if (0 <= c && c < ' ')
+        {
+            char escape[8];
+            snprintf(escape, sizeof escape, "\\u%04x", c);
+            r += escape;
+        }
+        else
+            r += c;
+    }
+    return r + '"';
+}
+
+//------------------------------------------------------------------------------
+inline string Instruments::json()
+{
+    lock_guard<mutex> lock(m);
+    ostringstream os;
+    os << "{\n  \"tokens\": " << tokens << ",\n  \"putbacks\": " << putbacks
+       << ",\n  \"ignored_characters\": " << skipped << ",\n  \"errors\": {";
+    const char *separator = "";
+    for (const auto &e : errors)
+    {
+        os << separator << "\n    " << json_string(e.first) << ": " << e.second;
+        separator = ",";
+    }
+    os << "\n  },\n  \"nesting\": {";
+    separator = "";
+    for (int d = 0; d <= max_depth; ++d)
+        if (nesting[d])
+        {
+            os << separator << "\n    \"" << d << (d == max_depth ? "+" : "") << "\": " << nesting[d];
+            separator = ",";
+        }
+    os << "\n  },\n  \"latency_us\": {";
+    separator = "";
+    for (const auto &l : latency)
+    {
+        const Hdr_histogram &h = l.second;
+        os << separator << "\n    " << json_string(l.first) << ": {\"count\": " << h.count()
+           << ", \"min\": " << h.min() / 1e3 << ", \"mean\": " << h.mean() / 1e3
+           << ", \"p50\": " << h.value_at_percentile(50) / 1e3 << ", \"p90\": " << h.value_at_percentile(90) / 1e3
+           << ", \"p99\": " << h.value_at_percentile(99) / 1e3
+           << ", \"p99.9\": " << h.value_at_percentile(99.9) / 1e3 << ", \"max\": " << h.max() / 1e3
+           << ",\n      \"hdr\": " << json_string(h.percentile_distribution(1e3)) << "}";
+        separator = ",";
+    }
+    os << "\n  }\n}\n";
+    return os.str();
+}
+
+//------------------------------------------------------------------------------
+inline string &instruments_path() // where the JSON goes
+{
+    static string path;
+    return path;
+}
+
+inline mutex &instruments_file_mutex() // the SIGUSR1 thread and atexit() may both write
+{
+    static mutex m;
+    return m;
+}
+
+inline void write_instruments()
+{
+    string s = instruments().json();
+    lock_guard<mutex> lock(instruments_file_mutex());
+    if (instruments_path() == "-")
+        cerr << s;
+    else
+        ofstream(instruments_path()) << s;
+}
+
+//------------------------------------------------------------------------------
+// turn the counters on if CALCULATOR_STATS says so; call before starting any
+// threads, so that they all leave SIGUSR1 to the thread that writes the counters
+// (processes forked later, such as sweep workers, get it back)
+inline void start_instruments()
+{
+    const char *path = getenv("CALCULATOR_STATS");
+    if (!path || !*path)
+        return;
+    instruments_path() = path;
+    instrumented = true;
+    instruments(); // constructed before atexit(): destroyed after write_instruments() runs
+    instruments_file_mutex();
+    atexit(write_instruments);
+#ifdef INSTRUMENTS_POSIX
+    sigset_t usr1;
+    sigemptyset(&usr1);
+    sigaddset(&usr1, SIGUSR1);
+    sigset_t before;
+    pthread_sigmask(SIG_BLOCK, &usr1, &before); // inherited by threads started later
+    if (!sigismember(&before, SIGUSR1))
+        pthread_atfork(nullptr, nullptr, [] { // but not by a child, which has no thread to take it
+            sigset_t usr1;
+            sigemptyset(&usr1);
+            sigaddset(&usr1, SIGUSR1);
+            pthread_sigmask(SIG_UNBLOCK, &usr1, nullptr);
+        });
+    thread([usr1] {
+        for (int signal; sigwait(&usr1, &signal) == 0;)
+            write_instruments();
+    }).detach();
+#endif
+}
+
+#endif // INSTRUMENTS_H
@@ -0,0 +1,308 @@
+/*
+    integrate.h
+
+    The built-ins integrate(expr, var, a, b, tol) and solve(expr, var, lo, hi).
+
+    integrate() uses adaptive Gauss-Kronrod quadrature: each interval is evaluated
+    with the 15-point Kronrod rule and the embedded 7-point Gauss rule; their
+    difference estimates the error. An interval whose error is larger than its
+    share of tol is split in two, and the halves are handed to the
+    Work_stealing_pool, so the splitting spreads over all cores.
+
+    The pieces are added up in order of their left end point once all of them are
+    done, so the result does not depend on which thread finished first.
+
+    solve() finds a root of expr in [lo,hi] with Brent's method (bisection mixed
+    with secant and inverse quadratic interpolation).
+
+    Both write a line with the number of evaluations and the run time to cerr.
+    When one is called from inside the integrand of another (a double integral)
+    only the outermost call reports, and its count includes the inner ones.
+*/
+
+#ifndef INTEGRATE_H
+#define INTEGRATE_H
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include "compiled_expression.h"
+#include "work_stealing_pool.h"
+#include "std_lib_facilities.h"
+
+//------------------------------------------------------------------------------
+// abscissae of the 15-point Kronrod rule on [-1,1] (xgk[1], xgk[3], ... are the Gauss points)
+const double xgk[8] = {
+    0.991455371120812639206854697526329, 0.949107912342758524526189684047851,
+    0.864864423359769072789712788640926, 0.741531185599394439863864773280788,
+    0.586087235467691130294144845693013, 0.405845151377397166906606412076961,
+    0.207784955007898467600689403773245, 0.000000000000000000000000000000000};
+
+// weights of the 15-point Kronrod rule
+const double wgk[8] = {
+    0.022935322010529224963732008058970, 0.063092092629978553290700663189204,
+    0.104790010322250183839876322541518, 0.140653259715525918745189590510238,
+    0.169004726639267902826583426598550, 0.190350578064785409913256402421014,
+    0.204432940075298892414161999234649, 0.209482141084727828012999174891714};
+
+// weights of the 7-point Gauss rule
+const double wg[4] = {
+    0.129484966168869693270611432679082, 0.279705391489276667901467771423780,
+    0.381830050505118944950369775488975, 0.417959183673469387755102040816327};
+
+const int max_split_depth = 50; // give up refining an interval after this many halvings
+
+inline bool builtin_reports = true;            // write statistics to cerr? (not in sweeps)
+inline atomic<long> integrand_evaluations{0};  // by all calls of integrate() and solve()
+inline thread_local int integrand_nesting = 0; // > 0 while this thread evaluates an integrand
+
+//------------------------------------------------------------------------------
+// evaluate the body of call with its variable set to x
+inline double evaluate_integrand(const Code_view &code, const Call_site &call, double *slots, double x)
+{
+    slots[call.var] = x;
+    ++integrand_nesting;
+    try
+    {
+        double d = run(code, call.body, slots);
+        --integrand_nesting;
+        return d;
+    }
+    catch (...)
+    {
+        --integrand_nesting;
+        throw;
+    }
+}
+
+//------------------------------------------------------------------------------
+class Piece // the contribution of one finished interval
+{
+public:
+    double a;     // left end point; used to add the pieces in a fixed order
+    double value; // Kronrod estimate of the integral over the interval
+    double error; // |Kronrod - Gauss|
+};
+
+//------------------------------------------------------------------------------
+class Integration // the shared state of one call of integrate()
+{
+public:
+    Code_view code;
+    Call_site call;
+    vector<double> slots; // the caller's slots; each task copies them
+    double width;         // |b-a| of the whole range
+    double tol;
+    atomic<bool> failed; // an integrand evaluation threw; stop splitting
+    bool tolerance_met;
+    Statement_budget *budget; // of the statement that called integrate(); tasks charge it
+    mutex m; // protects pieces and tolerance_met
+    vector<Piece> pieces;
+
+    Integration(const Code_view &c, const Call_site &cs, const double *s, double w, double t)
+        : code(c), call(cs), slots(s, s + c.slots), width(w), tol(t),
+          failed(false), tolerance_met(true), budget(Statement_budget::current)
+    {
+    }
+};
+
+//------------------------------------------------------------------------------
+// integrate over [a,b], splitting as needed; runs as a task on the pool
+inline void integrate_interval(Integration &job, Task_group &group, double a, double b, int depth)
+{
+    if (job.failed)
+        return;
+
+    Budget_scope scope(job.budget); // we may be on another thread than the caller
+    vector<double> slots = job.slots;
+    auto f = [&](double x) { return evaluate_integrand(job.code, job.call, slots.data(), x); };
+
+    double center = (a + b) / 2;
+    double half = (b - a) / 2;
+    double kronrod = 0;
+    double gauss = 0;
+    try
+    {
+        double fc = f(center);
+        kronrod = fc * wgk[7];
+        gauss = fc * wg[3];
+        for (int j = 0; j < 7; ++j)
+        {
+            double dx = half * xgk[j];
+            double sum = f(center - dx) + f(center + dx);
+            kronrod += wgk[j] * sum;
+            if (j % 2 == 1)
+                gauss += wg[j / 2] * sum;
+        }
+    }
+    catch (...)
+    {
+        job.failed = true; // tell the other tasks not to bother
+        throw;
+    }
+    kronrod *= half;
+    gauss *= half;
+    integrand_evaluations += 15;
+
+    double error = abs(kronrod - gauss);
+    double allowed = job.tol * abs(b - a) / job.width; // this interval's share of tol
+    bool too_small = center == a || center == b;        // no more room to split
+    if (error <= allowed || depth == max_split_depth || too_small)
+    {
+        lock_guard<mutex> lock(job.m);
+        job.pieces.push_back(Piece{a, kronrod, error});
+        if (allowed < error)
+            job.tolerance_met = false;
+        return;
+    }
+
+    // let another worker take the left half; keep the right half ourselves
+    group.run([&job, &group, a, center, depth] { integrate_interval(job, group, a, center, depth + 1); });
+    integrate_interval(job, group, center, b, depth + 1);
+}
+
+//------------------------------------------------------------------------------
+inline double integrate(const Code_view &code, const Call_site &call, const double *slots,
+                        double a, double b, double tol)
+{
+    if (tol <= 0)
+        error(literal("integrate: tolerance must be positive"));
+    if (a == b)
+        return 0;
+
+    auto start = chrono::steady_clock::now();
+    long evaluations = integrand_evaluations;
+    Integration job(code, call, slots, abs(b - a), tol);
+    {
+        Task_group group;
+        group.run([&job, &group, a, b] { integrate_interval(job, group, a, b, 0); });
+        group.wait();
+    }
+
+    // add up in a fixed order, so that the last bits don't depend on thread timing
+    sort(job.pieces, [](const Piece &p, const Piece &q) { return p.a < q.a; });
+    double sum = 0;
+    double error_estimate = 0;
+    for (const Piece &p : job.pieces)
+    {
+        sum += p.value;
+        error_estimate += p.error;
+    }
+
+    if (builtin_reports && integrand_nesting == 0)
+    {
+        chrono::duration<double, milli> t = chrono::steady_clock::now() - start;
+        cerr << "integrate: " << integrand_evaluations - evaluations << " evaluations, "
+             << job.pieces.size() << " intervals, estimated error " << error_estimate
+             << (job.tolerance_met ? "" : " (tolerance not met)")
+             << ", " << t.count() << " ms\n";
+    }
+    return sum;
+}
+
+//------------------------------------------------------------------------------
+inline double solve(const Code_view &code, const Call_site &call, const double *s,
+                    double lo, double hi)
+{
+    auto start = chrono::steady_clock::now();
+    long evaluations = integrand_evaluations;
+    vector<double> slots(s, s + code.slots);
+    auto f = [&](double x) {
+        ++integrand_evaluations;
+        return evaluate_integrand(code, call, slots.data(), x);
+    };
+
+    double a = lo;
+    double b = hi;
+    double fa = f(a);
+    double fb = f(b);
+    if (0 < fa * fb)
+        error(literal("solve: no sign change between lo and hi"));
+    if (fa == 0)
+    {
+        b = a;
+        fb = fa;
+    }
+
+    // Brent's method: b is the best guess so far, a the previous one, c brackets the root with b
+    double c = a;
+    double fc = fa;
+    double d = b - a;
+    double e = d;
+    int iterations = 0;
+    const int max_iterations = 200;
+    for (; fb != 0 && iterations < max_iterations; ++iterations)
+    {
+        if (0 < fb * fc)
+        {
+            c = a;
+            fc = fa;
+            d = e = b - a;
+        }
+        if (abs(fc) < abs(fb))
+        {
+            a = b;
+            b = c;
+            c = a;
+            fa = fb;
+            fb = fc;
+            fc = fa;
+        }
+        double tol = 2 * numeric_limits<double>::epsilon() * abs(b) + 1e-300;
+        double m = (c - b) / 2;
+        if (abs(m) <= tol)
+            break;
+
+        if (tol <= abs(e) && abs(fb) < abs(fa))
+        {
+            // try interpolation
+            double p, q;
+            double s = fb / fa;
+            if (a == c) // secant
+            {
+                p = 2 * m * s;
+                q = 1 - s;
+            }
+            else // inverse quadratic
+            {
+                double r = fb / fc;
+                double t = fa / fc;
+                p = s * (2 * m * t * (t - r) - (b - a) * (r - 1));
+                q = (t - 1) * (r - 1) * (s - 1);
+            }
+            if (0 < p)
+                q = -q;
+            else
+                p = -p;
+            if (2 * p < min(3 * m * q - abs(tol * q), abs(e * q)))
+            {
+                e = d; // accept interpolation
+                d = p / q;
+            }
+            else
+            {
+                d = m; // interpolation failed; bisect
+                e = d;
+            }
+        }
+        else
+        {
+            d = m; // bisect
+            e = d;
+        }
+        a = b;
+        fa = fb;
+        b += tol < abs(d) ? d : (0 < m ? tol : -tol);
+        fb = f(b);
+    }
+
+    if (builtin_reports && integrand_nesting == 0)
+    {
+        chrono::duration<double, milli> t = chrono::steady_clock::now() - start;
+        cerr << "solve: " << integrand_evaluations - evaluations << " evaluations, "
+             << iterations << " iterations, " << t.count() << " ms\n";
+    }
+    return b;
+}
+
+#endif // INTEGRATE_H
@@ -0,0 +1,425 @@
+/*
+    matrix.h
+
+    Matrices for the calculator, and Value: what a calculator expression yields,
+    either a number or a matrix.
+
+    A Matrix shares its elements with the matrices it was made from where it can:
+    the elements live in a shared vector and are addressed through a row stride
+    and a column stride, so transpose() just swaps the strides and never copies.
+    Values never change a Matrix after it has been built, so the sharing is safe.
+
+    multiply() is blocked for the caches in the usual way:
+        - the right-hand operand is copied ("packed") in blocks of kc rows by nc
+          columns, laid out as strips of nr columns;
+        - the left-hand operand is packed in blocks of mc rows by kc columns,
+          laid out as strips of mr rows; such a block stays in the L2 cache;
+        - a small kernel computes an mr by nr piece of the result from one
+          strip of each, keeping the piece in registers and using the compiler's
+          vector types (SIMD) where available. One strip of the right-hand
+          block (kc by nr) stays in the L1 cache while the kernel works
+          through the strips of the left-hand block.
+    Packing also takes care of transposed operands: the kernel never sees strides.
+    Above parallel_threshold multiply-adds, the mc blocks of the left operand are
+    shared out over the Work_stealing_pool.
+
+    Matrix-vector products don't need blocking (every element of the matrix is
+    used once): they run straight over the matrix in whichever direction is
+    contiguous in memory.
+*/
+
+#ifndef MATRIX_H
+#define MATRIX_H
+
+#include <memory>
+#include "work_stealing_pool.h"
+#include "std_lib_facilities.h" // after the standard headers: it #defines vector
+
+//------------------------------------------------------------------------------
+class Matrix
+{
+public:
+    Matrix(int rows, int cols); // a rows by cols matrix of zeros
+
+    int rows() const { return r; }
+    int cols() const { return c; }
+    long size() const { return long(r) * c; }
+
+    double operator()(int i, int j) const { return p[i * row_stride + j * col_stride]; }
+    double &operator()(int i, int j) { return p[i * row_stride + j * col_stride]; }
+
+    Matrix transpose() const; // shares the elements; O(1)
+
+    // the layout, for the kernels:
+    const double *data() const { return p; }
+    long stride_of_rows() const { return row_stride; }    // distance from (i,j) to (i+1,j)
+    long stride_of_columns() const { return col_stride; } // distance from (i,j) to (i,j+1)
+
+private:
+    int r, c;
+    long row_stride, col_stride;
+    shared_ptr<vector<double>> elements; // shared with transposed views
+    double *p;                           // elements->data(), to avoid range checks
+};
+
+//------------------------------------------------------------------------------
+inline Matrix::Matrix(int rows, int cols)
+    : r(rows), c(cols), row_stride(cols), col_stride(1)
+{
+    if (rows < 0 || cols < 0)
+        error("negative matrix size");
+    elements = make_shared<vector<double>>(size_t(rows) * cols);
+    p = elements->data();
+}
+
+//------------------------------------------------------------------------------
+inline Matrix Matrix::transpose() const
+{
+    Matrix t = *this; // copies the pointer to the elements, not the elements
+    swap(t.r, t.c);
+    swap(t.row_stride, t.col_stride);
+    return t;
+}
+
+//------------------------------------------------------------------------------
+inline Matrix identity(int n)
+{
+    Matrix m(n, n);
+    for (int i = 0; i < n; ++i)
+        m(i, i) = 1;
+    return m;
+}
+
+//------------------------------------------------------------------------------
+// the block sizes of multiply(); see the comment at the top
+#if defined(__AVX__)
+const int simd_lanes = 4; // doubles in a vector register: AVX has 32-byte registers...
+#else
+const int simd_lanes = 2; // ...x86-64 without -mavx (or -march) only the 16 bytes of SSE2
+#endif
+const int mr = 4;     // rows of the register kernel
+const int nr = 2 * simd_lanes; // columns of the register kernel: the tile takes 2*mr registers
+const int mc = 128;   // rows of a packed block of the left operand
+const int kc = 256;   // depth of the packed blocks
+const int nc = 2048;  // columns of a packed block of the right operand
+const long parallel_threshold = 128L * 128 * 128; // multiply-adds below which we stay on one thread
+
+//------------------------------------------------------------------------------
+// copy rows [i0,i0+m) and columns [p0,p0+k) of a into strips of mr rows:
+// strip s holds a(i0+s*mr+ii, p0+q) at buffer[s*mr*k + q*mr + ii]; missing rows are 0
+inline void pack_left(const Matrix &a, int i0, int m, int p0, int k, double *buffer)
+{
+    const double *base = a.data();
+    long rs = a.stride_of_rows();
+    long cs = a.stride_of_columns();
+    for (int s = 0; s < m; s += mr)
+    {
+        int rows = min(mr, m - s);
+        for (int q = 0; q < k; ++q)
+        {
+            const double *from = base + (i0 + s) * rs + (p0 + q) * cs;
+            for (int ii = 0; ii < rows; ++ii)
+                buffer[ii] = from[ii * rs];
+            for (int ii = rows; ii < mr; ++ii)
+                buffer[ii] = 0;
+            buffer += mr;
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+// copy rows [p0,p0+k) and columns [j0,j0+n) of b into strips of nr columns:
+// strip s holds b(p0+q, j0+s*nr+jj) at buffer[s*nr*k + q*nr + jj]; missing columns are 0
+inline void pack_right(const Matrix &b, int p0, int k, int j0, int n, double *buffer)
+{
+    const double *base = b.data();
+    long rs = b.stride_of_rows();
+    long cs = b.stride_of_columns();
+    for (int s = 0; s < n; s += nr)
+    {
+        int cols = min(nr, n - s);
+        for (int q = 0; q < k; ++q)
+        {
+            const double *from = base + (p0 + q) * rs + (j0 + s) * cs;
+            for (int jj = 0; jj < cols; ++jj)
+                buffer[jj] = from[jj * cs];
+            for (int jj = cols; jj < nr; ++jj)
+                buffer[jj] = 0;
+            buffer += nr;
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+// tile[ii*nr+jj] = sum over q of a[q*mr+ii] * b[q*nr+jj]: an mr by nr piece of a product
+// (a vector wider than the registers would be split up by the compiler, at a
+// cost: 4 lanes without AVX made the kernel slower than the naive loop)
+#if defined(__GNUC__)
+typedef double Simd_double __attribute__((vector_size(simd_lanes * sizeof(double))));
+
+inline void kernel(int k, const double *a, const double *b, double *tile)
+{
+    Simd_double c[mr][2] = {}; // the tile, in registers
+    for (int q = 0; q < k; ++q)
+    {
+        Simd_double b0, b1;
+        __builtin_memcpy(&b0, b + q * nr, sizeof b0); // packed strips are not aligned for vectors
+        __builtin_memcpy(&b1, b + q * nr + simd_lanes, sizeof b1);
+        for (int ii = 0; ii < mr; ++ii)
+        {
+            double x = a[q * mr + ii];
+            c[ii][0] += x * b0;
+            c[ii][1] += x * b1;
+        }
+    }
+    __builtin_memcpy(tile, c, sizeof c);
+}
+#else
+inline void kernel(int k, const double *a, const double *b, double *tile)
+{
+    double c[mr * nr] = {};
+    for (int q = 0; q < k; ++q)
+        for (int ii = 0; ii < mr; ++ii)
+            for (int jj = 0; jj < nr; ++jj)
+                c[ii * nr + jj] += a[q * mr + ii] * b[q * nr + jj];
+    for (int i = 0; i < mr * nr; ++i)
+        tile[i] = c[i];
+}
+#endif
+
+//------------------------------------------------------------------------------
+// result(i0.., j0..) += packed left block (m by k) * packed right block (k by n)
+inline void multiply_block(const double *left, const double *right, int m, int k, int n,
+                           double *result, long ldr)
+{
+    double tile[mr * nr];
+    for (int js = 0; js < n; js += nr)
+        for (int is = 0; is < m; is += mr)
+        {
+            kernel(k, left + is * k, right + js * k, tile);
+            int rows = min(mr, m - is);
+            int cols = min(nr, n - js);
+            for (int ii = 0; ii < rows; ++ii)
+                for (int jj = 0; jj < cols; ++jj)
+                    result[(is + ii) * ldr + js + jj] += tile[ii * nr + jj];
+        }
+}
+
+//------------------------------------------------------------------------------
+// y = a*x for a column vector x
+inline Matrix multiply_vector(const Matrix &a, const Matrix &x)
+{
+    int m = a.rows();
+    int k = a.cols();
+    Matrix y(m, 1);
+    const double *pa = a.data();
+    const double *px = x.data();
+    long xs = x.stride_of_rows();
+    double *py = &y(0, 0);
+    if (a.stride_of_columns() == 1) // rows are contiguous: one dot product per row
+    {
+        long rs = a.stride_of_rows();
+        for (int i = 0; i < m; ++i)
+        {
+            const double *row = pa + i * rs;
+            double s0 = 0, s1 = 0, s2 = 0, s3 = 0; // independent sums, so they can be vectorized
+            int q = 0;
+            for (; q + 4 <= k; q += 4)
+            {
+                s0 += row[q] * px[q * xs];
+                s1 += row[q + 1] * px[(q + 1) * xs];
+                s2 += row[q + 2] * px[(q + 2) * xs];
+                s3 += row[q + 3] * px[(q + 3) * xs];
+            }
+            for (; q < k; ++q)
+                s0 += row[q] * px[q * xs];
+            py[i] = (s0 + s1) + (s2 + s3);
+        }
+    }
+    else // columns are contiguous (e.g. a transposed view): add up scaled columns
+    {
+        long cs = a.stride_of_columns();
+        long rs = a.stride_of_rows();
+        for (int q = 0; q < k; ++q)
+        {
+            const double *column = pa + q * cs;
+            double xq = px[q * xs];
+            for (int i = 0; i < m; ++i)
+                py[i] += xq * column[i * rs];
+        }
+    }
+    return y;
+}
+
+//------------------------------------------------------------------------------
+inline Matrix multiply(const Matrix &a, const Matrix &b)
+{
+    if (a.cols() != b.rows())
+        error("matrix sizes don't match for *");
+    if (b.cols() == 1)
+        return multiply_vector(a, b);
+    if (a.rows() == 1) // x*b == (b'*x')'
+        return multiply_vector(b.transpose(), a.transpose()).transpose();
+
+    int m = a.rows();
+    int n = b.cols();
+    int k = a.cols();
+    Matrix result(m, n);
+    double *pr = &result(0, 0);
+    long ldr = result.stride_of_rows();
+    bool parallel = parallel_threshold <= long(m) * n * k;
+
+    vector<double> right(size_t(kc) * (min(nc, n) + nr));
+    for (int j0 = 0; j0 < n; j0 += nc)
+    {
+        int nb = min(nc, n - j0);
+        for (int p0 = 0; p0 < k; p0 += kc)
+        {
+            int kb = min(kc, k - p0);
+            pack_right(b, p0, kb, j0, nb, right.data());
+
+            auto rows = [&, j0, nb, p0, kb](int i0) {
+                int mb = min(mc, m - i0);
+                vector<double> left(size_t(mc + mr) * kb); // each task packs its own block
+                pack_left(a, i0, mb, p0, kb, left.data());
+                multiply_block(left.data(), right.data(), mb, kb, nb, pr + i0 * ldr + j0, ldr);
+            };
+            if (parallel)
+            {
+                Task_group group;
+                for (int i0 = 0; i0 < m; i0 += mc)
+                    group.run([&rows, i0] { rows(i0); });
+                group.wait();
+            }
+            else
+                for (int i0 = 0; i0 < m; i0 += mc)
+                    rows(i0);
+        }
+    }
+    return result;
+}
+
+//------------------------------------------------------------------------------
+// element-wise a+b (sign==1) or a-b (sign==-1)
+inline Matrix add(const Matrix &a, const Matrix &b, int sign)
+{
+    if (a.rows() != b.rows() || a.cols() != b.cols())
+        error("matrix sizes don't match for ", sign == 1 ? "+" : "-");
+    Matrix result(a.rows(), a.cols());
+    for (int i = 0; i < a.rows(); ++i)
+        for (int j = 0; j < a.cols(); ++j)
+            result(i, j) = a(i, j) + sign * b(i, j);
+    return result;
+}
+
+//------------------------------------------------------------------------------
+inline Matrix scale(const Matrix &a, double s)
+{
+    Matrix result(a.rows(), a.cols());
+    for (int i = 0; i < a.rows(); ++i)
+        for (int j = 0; j < a.cols(); ++j)
+            result(i, j) = s * a(i, j);
+    return result;
+}
+
+//------------------------------------------------------------------------------
+// what the calculator computes: a number or a matrix
+class Value
+{
+public:
+    double number;
+    shared_ptr<Matrix> matrix; // null for a number
+
+    Value(double d = 0) : number(d) {}
+    Value(Matrix m) : number(0), matrix(make_shared<Matrix>(move(m))) {}
+
+    bool is_matrix() const { return matrix != nullptr; }
+    double scalar() const // the number; it is an error to ask a matrix
+    {
+        if (matrix)
+            error("number expected, but got a matrix");
+        return number;
+    }
+};
+
+//------------------------------------------------------------------------------
+inline Value operator+(const Value &a, const Value &b)
+{
+    if (!a.matrix && !b.matrix)
+        return a.number + b.number;
+    if (!a.matrix || !b.matrix)
+        error("can't add a number and a matrix");
+    return add(*a.matrix, *b.matrix, 1);
+}
+
+//------------------------------------------------------------------------------
+inline Value operator-(const Value &a, const Value &b)
+{
+    if (!a.matrix && !b.matrix)
+        return a.number - b.number;
+    if (!a.matrix || !b.matrix)
+        error("can't subtract a number and a matrix");
+    return add(*a.matrix, *b.matrix, -1);
+}
+
+//------------------------------------------------------------------------------
+inline Value operator*(const Value &a, const Value &b)
+{
+    if (!a.matrix && !b.matrix)
+        return a.number * b.number;
+    if (!a.matrix)
+        return scale(*b.matrix, a.number);
+    if (!b.matrix)
+        return scale(*a.matrix, b.number);
+    return multiply(*a.matrix, *b.matrix);
+}
+
+//------------------------------------------------------------------------------
+inline Value operator/(const Value &a, const Value &b)
+{
+    double d = b.scalar();
+    if (!a.matrix)
+        return a.number / d;
+    return scale(*a.matrix, 1 / d);
+}
+
+//------------------------------------------------------------------------------
+inline Value operator-(const Value &a)
+{
+    if (!a.matrix)
+        return -a.number;
+    return scale(*a.matrix, -1);
+}
+
+//------------------------------------------------------------------------------
+inline Value transpose(const Value &a)
+{
+    if (!a.matrix)
+        return a; // a number is its own transpose
+    return a.matrix->transpose();
+}
+
+//------------------------------------------------------------------------------
+const long max_printed_elements = 400; // larger matrices are written as just their size
+
+//------------------------------------------------------------------------------
+// write a number as usual, and a matrix as [[1, 2], [3, 4]]
+inline ostream &operator<<(ostream &os, const Value &v)
+{
+    if (!v.matrix)
+        return os << v.number;
+    const Matrix &m = *v.matrix;
+    if (max_printed_elements < m.size())
+        return os << "[" << m.rows() << "x" << m.cols() << " matrix]";
+    os << '[';
+    for (int i = 0; i < m.rows(); ++i)
+    {
+        os << (i ? ", [" : "[");
+        for (int j = 0; j < m.cols(); ++j)
+            os << (j ? ", " : "") << m(i, j);
+        os << ']';
+    }
+    return os << ']';
+}
+
+#endif // MATRIX_H
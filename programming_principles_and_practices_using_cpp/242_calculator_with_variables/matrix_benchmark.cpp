@@ -0,0 +1,134 @@
+/*
+    matrix_benchmark.cpp
+
+    Compare the calculator's matrix multiplication (matrix.h) with the naive
+    triple loop, in GFLOP/s (one multiply-add counts as two floating-point
+    operations). Also times matrix-vector products on a matrix and on its
+    transposed view. Where the hardware counters can be read (see
+    perf_counters.h), the blocked and naive multiplications also get their
+    instructions per cycle and misses per multiply-add.
+
+    Build with optimization, for example:
+        g++ -O2 -march=native -std=c++17 -pthread -o matrix_benchmark matrix_benchmark.cpp
+*/
+
+#include <chrono>
+#include <functional> // before std_lib_facilities.h, which #defines vector
+#include "matrix.h"
+#include "perf_counters.h"
+#include "std_lib_facilities.h"
+
+//------------------------------------------------------------------------------
+Matrix random_matrix(int rows, int cols)
+{
+    Matrix m(rows, cols);
+    for (int i = 0; i < rows; ++i)
+        for (int j = 0; j < cols; ++j)
+            m(i, j) = randint(-1000, 1000) / 1000.0;
+    return m;
+}
+
+//------------------------------------------------------------------------------
+// the textbook algorithm: c[i][j] = sum of a[i][k]*b[k][j]
+Matrix naive_multiply(const Matrix &a, const Matrix &b)
+{
+    Matrix c(a.rows(), b.cols());
+    for (int i = 0; i < a.rows(); ++i)
+        for (int j = 0; j < b.cols(); ++j)
+        {
+            double sum = 0;
+            for (int k = 0; k < a.cols(); ++k)
+                sum += a(i, k) * b(k, j);
+            c(i, j) = sum;
+        }
+    return c;
+}
+
+//------------------------------------------------------------------------------
+// run f until at least min_time has passed; return seconds per run, and if
+// counters isn't null, the hardware counts per run there
+double seconds_per_run(function<void()> f, Perf_sample *counters = nullptr)
+{
+    const double min_time = 0.2;
+    int runs = 0;
+    perf_counters().start();
+    auto start = chrono::steady_clock::now();
+    chrono::duration<double> t;
+    do
+    {
+        f();
+        ++runs;
+        t = chrono::steady_clock::now() - start;
+    } while (t.count() < min_time);
+    Perf_sample s = perf_counters().stop();
+    if (counters)
+    {
+        for (int e = 0; e < Perf_sample::events; ++e)
+            if (s.has(e))
+                s.count[e] /= runs;
+        *counters = s;
+    }
+    return t.count() / runs;
+}
+
+//------------------------------------------------------------------------------
+double max_difference(const Matrix &a, const Matrix &b)
+{
+    double d = 0;
+    for (int i = 0; i < a.rows(); ++i)
+        for (int j = 0; j < a.cols(); ++j)
+            d = max(d, abs(a(i, j) - b(i, j)));
+    return d;
+}
+
+//------------------------------------------------------------------------------
+int main()
+{
+    const int naive_limit = 1024; // the naive loop gets too slow to wait for beyond this
+
+    cout << "threads: " << default_pool().size() << '\n' << perf_counters().status() << "\n\n";
+    cout << setw(6) << "n" << setw(14) << "naive GFLOP/s" << setw(16) << "blocked GFLOP/s"
+         << setw(10) << "speedup" << setw(14) << "max diff" << '\n';
+    for (int n : {64, 128, 256, 512, 1024, 2048})
+    {
+        Matrix a = random_matrix(n, n);
+        Matrix b = random_matrix(n, n);
+        double flop = 2.0 * n * n * n;
+
+        Matrix c = multiply(a, b);
+        Perf_sample blocked_counts;
+        double blocked = seconds_per_run([&] { c = multiply(a, b); }, &blocked_counts);
+        Perf_sample naive_counts;
+
+        cout << setw(6) << n;
+        if (n <= naive_limit)
+        {
+            Matrix d = naive_multiply(a, b);
+            double naive = seconds_per_run([&] { d = naive_multiply(a, b); }, &naive_counts);
+            cout << setw(14) << flop / naive / 1e9 << setw(16) << flop / blocked / 1e9
+                 << setw(10) << naive / blocked << setw(14) << max_difference(c, d) << '\n';
+        }
+        else
+            cout << setw(14) << "-" << setw(16) << flop / blocked / 1e9 << '\n';
+        if (perf_counters().available()) // per multiply-add
+        {
+            if (n <= naive_limit)
+                cout << "        naive:   " << naive_counts.report(flop / 2) << '\n';
+            cout << "        blocked: " << blocked_counts.report(flop / 2) << '\n';
+        }
+    }
+
+    cout << "\nmatrix-vector products (n = 2048):\n";
+    const int n = 2048;
+    Matrix a = random_matrix(n, n);
+    Matrix x = random_matrix(n, 1);
+    Matrix at = a.transpose();
+    double flop = 2.0 * n * n;
+    Matrix y = multiply(a, x);
+    double direct = seconds_per_run([&] { y = multiply(a, x); });
+    double transposed = seconds_per_run([&] { y = multiply(at, x); });
+    double naive = seconds_per_run([&] { y = naive_multiply(at, x); });
+    cout << "  A*x         " << flop / direct / 1e9 << " GFLOP/s\n"
+         << "  A'*x        " << flop / transposed / 1e9 << " GFLOP/s\n"
+         << "  naive A'*x  " << flop / naive / 1e9 << " GFLOP/s\n";
+}
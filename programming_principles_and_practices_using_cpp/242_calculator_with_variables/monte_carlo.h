@@ -0,0 +1,241 @@
+/*
+    monte_carlo.h
+
+    The expectation of an expression whose variables are random, estimated
+    from samples (calculator --monte-carlo), e.g.
+        x*x + y   x=uniform:0:1 y=normal:0:2
+    gives the mean, the variance, and a 95% confidence interval of x*x + y.
+
+    The random numbers come from Philox4x32-10 (Salmon et al., "Parallel
+    random numbers: as easy as 1, 2, 3", 2011), a counter-based generator:
+    the numbers are a function of a key (the seed) and a counter, with no
+    state in between. Sample i of variable v uses counter (i, v), so a
+    thread that starts on sample i jumps straight to its part of the stream,
+    and each sample gets the same numbers whichever thread draws it.
+    randint() of std_lib_facilities.h, with its one shared engine, can't do
+    that.
+
+    The samples are cut into chunks of a fixed size, whatever the number of
+    threads. Each chunk's count, mean and sum of squared deviations are
+    computed in sample order; the chunks are combined in chunk order (Chan
+    et al.'s formula). So the results are the same, to the last bit, for
+    any number of threads.
+*/
+
+#ifndef MONTE_CARLO_H
+#define MONTE_CARLO_H
+
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include "compiled_expression.h"
+#include "work_stealing_pool.h"
+#include "std_lib_facilities.h" // after the standard headers: it #defines vector
+
+//------------------------------------------------------------------------------
+// Philox4x32-10: four 32-bit random words for each 128-bit counter
+class Philox
+{
+public:
+    explicit Philox(uint64_t seed) : key{uint32_t(seed), uint32_t(seed >> 32)} {}
+
+    void generate(const uint32_t counter[4], uint32_t out[4]) const;
+
+    // two doubles in [0,1) for counter (index, stream)
+    void uniforms(uint64_t index, uint32_t stream, double &u1, double &u2) const;
+
+private:
+    uint32_t key[2];
+};
+
+//------------------------------------------------------------------------------
+inline void Philox::generate(const uint32_t counter[4], uint32_t out[4]) const
+{
+    const uint32_t m0 = 0xD2511F53, m1 = 0xCD9E8D57; // multipliers
+    const uint32_t w0 = 0x9E3779B9, w1 = 0xBB67AE85; // key increments (golden ratio, sqrt(3)-1)
+    uint32_t c[4] = {counter[0], counter[1], counter[2], counter[3]};
+    uint32_t k0 = key[0], k1 = key[1];
+    for (int round = 0; round < 10; ++round)
+    {
+        uint64_t p0 = uint64_t(m0) * c[0];
+        uint64_t p1 = uint64_t(m1) * c[2];
+        uint32_t next[4] = {uint32_t(p1 >> 32) ^ c[1] ^ k0, uint32_t(p1),
+                            uint32_t(p0 >> 32) ^ c[3] ^ k1, uint32_t(p0)};
+        for (int i = 0; i < 4; ++i)
+            c[i] = next[i];
+        k0 += w0;
+        k1 += w1;
+    }
+    for (int i = 0; i < 4; ++i)
+        out[i] = c[i];
+}
+
+//------------------------------------------------------------------------------
+inline void Philox::uniforms(uint64_t index, uint32_t stream, double &u1, double &u2) const
+{
+    uint32_t counter[4] = {uint32_t(index), uint32_t(index >> 32), stream, 0};
+    uint32_t r[4];
+    generate(counter, r);
+    const double scale = 1.0 / 9007199254740992.0; // 2^-53
+    u1 = ((uint64_t(r[0]) << 21) ^ (r[1] >> 11)) * scale;
+    u2 = ((uint64_t(r[2]) << 21) ^ (r[3] >> 11)) * scale;
+}
+
+//------------------------------------------------------------------------------
+class Random_variable // var=uniform:a:b, var=normal:mean:sd, or var=value
+{
+public:
+    enum Kind { constant, uniform, normal };
+    string var;
+    Kind kind;
+    double a;
+    double b; // for uniform, a <= x < b; for normal, mean a and standard deviation b
+
+    double sample(const Philox &g, uint64_t index, uint32_t stream) const;
+};
+
+//------------------------------------------------------------------------------
+inline double Random_variable::sample(const Philox &g, uint64_t index, uint32_t stream) const
+{
+    if (kind == constant)
+        return a;
+    double u1, u2;
+    g.uniforms(index, stream, u1, u2);
+    if (kind == uniform)
+        return a + (b - a) * u1;
+    const double pi = 3.14159265358979323846;
+    return a + b * sqrt(-2 * log(1 - u1)) * cos(2 * pi * u2); // Box-Muller; 1-u1 is never 0
+}
+
+//------------------------------------------------------------------------------
+inline Random_variable parse_random_variable(const string &s)
+{
+    istringstream is(s);
+    Random_variable r;
+    getline(is, r.var, '=');
+    if (!is || r.var.empty())
+        error("random variable expected (var=uniform:a:b or var=normal:mean:sd): ", s);
+    string kind;
+    getline(is, kind, ':');
+    char colon;
+    if (kind == "uniform" || kind == "normal")
+    {
+        if (!(is >> r.a >> colon >> r.b) || colon != ':' || is >> colon)
+            error("bad random variable: ", s);
+        r.kind = kind == "uniform" ? Random_variable::uniform : Random_variable::normal;
+        if (r.kind == Random_variable::uniform ? !(r.a < r.b) : !(0 <= r.b))
+            error("bad parameters for ", s);
+        return r;
+    }
+    istringstream value(kind);
+    if (!(value >> r.a) || value >> colon || is >> colon)
+        error("bad random variable (var=uniform:a:b or var=normal:mean:sd): ", s);
+    r.kind = Random_variable::constant;
+    return r;
+}
+
+//------------------------------------------------------------------------------
+class Moments // of some samples; combine() merges those of other samples
+{
+public:
+    long n = 0;
+    double mean = 0;
+    double m2 = 0; // sum of squared deviations from the mean
+
+    void add(double x) // Welford
+    {
+        ++n;
+        double d = x - mean;
+        mean += d / n;
+        m2 += d * (x - mean);
+    }
+
+    void combine(const Moments &o) // Chan, Golub, and LeVeque
+    {
+        if (o.n == 0)
+            return;
+        long total = n + o.n;
+        double d = o.mean - mean;
+        mean += d * o.n / total;
+        m2 += o.m2 + d * d * (double(n) * o.n / total);
+        n = total;
+    }
+
+    double variance() const { return 1 < n ? m2 / (n - 1) : 0; }
+};
+
+//------------------------------------------------------------------------------
+class Monte_carlo_result
+{
+public:
+    Moments moments;
+    long errors = 0; // samples at which the expression could not be evaluated; not in moments
+    double seconds = 0;
+
+    double half_width() const // of the 95% confidence interval of the mean
+    {
+        return 1.959963984540054 * sqrt(moments.variance() / max(moments.n, 1L));
+    }
+};
+
+//------------------------------------------------------------------------------
+// evaluate code for samples 0..samples-1 of the variables, on pool
+inline Monte_carlo_result run_monte_carlo(const Code &code, const vector<Random_variable> &variables,
+                                          long samples, uint64_t seed, Work_stealing_pool &pool)
+{
+    auto start = chrono::steady_clock::now();
+    if (code.uses_matrices)
+        error("Monte Carlo needs an expression that yields a number");
+    vector<int> variable_of_slot; // slot i gets a sample of variables[variable_of_slot[i]], or -1
+    for (int i = 0; i < int(code.names.size()); ++i)
+    {
+        int v = 0;
+        while (v < int(variables.size()) && variables[v].var != code.names[i])
+            ++v;
+        if (v == int(variables.size()) && !code.is_bound(i))
+            error("no distribution given for variable ", code.names[i]);
+        variable_of_slot.push_back(v < int(variables.size()) ? v : -1);
+    }
+    if (samples < 1)
+        error("at least one sample needed");
+
+    const long chunk = 1 << 14; // samples; not a function of the number of threads
+    long chunks = (samples + chunk - 1) / chunk;
+    vector<Moments> parts(chunks);
+    vector<long> errors(chunks);
+    Philox generator(seed);
+    Task_group group(pool);
+    for (long c = 0; c < chunks; ++c)
+        group.run([&, c] {
+            vector<double> slots(code.names.size());
+            Moments &m = parts[c];
+            long last = min(samples, (c + 1) * chunk);
+            for (long i = c * chunk; i < last; ++i)
+            {
+                for (int s = 0; s < int(slots.size()); ++s)
+                    if (0 <= variable_of_slot[s])
+                        slots[s] = variables[variable_of_slot[s]].sample(generator, i, variable_of_slot[s]);
+                try
+                {
+                    m.add(run(code, 0, slots.data()));
+                }
+                catch (exception &)
+                {
+                    ++errors[c]; // e.g. divide by zero for this sample
+                }
+            }
+        });
+    group.wait();
+
+    Monte_carlo_result r;
+    for (long c = 0; c < chunks; ++c) // in order: the same sums for any number of threads
+    {
+        r.moments.combine(parts[c]);
+        r.errors += errors[c];
+    }
+    chrono::duration<double> t = chrono::steady_clock::now() - start;
+    r.seconds = t.count();
+    return r;
+}
+
+#endif // MONTE_CARLO_H
@@ -0,0 +1,117 @@
+/*
+    number_format.h
+
+    Writing numbers without the iostream machinery: operator<< on a double
+    goes through the locale, num_put, and a printf-style conversion for
+    every number, which is much of the time of printing many results.
+    A Number_formatter converts with std::to_chars into a buffer of its own,
+    reused from number to number, and writes the characters in one go.
+
+    It has three modes:
+        general:6    six significant digits, as cout << x writes them (the
+                     default, so results look as they always did);
+                     general:N for N digits
+        shortest     the fewest digits that read back as the same double
+                     (to_chars's shortest round trip, as Ryu computes it),
+                     e.g. 0.1 rather than 0.10000000000000001
+        fixed:N      N digits after the decimal point
+    The output depends only on the number and the mode: to_chars doesn't
+    look at the locale, so it is the same in every run.
+*/
+
+#ifndef NUMBER_FORMAT_H
+#define NUMBER_FORMAT_H
+
+#include <charconv>
+#include <ostream>
+#include <string>
+#include "matrix.h"
+#include "std_lib_facilities.h" // after the standard headers: it #defines vector
+
+//------------------------------------------------------------------------------
+class Number_formatter
+{
+public:
+    enum Mode { general, shortest, fixed };
+
+    explicit Number_formatter(Mode m = general, int p = 6);
+    explicit Number_formatter(const string &spec); // "general:6", "shortest", "fixed:2"
+
+    // x's characters, in the buffer; valid until the next call
+    string_view operator()(double x)
+    {
+        to_chars_result r = mode == shortest ? to_chars(buffer, buffer + sizeof buffer, x)
+                            : mode == general ? to_chars(buffer, buffer + sizeof buffer, x, chars_format::general, precision)
+                                              : to_chars(buffer, buffer + sizeof buffer, x, chars_format::fixed, precision);
+        return string_view(buffer, r.ptr - buffer); // the buffer holds any double in any mode we allow
+    }
+
+    void write(ostream &os, double x)
+    {
+        string_view s = (*this)(x);
+        os.write(s.data(), s.size());
+    }
+    void write(ostream &os, const Value &v); // a matrix as operator<< writes it
+
+private:
+    Mode mode;
+    int precision;
+    static const int max_precision = 40;
+    char buffer[330 + max_precision]; // fixed: up to 309 digits before the point
+};
+
+//------------------------------------------------------------------------------
+inline Number_formatter::Number_formatter(Mode m, int p) : mode(m), precision(p)
+{
+    if (p < 0 || max_precision < p || (m == general && p == 0))
+        error("bad number of digits: ", p);
+}
+
+inline Number_formatter::Number_formatter(const string &spec) : Number_formatter()
+{
+    string name = spec.substr(0, spec.find(':'));
+    if (name == "shortest" && name == spec)
+    {
+        mode = shortest;
+        return;
+    }
+    if (name != "general" && name != "fixed")
+        error("number format expected (general:N, shortest, or fixed:N): ", spec);
+    istringstream is(spec.substr(name.size()));
+    char colon;
+    int p;
+    if (!(is >> colon >> p) || colon != ':' || is >> colon)
+        error("bad number format: ", spec);
+    *this = Number_formatter(name == "general" ? general : fixed, p);
+}
+
+//------------------------------------------------------------------------------
+inline void Number_formatter::write(ostream &os, const Value &v)
+{
+    if (!v.matrix)
+    {
+        write(os, v.number);
+        return;
+    }
+    const Matrix &m = *v.matrix;
+    if (max_printed_elements < m.size())
+    {
+        os << v;
+        return;
+    }
+    os << '[';
+    for (int i = 0; i < m.rows(); ++i)
+    {
+        os << (i ? ", [" : "[");
+        for (int j = 0; j < m.cols(); ++j)
+        {
+            if (j)
+                os << ", ";
+            write(os, m(i, j));
+        }
+        os << ']';
+    }
+    os << ']';
+}
+
+#endif // NUMBER_FORMAT_H
@@ -0,0 +1,208 @@
+/*
+    perf_counters.h
+
+    Hardware performance counters around a measured region of a benchmark,
+    to tell why it got slower or faster: more instructions, fewer of them
+    per cycle, branch mispredictions, or cache misses. Counts cycles,
+    instructions, branch misses, L1 data cache read misses, and last level
+    cache read misses of the calling thread (and of threads it starts while
+    counting), in user mode only, with Linux's perf_event_open().
+
+    Counters the kernel or the hardware doesn't offer (in many virtual
+    machines, in containers, with perf_event_paranoid set high, or on other
+    systems) are left out: their values are -1 and report() omits them, so
+    a benchmark prints its timings as before. Perf_counters::status() says
+    which counters work, or why none do. When there are more counters than the
+    hardware has registers, the kernel takes turns; the counts are then
+    scaled up by the time each counter was enabled over the time it ran.
+*/
+
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <sstream>
+#include <string>
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#define PERF_COUNTERS_LINUX 1
+#endif
+#include "std_lib_facilities.h" // after the standard headers: it #defines vector
+
+//------------------------------------------------------------------------------
+class Perf_sample // counts of one measured region; -1 for a counter we don't have
+{
+public:
+    enum Event { cycles, instructions, branch_misses, l1d_misses, llc_misses, events };
+    double count[events];
+
+    Perf_sample()
+    {
+        for (double &c : count)
+            c = -1;
+    }
+    bool has(int e) const { return 0 <= count[e]; }
+
+    // e.g. "IPC 2.41, 312 instructions/op, 0.52 branch-misses/op, ..." for
+    // a region that did operations operations; "" if nothing was counted
+    string report(double operations) const;
+
+    static const char *name(int e)
+    {
+        static const char *names[events] = {"cycles", "instructions", "branch-misses", "L1d-misses", "LLC-misses"};
+        return names[e];
+    }
+};
+
+//------------------------------------------------------------------------------
+inline string Perf_sample::report(double operations) const
+{
+    ostringstream os;
+    const char *separator = "";
+    if (has(cycles) && has(instructions) && 0 < count[cycles])
+    {
+        os << "IPC " << fixed << setprecision(2) << count[instructions] / count[cycles] << defaultfloat;
+        separator = ", ";
+    }
+    for (int e = instructions; e < events; ++e)
+        if (has(e))
+        {
+            os << separator << setprecision(3) << count[e] / operations << ' ' << name(e) << "/op";
+            separator = ", ";
+        }
+    os << setprecision(6);
+    return os.str();
+}
+
+//------------------------------------------------------------------------------
+// one counter per Perf_sample::Event, opened once; start() and stop() around each region
+class Perf_counters
+{
+public:
+    Perf_counters();
+    ~Perf_counters();
+    Perf_counters(const Perf_counters &) = delete;
+    Perf_counters &operator=(const Perf_counters &) = delete;
+
+    bool available() const; // any counter at all?
+    string status() const;  // which counters, or why there are none
+
+    void start();
+    Perf_sample stop();
+
+private:
+    int fd[Perf_sample::events];
+    string why_not; // the error of the first counter that couldn't be opened
+};
+
+//------------------------------------------------------------------------------
+inline Perf_counters::Perf_counters()
+{
+    for (int &f : fd)
+        f = -1;
+#ifdef PERF_COUNTERS_LINUX
+    auto cache_miss = [](uint64_t cache) {
+        return cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    };
+    const uint32_t types[Perf_sample::events] = {PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE,
+                                                 PERF_TYPE_HW_CACHE, PERF_TYPE_HW_CACHE};
+    const uint64_t configs[Perf_sample::events] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+                                                   PERF_COUNT_HW_BRANCH_MISSES, cache_miss(PERF_COUNT_HW_CACHE_L1D),
+                                                   cache_miss(PERF_COUNT_HW_CACHE_LL)};
+    for (int e = 0; e < Perf_sample::events; ++e)
+    {
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof attr);
+        attr.size = sizeof attr;
+        attr.type = types[e];
+        attr.config = configs[e];
+        attr.disabled = 1;
+        attr.inherit = 1; // threads started while counting
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        // not one group: a counter the hardware lacks mustn't take the others with it
+        fd[e] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if (fd[e] < 0 && why_not.empty())
+            why_not = string(Perf_sample::name(e)) + ": " + strerror(errno);
+    }
+#else
+    why_not = "perf_event_open() is Linux only";
+#endif
+}
+
+inline Perf_counters::~Perf_counters()
+{
+#ifdef PERF_COUNTERS_LINUX
+    for (int f : fd)
+        if (0 <= f)
+            close(f);
+#endif
+}
+
+//------------------------------------------------------------------------------
+inline bool Perf_counters::available() const
+{
+    for (int f : fd)
+        if (0 <= f)
+            return true;
+    return false;
+}
+
+inline string Perf_counters::status() const
+{
+    if (!available())
+        return "hardware counters: not available (" + why_not + ")";
+    string s = "hardware counters:";
+    for (int e = 0; e < Perf_sample::events; ++e)
+        if (0 <= fd[e])
+            s += string(" ") + Perf_sample::name(e);
+    if (!why_not.empty())
+        s += " (not " + why_not + ")";
+    return s;
+}
+
+//------------------------------------------------------------------------------
+inline void Perf_counters::start()
+{
+#ifdef PERF_COUNTERS_LINUX
+    for (int f : fd)
+        if (0 <= f)
+        {
+            ioctl(f, PERF_EVENT_IOC_RESET, 0);
+            ioctl(f, PERF_EVENT_IOC_ENABLE, 0);
+        }
+#endif
+}
+
+inline Perf_sample Perf_counters::stop()
+{
+    Perf_sample s;
+#ifdef PERF_COUNTERS_LINUX
+    for (int f : fd)
+        if (0 <= f)
+            ioctl(f, PERF_EVENT_IOC_DISABLE, 0);
+    for (int e = 0; e < Perf_sample::events; ++e)
+    {
+        uint64_t v[3]; // value, time enabled, time running
+        if (fd[e] < 0 || read(fd[e], v, sizeof v) != sizeof v || v[2] == 0)
+            continue; // never got a turn on the hardware: unknown, not 0
+        s.count[e] = double(v[0]) * v[1] / v[2];
+    }
+#endif
+    return s;
+}
+
+//------------------------------------------------------------------------------
+inline Perf_counters &perf_counters() // the program's counters, opened when first used
+{
+    static Perf_counters c;
+    return c;
+}
+
+#endif // PERF_COUNTERS_H
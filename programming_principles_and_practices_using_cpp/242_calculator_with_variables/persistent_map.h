@@ -0,0 +1,221 @@
+/*
+    persistent_map.h
+
+    Persistent_map<V>: a map from string to V that is never changed in place.
+    set() returns a new map and leaves the old one as it was. The two share
+    everything except the few nodes on the path to the changed entry, so
+    copying a map is O(1) (it copies one pointer) and set() is O(log n).
+    That lets us keep thousands of slightly different variable tables
+    ("scenarios") alive at once for the price of their differences.
+
+    The map is a hash array mapped trie (HAMT): the hash of a key is cut into
+    5-bit pieces, and each piece selects one of 32 branches at one level of
+    the tree. A node stores only the branches that are in use, in an array
+    whose positions are given by a 32-bit bitmap, so sparse nodes stay small.
+    Keys whose hashes are entirely equal are chained in one leaf.
+
+    Nodes are immutable once built, so maps may be shared between threads.
+*/
+
+#ifndef PERSISTENT_MAP_H
+#define PERSISTENT_MAP_H
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include "std_lib_facilities.h" // after the standard headers: it #defines vector
+
+//------------------------------------------------------------------------------
+template <class V>
+class Persistent_map
+{
+public:
+    const V *find(const string &key) const;            // nullptr if key isn't there
+    Persistent_map set(const string &key, V value) const; // a map with key bound to value
+    int size() const { return count; }
+
+    template <class F>
+    void for_each(F f) const // call f(key, value) for every entry, in no particular order
+    {
+        if (root)
+            visit(*root, f);
+    }
+
+private:
+    class Item // a leaf or a node; entries point to either
+    {
+    public:
+        bool is_leaf;
+    };
+
+    class Leaf : public Item
+    {
+    public:
+        size_t hash;
+        string key;
+        V value;
+        shared_ptr<const Leaf> next; // another key with the same hash; rarely used
+
+        Leaf(size_t h, string k, V v, shared_ptr<const Leaf> n)
+            : Item{true}, hash(h), key(move(k)), value(move(v)), next(move(n))
+        {
+        }
+    };
+
+    class Node : public Item
+    {
+    public:
+        uint32_t bitmap = 0;                    // bit i is set if branch i is in use
+        vector<shared_ptr<const Item>> entries; // one per set bit, in bit order
+
+        Node() : Item{false} {}
+    };
+
+    static const int bits = 5; // bits of the hash used per level
+
+    shared_ptr<const Node> root;
+    int count = 0;
+
+    static int position(uint32_t bitmap, uint32_t bit) // index in entries of the entry for bit
+    {
+        return __builtin_popcount(bitmap & (bit - 1));
+    }
+    static shared_ptr<const Node> insert(const Node *node, size_t hash, int shift,
+                                         shared_ptr<const Leaf> leaf, bool &added);
+    static shared_ptr<const Node> merge(shared_ptr<const Leaf> a, shared_ptr<const Leaf> b, int shift);
+    static const Leaf *as_leaf(const Item *e) { return e->is_leaf ? static_cast<const Leaf *>(e) : nullptr; }
+    static shared_ptr<const Leaf> replace(const shared_ptr<const Leaf> &chain,
+                                          shared_ptr<const Leaf> leaf, bool &added);
+
+    template <class F>
+    static void visit(const Node &node, F &f)
+    {
+        for (const shared_ptr<const Item> &e : node.entries)
+        {
+            const Leaf *l = as_leaf(e.get());
+            if (!l)
+                visit(static_cast<const Node &>(*e), f);
+            for (; l; l = l->next.get())
+                f(l->key, l->value);
+        }
+    }
+};
+
+//------------------------------------------------------------------------------
+template <class V>
+const V *Persistent_map<V>::find(const string &key) const
+{
+    size_t hash = std::hash<string>()(key);
+    const Node *node = root.get();
+    for (int shift = 0; node; shift += bits)
+    {
+        uint32_t bit = uint32_t(1) << ((hash >> shift) & 31);
+        if (!(node->bitmap & bit))
+            return nullptr;
+        const Item *e = node->entries.data()[position(node->bitmap, bit)].get();
+        const Leaf *l = as_leaf(e);
+        if (!l)
+        {
+            node = static_cast<const Node *>(e);
+            continue;
+        }
+        for (; l; l = l->next.get())
+            if (l->hash == hash && l->key == key)
+                return &l->value;
+        return nullptr;
+    }
+    return nullptr;
+}
+
+//------------------------------------------------------------------------------
+template <class V>
+Persistent_map<V> Persistent_map<V>::set(const string &key, V value) const
+{
+    size_t hash = std::hash<string>()(key);
+    auto leaf = make_shared<const Leaf>(hash, key, move(value), nullptr);
+    bool added = false;
+    Persistent_map m;
+    m.root = insert(root.get(), hash, 0, leaf, added);
+    m.count = count + (added ? 1 : 0);
+    return m;
+}
+
+//------------------------------------------------------------------------------
+// a copy of node (which may be null) with leaf in it; only the path to leaf is copied
+template <class V>
+shared_ptr<const typename Persistent_map<V>::Node>
+Persistent_map<V>::insert(const Node *node, size_t hash, int shift,
+                          shared_ptr<const Leaf> leaf, bool &added)
+{
+    auto copy = node ? make_shared<Node>(*node) : make_shared<Node>();
+    uint32_t bit = uint32_t(1) << ((hash >> shift) & 31);
+    int i = position(copy->bitmap, bit);
+
+    if (!(copy->bitmap & bit)) // a free branch: the leaf goes here
+    {
+        copy->bitmap |= bit;
+        copy->entries.insert(copy->entries.begin() + i, leaf);
+        added = true;
+        return copy;
+    }
+
+    shared_ptr<const Item> &e = copy->entries[i];
+    if (!e->is_leaf)
+        e = insert(static_cast<const Node *>(e.get()), hash, shift + bits, leaf, added);
+    else
+    {
+        auto old = static_pointer_cast<const Leaf>(e);
+        if (old->hash == hash) // the same key, or a full hash collision
+            e = replace(old, leaf, added);
+        else // two leaves in one branch: push both down a level
+        {
+            e = merge(old, leaf, shift + bits);
+            added = true;
+        }
+    }
+    return copy;
+}
+
+//------------------------------------------------------------------------------
+// a node holding leaves a and b, whose hashes differ
+template <class V>
+shared_ptr<const typename Persistent_map<V>::Node>
+Persistent_map<V>::merge(shared_ptr<const Leaf> a, shared_ptr<const Leaf> b, int shift)
+{
+    auto node = make_shared<Node>();
+    uint32_t bit_a = uint32_t(1) << ((a->hash >> shift) & 31);
+    uint32_t bit_b = uint32_t(1) << ((b->hash >> shift) & 31);
+    if (bit_a == bit_b) // still the same branch: go one level deeper
+    {
+        node->bitmap = bit_a;
+        node->entries.push_back(merge(a, b, shift + bits));
+    }
+    else
+    {
+        node->bitmap = bit_a | bit_b;
+        if (bit_a < bit_b)
+            node->entries = {a, b};
+        else
+            node->entries = {b, a};
+    }
+    return node;
+}
+
+//------------------------------------------------------------------------------
+// chain with leaf's key bound to leaf's value (all leaves in chain have leaf's hash)
+template <class V>
+shared_ptr<const typename Persistent_map<V>::Leaf>
+Persistent_map<V>::replace(const shared_ptr<const Leaf> &chain, shared_ptr<const Leaf> leaf, bool &added)
+{
+    if (!chain) // not there: add it
+    {
+        added = true;
+        return leaf;
+    }
+    if (chain->key == leaf->key)
+        return make_shared<const Leaf>(leaf->hash, leaf->key, leaf->value, chain->next);
+    return make_shared<const Leaf>(chain->hash, chain->key, chain->value,
+                                   replace(chain->next, leaf, added));
+}
+
+#endif // PERSISTENT_MAP_H
@@ -0,0 +1,137 @@
+/*
+    plan_cache.h
+
+    Compiled expressions (Codes, see compiled_expression.h) kept for reuse.
+
+    Expressions often come in a few shapes with different numbers in them:
+        price*1.19;
+        price*1.07;
+    The grammar functions put every number into Code::constants, and nothing
+    else in a Code depends on their values. So two expressions that differ
+    only in their numbers compile to the same Code except for the constants.
+    The cache is keyed by the "shape" of the tokens (the token kinds and
+    names, with every number left blank); on a hit, the caller only has to
+    put the new numbers into the constants.
+
+    The constants needn't be in the order of the numbers: a function call
+    compiled in place puts its arguments where its body uses them, perhaps
+    twice or not at all, and adds the numbers of the body. So Code::places
+    records which number of the statement each constant is (-1 for those
+    that aren't the statement's), and the new numbers go there.
+
+    The cache holds at most max_bytes of Codes (roughly counted); when a new
+    Code doesn't fit, the least recently used ones are evicted.
+
+    A Plan_cache is meant for one thread: find() hands out Codes that the
+    caller changes (by binding constants).
+*/
+
+#ifndef PLAN_CACHE_H
+#define PLAN_CACHE_H
+
+#include <list>
+#include <memory>
+#include <unordered_map>
+#include "compiled_expression.h"
+#include "std_lib_facilities.h" // after the standard headers: it #defines vector
+
+//------------------------------------------------------------------------------
+// about how many bytes c occupies
+inline size_t footprint(const Code &c)
+{
+    size_t n = sizeof(Code) + c.instructions.size() * sizeof(Instruction) +
+               c.constants.size() * (sizeof(double) + sizeof(int)) + c.calls.size() * sizeof(Call_site) +
+               c.shapes.size() * sizeof(Shape) + c.functions.size() * sizeof(Function_site) +
+               (c.state ? sizeof(Function_state) + c.functions.size() * sizeof(Function_state::Counts) : 0);
+    for (const string &s : c.names)
+        n += sizeof(string) + s.size();
+    return n;
+}
+
+//------------------------------------------------------------------------------
+class Plan_cache
+{
+public:
+    explicit Plan_cache(size_t max = 1 << 20) : max_bytes(max) {}
+
+    shared_ptr<Code> find(const string &shape);      // nullptr if there is no Code of that shape
+    void insert(const string &shape, shared_ptr<Code> code); // keep code, evicting if necessary
+    void clear();
+
+    int size() const { return entries.size(); }
+    size_t bytes() const { return used_bytes; }
+
+    // statistics
+    long hits = 0;
+    long misses = 0;
+    long evictions = 0;
+    size_t max_bytes; // the memory bound
+
+private:
+    class Entry
+    {
+    public:
+        string shape;
+        shared_ptr<Code> code;
+        size_t bytes;
+    };
+    list<Entry> entries; // most recently used first
+    unordered_map<string, list<Entry>::iterator> index;
+    size_t used_bytes = 0;
+
+    void evict_last();
+};
+
+//------------------------------------------------------------------------------
+inline shared_ptr<Code> Plan_cache::find(const string &shape)
+{
+    auto p = index.find(shape);
+    if (p == index.end())
+    {
+        ++misses;
+        return nullptr;
+    }
+    ++hits;
+    entries.splice(entries.begin(), entries, p->second); // now the most recently used
+    return p->second->code;
+}
+
+//------------------------------------------------------------------------------
+inline void Plan_cache::insert(const string &shape, shared_ptr<Code> code)
+{
+    size_t bytes = footprint(*code) + 2 * shape.size() + 64; // the key is kept twice; 64 for the nodes
+    if (max_bytes < bytes)
+        return; // would never fit
+    auto p = index.find(shape);
+    if (p != index.end()) // replace the old Code
+    {
+        used_bytes -= p->second->bytes;
+        entries.erase(p->second);
+        index.erase(p);
+    }
+    while (max_bytes < used_bytes + bytes)
+        evict_last();
+    entries.push_front(Entry{shape, code, bytes});
+    index[shape] = entries.begin();
+    used_bytes += bytes;
+}
+
+//------------------------------------------------------------------------------
+inline void Plan_cache::evict_last()
+{
+    const Entry &e = entries.back();
+    used_bytes -= e.bytes;
+    index.erase(e.shape);
+    entries.pop_back();
+    ++evictions;
+}
+
+//------------------------------------------------------------------------------
+inline void Plan_cache::clear()
+{
+    entries.clear();
+    index.clear();
+    used_bytes = 0;
+}
+
+#endif // PLAN_CACHE_H
@@ -0,0 +1,150 @@
+/*
+    scenario_benchmark.cpp
+
+    "What-if" scenarios: start from a variable table with many variables, make
+    thousands of copies, and change a few variables in each copy.
+
+    Compares copying a vector of variables (what the calculator used to do)
+    with forking a Persistent_map (persistent_map.h), and reports how much
+    memory thousands of live scenarios take. Where the hardware counters
+    can be read (see perf_counters.h), each measurement also gets its
+    instructions per cycle and misses per scenario or lookup.
+
+    Build with optimization, for example:
+        g++ -O2 -std=c++17 -o scenario_benchmark scenario_benchmark.cpp
+*/
+
+#include <chrono>
+#include <functional> // before std_lib_facilities.h, which #defines vector
+#include "perf_counters.h"
+#include "persistent_map.h"
+#include "std_lib_facilities.h"
+
+//------------------------------------------------------------------------------
+class Variable
+{
+public:
+    string name;
+    double value;
+};
+
+//------------------------------------------------------------------------------
+// resident memory of this process in MB, or 0 if we can't tell
+double resident_mb()
+{
+    ifstream statm("/proc/self/statm");
+    long pages = 0;
+    long resident = 0;
+    if (!(statm >> pages >> resident))
+        return 0;
+    return resident * 4096.0 / (1024 * 1024);
+}
+
+//------------------------------------------------------------------------------
+double seconds_since(chrono::steady_clock::time_point start)
+{
+    chrono::duration<double> t = chrono::steady_clock::now() - start;
+    return t.count();
+}
+
+//------------------------------------------------------------------------------
+// the counters of a region of operations operations, if there are any
+void report_counters(const Perf_sample &s, double operations)
+{
+    if (perf_counters().available())
+        cout << "    " << s.report(operations) << '\n';
+}
+
+//------------------------------------------------------------------------------
+int main()
+{
+    const int variables = 100000;
+    const int scenarios = 10000;
+    const int changes = 3; // variables changed per scenario
+
+    vector<string> names;
+    for (int i = 0; i < variables; ++i)
+        names.push_back("v" + to_string(i));
+
+    vector<Variable> table;
+    Persistent_map<double> base;
+    for (int i = 0; i < variables; ++i)
+    {
+        table.push_back(Variable{names[i], double(i)});
+        base = base.set(names[i], i);
+    }
+    cout << variables << " variables, " << scenarios << " scenarios, "
+         << changes << " changes each\n" << perf_counters().status() << "\n\n";
+
+    // the old way: copy the whole table, then find and change the variables
+    {
+        const int copies = 200; // enough to time; 10000 copies would need GBs
+        perf_counters().start();
+        auto start = chrono::steady_clock::now();
+        double sink = 0;
+        for (int s = 0; s < copies; ++s)
+        {
+            vector<Variable> copy = table;
+            for (int c = 0; c < changes; ++c)
+            {
+                const string &n = names[(s * 7919 + c * 104729) % variables];
+                for (Variable &v : copy)
+                    if (v.name == n)
+                    {
+                        v.value = -1;
+                        break;
+                    }
+            }
+            sink += copy[0].value;
+        }
+        double t = seconds_since(start);
+        Perf_sample counts = perf_counters().stop();
+        cout << "copying a vector:       " << t / copies * 1e6 << " us per scenario ("
+             << sink << ")\n";
+        report_counters(counts, copies);
+    }
+
+    // the new way: fork the persistent map and set the variables
+    double before = resident_mb();
+    perf_counters().start();
+    auto start = chrono::steady_clock::now();
+    vector<Persistent_map<double>> live;
+    for (int s = 0; s < scenarios; ++s)
+    {
+        Persistent_map<double> fork = base; // O(1)
+        for (int c = 0; c < changes; ++c)
+            fork = fork.set(names[(s * 7919 + c * 104729) % variables], -1);
+        live.push_back(fork);
+    }
+    double t = seconds_since(start);
+    Perf_sample counts = perf_counters().stop();
+    double after = resident_mb();
+    cout << "forking a Persistent_map: " << t / scenarios * 1e6 << " us per scenario\n";
+    report_counters(counts, scenarios);
+    if (after)
+        cout << "memory for " << scenarios << " live scenarios: " << after - before << " MB ("
+             << (after - before) * 1024 / scenarios << " KB each)\n";
+
+    // lookups cost about the same in every scenario
+    perf_counters().start();
+    start = chrono::steady_clock::now();
+    double sum = 0;
+    const int lookups = 1000000;
+    for (int i = 0; i < lookups; ++i)
+        sum += *live[i % scenarios].find(names[(i * 31) % variables]);
+    t = seconds_since(start);
+    counts = perf_counters().stop();
+    cout << "lookup: " << t / lookups * 1e9 << " ns (" << sum << ")\n";
+    report_counters(counts, lookups);
+
+    // check that the scenarios didn't disturb each other or the base
+    int wrong = 0;
+    for (int s = 0; s < scenarios; ++s)
+        for (int c = 0; c < changes; ++c)
+        {
+            int i = (s * 7919 + c * 104729) % variables;
+            if (*live[s].find(names[i]) != -1 || *base.find(names[i]) != i)
+                ++wrong;
+        }
+    cout << (wrong ? "ERROR: scenarios interfered\n" : "all scenarios independent\n");
+}
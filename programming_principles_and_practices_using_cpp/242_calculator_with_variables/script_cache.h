@@ -0,0 +1,473 @@
+/*
+    script_cache.h
+
+    Compiled scripts kept on disk, so that running a large script that
+    hasn't changed doesn't start with lexing and parsing all of it again
+    (calculator --run script).
+
+    A script is compiled into an image: for each statement its kind, the
+    name it defines or assigns, and its Code (see compiled_expression.h); a
+    statement that doesn't compile keeps its error message instead. The
+    image holds no pointers, only offsets from its start, and each array is
+    laid out as in memory, so a mapped image is used where it is: a
+    Code_view points into the mapping, and run() executes the instructions
+    from the file's pages. Nothing is read or copied before the first
+    statement runs.
+
+    The cache is a directory. An image is stored under the hash of the
+    script's text (FNV-1a, 64 bits), so moving or copying a script doesn't
+    lose its image. To find the hash without reading the text, an index
+    file (named by the hash of the script's path) remembers the file's
+    device, inode, size, and modification time, as make and ccache do;
+    only when those changed is the text read and hashed again.
+
+    The images are trusted like any other file the user's programs write:
+    the header, and each statement's tables when the statement is about to
+    run, are checked against the file's size; the bytecode is not. They depend on the machine and compiler that wrote
+    them (see Image_header::abi); a mismatch is a miss.
+
+    POSIX only; elsewhere every lookup is a miss and nothing is stored.
+*/
+
+#ifndef SCRIPT_CACHE_H
+#define SCRIPT_CACHE_H
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define SCRIPT_CACHE_POSIX 1
+#endif
+#include "compiled_expression.h"
+#include "std_lib_facilities.h" // after the standard headers: it #defines vector
+
+//------------------------------------------------------------------------------
+inline uint64_t fnv1a(const char *p, size_t n, uint64_t h = 0xcbf29ce484222325)
+{
+    for (size_t i = 0; i < n; ++i)
+        h = (h ^ uint8_t(p[i])) * 0x100000001b3;
+    return h;
+}
+
+//------------------------------------------------------------------------------
+enum class Statement_kind : uint32_t
+{
+    expression,  // write its value
+    declaration, // let name = expression
+    assignment,  // name = expression
+    definition,  // f(x) = expression; compiled into the statements that call f, so no code
+    failed       // didn't compile; the text is the error message
+};
+
+//------------------------------------------------------------------------------
+// the layout of an image; all offsets are from the start of the image
+class Image_header
+{
+public:
+    char magic[8];
+    uint32_t abi;        // sizes of the records run() reads, as this compiler lays them out
+    uint32_t statement_count;
+    uint64_t content_hash; // of the script
+    uint64_t size;         // of the image
+    uint32_t statements;   // offset of statement_count Statement_records
+    uint32_t final_prompt; // 0 if the input ended in the middle of skipping a bad statement
+
+    static uint32_t this_abi()
+    {
+        return sizeof(Instruction) | sizeof(Call_site) << 8 | sizeof(Shape) << 16 | sizeof(double) << 24;
+    }
+};
+
+class Statement_record
+{
+public:
+    Statement_kind kind;
+    uint32_t text; // NUL-terminated name or error message; 0 if none
+    uint32_t code; // a Code_record; 0 if failed
+};
+
+class Code_record // the arrays of a Code
+{
+public:
+    uint32_t instructions, instruction_count;
+    uint32_t constants, constant_count;
+    uint32_t names, name_count; // name_count offsets of NUL-terminated names
+    uint32_t calls, call_count;
+    uint32_t shapes, shape_count;
+    uint32_t functions, function_count;
+    uint32_t uses_matrices;
+    uint32_t unused;
+};
+
+const char image_magic[8] = {'C', 'A', 'L', 'C', 'I', 'M', 'G', '2'};
+
+//------------------------------------------------------------------------------
+// builds an image, one statement at a time
+class Image_writer
+{
+public:
+    explicit Image_writer(uint64_t content_hash);
+
+    void add(Statement_kind kind, const string &text, const Code *code); // code is copied now
+    string finish(bool final_prompt); // the image
+
+private:
+    string bytes;
+    vector<Statement_record> statements;
+    uint64_t hash;
+
+    uint32_t append(const void *p, size_t n); // at a multiple of 8; returns the offset
+    uint32_t append_string(const string &s);
+};
+
+//------------------------------------------------------------------------------
+inline Image_writer::Image_writer(uint64_t content_hash) : hash(content_hash)
+{
+    bytes.assign(sizeof(Image_header), '\0'); // filled in by finish()
+}
+
+//------------------------------------------------------------------------------
+inline uint32_t Image_writer::append(const void *p, size_t n)
+{
+    bytes.resize((bytes.size() + 7) & ~size_t(7), '\0');
+    if (UINT32_MAX < bytes.size() + n)
+        error("script too large to be cached");
+    uint32_t offset = bytes.size();
+    if (n)
+        bytes.append(static_cast<const char *>(p), n);
+    return offset;
+}
+
+inline uint32_t Image_writer::append_string(const string &s)
+{
+    return append(s.c_str(), s.size() + 1);
+}
+
+//------------------------------------------------------------------------------
+inline void Image_writer::add(Statement_kind kind, const string &text, const Code *code)
+{
+    Statement_record s{kind, text.empty() ? 0 : append_string(text), 0};
+    if (code)
+    {
+        Code_record c{};
+        c.instructions = append(code->instructions.data(), code->instructions.size() * sizeof(Instruction));
+        c.instruction_count = code->instructions.size();
+        c.constants = append(code->constants.data(), code->constants.size() * sizeof(double));
+        c.constant_count = code->constants.size();
+        vector<uint32_t> names;
+        for (const string &n : code->names)
+            names.push_back(append_string(n));
+        c.names = append(names.data(), names.size() * sizeof(uint32_t));
+        c.name_count = names.size();
+        c.calls = append(code->calls.data(), code->calls.size() * sizeof(Call_site));
+        c.call_count = code->calls.size();
+        c.shapes = append(code->shapes.data(), code->shapes.size() * sizeof(Shape));
+        c.shape_count = code->shapes.size();
+        c.functions = append(code->functions.data(), code->functions.size() * sizeof(Function_site));
+        c.function_count = code->functions.size();
+        c.uses_matrices = code->uses_matrices;
+        s.code = append(&c, sizeof c);
+    }
+    statements.push_back(s);
+}
+
+//------------------------------------------------------------------------------
+inline string Image_writer::finish(bool final_prompt)
+{
+    Image_header h{};
+    memcpy(h.magic, image_magic, sizeof h.magic);
+    h.abi = Image_header::this_abi();
+    h.statement_count = statements.size();
+    h.content_hash = hash;
+    h.statements = append(statements.data(), statements.size() * sizeof(Statement_record));
+    h.size = bytes.size();
+    h.final_prompt = final_prompt;
+    memcpy(&bytes[0], &h, sizeof h);
+    return bytes;
+}
+
+//------------------------------------------------------------------------------
+// an image, mapped from a file or held in memory; statements are looked at in
+// place, and checked only when they are looked at
+class Script_image
+{
+public:
+    explicit Script_image(string image); // one just compiled
+    ~Script_image();
+    Script_image(const Script_image &) = delete;
+    Script_image &operator=(const Script_image &) = delete;
+
+    static unique_ptr<Script_image> map(const string &path); // nullptr if it isn't a usable image
+
+    int size() const { return header().statement_count; }
+    bool final_prompt() const { return header().final_prompt; }
+    Statement_kind kind(int i) const { return record(i).kind; }
+    const char *text(int i) const { return record(i).text ? base + record(i).text : ""; }
+    Code_view code(int i) const;
+
+private:
+    string own; // the image, when it isn't mapped
+    const char *base;
+    size_t bytes;
+    bool mapped = false;
+
+    Script_image(const char *p, size_t n); // check the header
+    void check_header() const;
+    const Image_header &header() const { return *reinterpret_cast<const Image_header *>(base); }
+    const Statement_record &record(int i) const;
+    void check(uint32_t offset, size_t count, size_t size) const;
+};
+
+//------------------------------------------------------------------------------
+inline Script_image::Script_image(string image) : own(move(image)), base(own.data()), bytes(own.size())
+{
+    check_header();
+}
+
+inline Script_image::Script_image(const char *p, size_t n) : base(p), bytes(n)
+{
+    check_header();
+}
+
+//------------------------------------------------------------------------------
+inline void Script_image::check_header() const
+{
+    if (bytes < sizeof(Image_header) || memcmp(header().magic, image_magic, sizeof image_magic) != 0 ||
+        header().abi != Image_header::this_abi() || header().size != bytes)
+        error("bad script image");
+    check(header().statements, header().statement_count, sizeof(Statement_record));
+}
+
+//------------------------------------------------------------------------------
+// is [offset, offset+count*size) inside the image?
+inline void Script_image::check(uint32_t offset, size_t count, size_t size) const
+{
+    if (offset % 8 || bytes < offset || (bytes - offset) / size < count)
+        error("bad script image");
+}
+
+//------------------------------------------------------------------------------
+inline const Statement_record &Script_image::record(int i) const
+{
+    const Statement_record &s = reinterpret_cast<const Statement_record *>(base + header().statements)[i];
+    if (bytes <= s.text || Statement_kind::failed < s.kind || (s.code == 0) != (s.kind == Statement_kind::failed || s.kind == Statement_kind::definition))
+        error("bad script image");
+    return s;
+}
+
+//------------------------------------------------------------------------------
+inline Code_view Script_image::code(int i) const
+{
+    uint32_t offset = record(i).code;
+    check(offset, 1, sizeof(Code_record));
+    const Code_record &c = *reinterpret_cast<const Code_record *>(base + offset);
+    check(c.instructions, c.instruction_count, sizeof(Instruction));
+    check(c.constants, c.constant_count, sizeof(double));
+    check(c.names, c.name_count, sizeof(uint32_t));
+    check(c.calls, c.call_count, sizeof(Call_site));
+    check(c.shapes, c.shape_count, sizeof(Shape));
+    check(c.functions, c.function_count, sizeof(Function_site));
+
+    Code_view v;
+    v.instructions = reinterpret_cast<const Instruction *>(base + c.instructions);
+    v.constants = reinterpret_cast<const double *>(base + c.constants);
+    v.calls = reinterpret_cast<const Call_site *>(base + c.calls);
+    v.shapes = reinterpret_cast<const Shape *>(base + c.shapes);
+    v.functions = reinterpret_cast<const Function_site *>(base + c.functions);
+    v.size = c.instruction_count;
+    v.call_count = c.call_count;
+    v.function_count = c.function_count; // the caller supplies a Function_state
+    v.slots = c.name_count;
+    v.uses_matrices = c.uses_matrices;
+    v.strings = base;
+    v.name_offsets = reinterpret_cast<const uint32_t *>(base + c.names);
+    return v;
+}
+
+#ifdef SCRIPT_CACHE_POSIX
+
+//------------------------------------------------------------------------------
+inline Script_image::~Script_image()
+{
+    if (mapped)
+        munmap(const_cast<char *>(base), bytes);
+}
+
+//------------------------------------------------------------------------------
+inline unique_ptr<Script_image> Script_image::map(const string &path)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return nullptr;
+    struct stat st;
+    void *p = fstat(fd, &st) == 0 && 0 < st.st_size
+                  ? mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)
+                  : MAP_FAILED;
+    close(fd);
+    if (p == MAP_FAILED)
+        return nullptr;
+    try
+    {
+        unique_ptr<Script_image> image(new Script_image(static_cast<const char *>(p), st.st_size));
+        image->mapped = true;
+        return image;
+    }
+    catch (exception &)
+    {
+        munmap(p, st.st_size); // truncated, or written by another version: a miss
+        return nullptr;
+    }
+}
+
+#else // not POSIX
+
+inline Script_image::~Script_image() {}
+
+inline unique_ptr<Script_image> Script_image::map(const string &) { return nullptr; }
+
+#endif
+
+//------------------------------------------------------------------------------
+// a directory of images
+class Script_cache
+{
+public:
+    explicit Script_cache(const string &dir) : directory(dir) {}
+
+    // the image of the script in file path, if the cache has one; else nullptr
+    // and the text (and its hash) for compiling it
+    unique_ptr<Script_image> find(const string &path, string &text, uint64_t &hash);
+    void store(uint64_t hash, const string &image);
+
+    string directory;
+
+private:
+    class File_identity // what the index remembers about a script file
+    {
+    public:
+        uint64_t device, inode, size, modified; // modified in nanoseconds
+        uint64_t content_hash;
+    };
+    string image_path(uint64_t hash) const;
+    string index_path(const string &path) const;
+    bool identify(const string &path, File_identity &id) const;
+};
+
+//------------------------------------------------------------------------------
+inline string Script_cache::image_path(uint64_t hash) const
+{
+    ostringstream os;
+    os << directory << '/' << hex << hash << ".image";
+    return os.str();
+}
+
+inline string Script_cache::index_path(const string &path) const
+{
+    ostringstream os;
+    os << directory << '/' << hex << fnv1a(path.data(), path.size()) << ".index";
+    return os.str();
+}
+
+//------------------------------------------------------------------------------
+// read a whole file
+inline string file_text(const string &path)
+{
+    ifstream is(path, ios_base::binary);
+    if (!is)
+        error("can't open ", path);
+    ostringstream os;
+    os << is.rdbuf();
+    return os.str();
+}
+
+#ifdef SCRIPT_CACHE_POSIX
+
+//------------------------------------------------------------------------------
+// write a whole file; first to a temporary, so that a reader never sees half of it
+inline bool write_file(const string &path, const string &data)
+{
+    string temporary = path + ".tmp" + to_string(getpid());
+    {
+        ofstream os(temporary, ios_base::binary);
+        if (!os.write(data.data(), data.size()) || !os.flush())
+        {
+            remove(temporary.c_str());
+            return false;
+        }
+    }
+    if (rename(temporary.c_str(), path.c_str()) == 0)
+        return true;
+    remove(temporary.c_str());
+    return false;
+}
+
+//------------------------------------------------------------------------------
+inline bool Script_cache::identify(const string &path, File_identity &id) const
+{
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0)
+        return false;
+    id.device = st.st_dev;
+    id.inode = st.st_ino;
+    id.size = st.st_size;
+#ifdef __APPLE__
+    id.modified = uint64_t(st.st_mtimespec.tv_sec) * 1000000000 + st.st_mtimespec.tv_nsec;
+#else
+    id.modified = uint64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+    return true;
+}
+
+//------------------------------------------------------------------------------
+inline unique_ptr<Script_image> Script_cache::find(const string &path, string &text, uint64_t &hash)
+{
+    File_identity now{};
+    bool known = identify(path, now);
+    File_identity before{};
+    ifstream index(index_path(path), ios_base::binary);
+    if (known && index.read(reinterpret_cast<char *>(&before), sizeof before) &&
+        before.device == now.device && before.inode == now.inode && before.size == now.size &&
+        before.modified == now.modified)
+    {
+        hash = before.content_hash; // unchanged: no need to read it
+        if (unique_ptr<Script_image> image = Script_image::map(image_path(hash)))
+            return image;
+    }
+
+    text = file_text(path);
+    hash = fnv1a(text.data(), text.size());
+    if (known) // remember the hash for next time
+    {
+        now.content_hash = hash;
+        mkdir(directory.c_str(), 0700);
+        write_file(index_path(path), string(reinterpret_cast<const char *>(&now), sizeof now));
+    }
+    return Script_image::map(image_path(hash)); // the same text may be cached under another path
+}
+
+//------------------------------------------------------------------------------
+inline void Script_cache::store(uint64_t hash, const string &image)
+{
+    mkdir(directory.c_str(), 0700); // fails harmlessly if it exists
+    write_file(image_path(hash), image);
+}
+
+#else // not POSIX
+
+inline unique_ptr<Script_image> Script_cache::find(const string &path, string &text, uint64_t &hash)
+{
+    text = file_text(path);
+    hash = fnv1a(text.data(), text.size());
+    return nullptr;
+}
+
+inline void Script_cache::store(uint64_t, const string &) {}
+
+#endif
+
+#endif // SCRIPT_CACHE_H
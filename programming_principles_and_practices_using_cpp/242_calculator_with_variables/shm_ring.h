@@ -0,0 +1,356 @@
+/*
+    shm_ring.h
+
+    Messages between processes on one host through shared memory, without a
+    system call per message.
+
+    A Shared_region (a POSIX shared memory object, /dev/shm/name on Linux)
+    holds two rings: requests from the client to the calculator, and replies
+    back. Each ring has exactly one writer and one reader (single producer,
+    single consumer), so head and tail are plain atomic counters: the writer
+    advances head after copying a record in, the reader advances tail after
+    it is done with a record. The counters count bytes and wrap around at
+    2^32; the capacity is a power of two, so position % capacity still works.
+
+    A record is an 8-byte header (length, type) and the payload, padded to a
+    multiple of 8. A record never wraps around the end of the ring: if it
+    doesn't fit there, the writer fills the rest with a skip record and
+    starts again at the beginning. So the reader can look at a payload where
+    it is, in the shared pages, without copying it out first.
+
+    Waiting for a record (or for room) first spins for a while, which costs
+    no system call if the other side is quick (on a machine with more than
+    one processor; with only one, spinning just delays the other side), then
+    sleeps on a futex (the head or tail counter itself). A sleeper sets a flag first; the other
+    side only makes the wake-up call when the flag is set.
+
+    serve() answers the requests of wire.h that arrive in a region: whenever
+    it wakes up, it answers all the requests that have arrived (a batch),
+    reading each one in place, and writes the replies into the other ring.
+    A client must not send more than fits into the reply ring before it
+    reads replies, or both sides end up waiting for room.
+
+    Linux only for the futex; elsewhere sleepers poll every 50 microseconds.
+*/
+
+#ifndef SHM_RING_H
+#define SHM_RING_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <thread>
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#define SHM_POSIX 1
+#endif
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+#include "wire.h"
+#include "std_lib_facilities.h" // after the standard headers: it #defines vector
+
+//------------------------------------------------------------------------------
+// sleep while *word == value (or until woken); wake the sleepers on word
+inline void futex_wait(atomic<uint32_t> *word, uint32_t value)
+{
+#ifdef __linux__
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(word), FUTEX_WAIT, value, nullptr, nullptr, 0);
+#else
+    if (word->load() == value)
+        this_thread::sleep_for(chrono::microseconds(50));
+#endif
+}
+
+inline void futex_wake(atomic<uint32_t> *word)
+{
+#ifdef __linux__
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(word), FUTEX_WAKE, INT32_MAX, nullptr, nullptr, 0);
+#endif
+}
+
+//------------------------------------------------------------------------------
+// tell the processor we are spinning (lets the other hyperthread run)
+inline void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+//------------------------------------------------------------------------------
+class Ring_header // at the start of each ring, in shared memory
+{
+public:
+    alignas(64) atomic<uint32_t> head;       // bytes ever written (mod 2^32)
+    atomic<uint32_t> reader_sleeping;        // set by the reader before sleeping on head
+    alignas(64) atomic<uint32_t> tail;       // bytes ever consumed
+    atomic<uint32_t> writer_sleeping;        // set by the writer before sleeping on tail
+};
+
+//------------------------------------------------------------------------------
+// one direction of a Shared_region; one process writes, the other reads
+class Ring
+{
+public:
+    Ring(Ring_header *h, char *d, uint32_t c) : header(h), data(d), capacity(c) {}
+
+    // writer
+    void write(char type, const void *payload, uint32_t n); // waits for room
+
+    // reader
+    const char *next(char &type, uint32_t &n); // the next record in place, or nullptr if none yet
+    void consume();                            // done with the record next() returned
+    void wait();                               // until there is a record
+
+    int spin = default_spin(); // times to look before going to sleep
+
+    // with one processor the other side can't run while we spin
+    static int default_spin() { return 1 < thread::hardware_concurrency() ? 200 : 0; }
+
+private:
+    Ring_header *header;
+    char *data;
+    uint32_t capacity; // a power of two
+    uint32_t reading = 0; // size of the record next() returned
+
+    static const uint32_t record_header = 8;
+    static const uint32_t skip = 0xffffffff; // length of a skip record
+    static uint32_t padded(uint32_t n) { return (n + 7) & ~7u; }
+    void wait_for_room(uint32_t n);
+};
+
+//------------------------------------------------------------------------------
+inline void Ring::write(char type, const void *payload, uint32_t n)
+{
+    uint32_t size = record_header + padded(n);
+    if (capacity / 2 < size)
+        error("message too large for the ring");
+    uint32_t head = header->head.load(memory_order_relaxed); // only we change it
+    uint32_t offset = head % capacity;
+    uint32_t gap = capacity - offset < size ? capacity - offset : 0; // to skip at the end
+    wait_for_room(gap + size);
+
+    if (gap) // fill up the end; the record starts again at the beginning
+    {
+        memcpy(data + offset, &skip, 4);
+        head += gap;
+        offset = 0;
+    }
+    memcpy(data + offset, &n, 4);
+    data[offset + 4] = type;
+    memcpy(data + offset + record_header, payload, n);
+    header->head.store(head + size, memory_order_seq_cst); // publish
+    if (header->reader_sleeping.load(memory_order_seq_cst))
+    {
+        header->reader_sleeping.store(0);
+        futex_wake(&header->head);
+    }
+}
+
+//------------------------------------------------------------------------------
+inline void Ring::wait_for_room(uint32_t n)
+{
+    auto room = [&] { return capacity - (header->head.load(memory_order_relaxed) -
+                                         header->tail.load(memory_order_acquire)) >= n; };
+    for (int i = 0; !room(); ++i)
+    {
+        if (i < spin)
+        {
+            cpu_relax();
+            continue;
+        }
+        uint32_t tail = header->tail.load(memory_order_seq_cst);
+        header->writer_sleeping.store(1, memory_order_seq_cst);
+        if (!room()) // the reader may have made room since we looked
+            futex_wait(&header->tail, tail);
+        header->writer_sleeping.store(0);
+    }
+}
+
+//------------------------------------------------------------------------------
+inline const char *Ring::next(char &type, uint32_t &n)
+{
+    uint32_t tail = header->tail.load(memory_order_relaxed); // only we change it
+    while (true)
+    {
+        if (tail == header->head.load(memory_order_acquire))
+            return nullptr;
+        uint32_t offset = tail % capacity;
+        memcpy(&n, data + offset, 4);
+        if (n != skip)
+        {
+            type = data[offset + 4];
+            reading = record_header + padded(n);
+            return data + offset + record_header;
+        }
+        tail += capacity - offset; // a skip record: the next one is at the beginning
+        header->tail.store(tail, memory_order_release);
+    }
+}
+
+//------------------------------------------------------------------------------
+inline void Ring::consume()
+{
+    header->tail.store(header->tail.load(memory_order_relaxed) + reading, memory_order_seq_cst);
+    reading = 0;
+    if (header->writer_sleeping.load(memory_order_seq_cst))
+    {
+        header->writer_sleeping.store(0);
+        futex_wake(&header->tail);
+    }
+}
+
+//------------------------------------------------------------------------------
+inline void Ring::wait()
+{
+    auto empty = [&] { return header->tail.load(memory_order_relaxed) ==
+                              header->head.load(memory_order_acquire); };
+    for (int i = 0; empty(); ++i)
+    {
+        if (i < spin)
+        {
+            cpu_relax();
+            continue;
+        }
+        uint32_t head = header->head.load(memory_order_seq_cst);
+        header->reader_sleeping.store(1, memory_order_seq_cst);
+        if (empty()) // the writer may have written since we looked
+            futex_wait(&header->head, head);
+        header->reader_sleeping.store(0);
+    }
+}
+
+#ifdef SHM_POSIX
+
+//------------------------------------------------------------------------------
+// the shared memory for one client and one server: requests and replies
+class Shared_region
+{
+public:
+    Shared_region(const string &name, bool create, uint32_t capacity = 1 << 20);
+    ~Shared_region();
+    Shared_region(const Shared_region &) = delete;
+    Shared_region &operator=(const Shared_region &) = delete;
+
+    Ring requests() { return Ring(&layout()->requests, base + data_offset, capacity); }
+    Ring replies() { return Ring(&layout()->replies, base + data_offset + capacity, capacity); }
+
+private:
+    class Layout
+    {
+    public:
+        uint32_t magic;
+        uint32_t capacity;
+        Ring_header requests;
+        Ring_header replies;
+    };
+    static const uint32_t region_magic = 0x43414c52; // "CALR"
+    static const size_t data_offset = 4096;           // the rings' data starts on its own page
+
+    string name;
+    bool owner; // we created it; we remove it
+    uint32_t capacity;
+    size_t bytes;
+    char *base;
+
+    Layout *layout() { return reinterpret_cast<Layout *>(base); }
+};
+
+//------------------------------------------------------------------------------
+// create (for the server) or open (for the client) the region called name
+inline Shared_region::Shared_region(const string &n, bool create, uint32_t c)
+    : name(n), owner(create), capacity(c)
+{
+    static_assert(sizeof(Layout) <= data_offset, "ring headers don't fit in the first page");
+    if (capacity < 4096 || (capacity & (capacity - 1)))
+        error("ring capacity must be a power of two of at least 4096");
+
+    int fd = create ? shm_open(name.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600)
+                    : shm_open(name.c_str(), O_RDWR, 0);
+    if (fd < 0)
+        error("can't open shared memory ", name);
+    if (!create) // the server chose the capacity
+    {
+        uint32_t header[2];
+        if (pread(fd, header, sizeof header, 0) != sizeof header || header[0] != region_magic)
+        {
+            close(fd);
+            error("not a calculator region: ", name);
+        }
+        capacity = header[1];
+    }
+    bytes = data_offset + 2 * size_t(capacity);
+    if (create && ftruncate(fd, bytes) < 0)
+    {
+        close(fd);
+        error("can't size shared memory ", name);
+    }
+    void *p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd); // the mapping keeps the memory
+    if (p == MAP_FAILED)
+        error("can't map shared memory ", name);
+    base = static_cast<char *>(p);
+    if (create) // new pages are zero: the counters start at 0
+    {
+        layout()->magic = region_magic;
+        layout()->capacity = capacity;
+    }
+}
+
+//------------------------------------------------------------------------------
+inline Shared_region::~Shared_region()
+{
+    munmap(base, bytes);
+    if (owner)
+        shm_unlink(name.c_str());
+}
+
+//------------------------------------------------------------------------------
+// answer the requests in region until the client sends stop_request
+inline void serve(Shared_region &region, function<Message(char type, Message_reader &request)> answer)
+{
+    Ring requests = region.requests();
+    Ring replies = region.replies();
+    while (true)
+    {
+        requests.wait();
+        char type = 0;
+        uint32_t n = 0;
+        while (const char *p = requests.next(type, n)) // all that have arrived
+        {
+            if (type == stop_request)
+            {
+                requests.consume();
+                return;
+            }
+            Message_reader r(p, n); // read straight from the shared pages
+            Message reply = answer(type, r);
+            requests.consume();
+            replies.write(reply.type, reply.payload.data(), reply.payload.size());
+        }
+    }
+}
+
+#else // not POSIX
+
+class Shared_region
+{
+public:
+    Shared_region(const string &, bool, uint32_t = 0) { error("shared memory is not supported on this system"); }
+    Ring requests() { error("shared memory is not supported on this system"); }
+    Ring replies() { error("shared memory is not supported on this system"); }
+};
+
+inline void serve(Shared_region &, function<Message(char, Message_reader &)>)
+{
+    error("shared memory is not supported on this system");
+}
+
+#endif // SHM_POSIX
+
+#endif // SHM_RING_H
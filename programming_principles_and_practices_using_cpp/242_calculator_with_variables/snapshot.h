@@ -0,0 +1,271 @@
+/*
+    snapshot.h
+
+    The variables of a session saved in a file, so that a restarted session
+    can go on where the old one stopped without replaying its history
+    (calculator --restore file --snapshot file).
+
+    A snapshot is a hash table laid out for mapping: a header, a table of
+    slots (open addressing, linear probing, at most half full), the values
+    in one array, the names (each stored once, NUL-terminated), and the
+    elements of matrix values. Slots and values refer to the rest by offsets
+    from the start of the file, never by pointers, so the file works
+    wherever it is mapped.
+
+    Restoring only maps the file and checks its header; nothing is built.
+    The mapped table stays underneath the session's own variables: a
+    lookup tries var_table first and then the snapshot, and a variable
+    that is assigned moves into var_table. A matrix is copied out of the
+    file the first time it is used.
+
+    Names are hashed with FNV-1a (see script_cache.h), not std::hash, which
+    may differ between builds. Like script images, snapshots depend on the
+    machine that wrote them (byte order, the format of double).
+*/
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <cstdint>
+#include <cstring>
+#include <unordered_map>
+#include <utility>
+#include "matrix.h"
+#include "script_cache.h" // fnv1a(), write_file()
+#include "std_lib_facilities.h" // after the standard headers: it #defines vector
+
+//------------------------------------------------------------------------------
+// the layout of a snapshot; all offsets are from the start of the file
+class Snapshot_header
+{
+public:
+    char magic[8];
+    uint64_t count;    // of variables
+    uint64_t capacity; // number of slots; a power of two
+    uint64_t slots;    // offset of the Snapshot_slots
+    uint64_t values;   // offset of count Snapshot_values
+    uint64_t size;     // of the file
+};
+
+class Snapshot_slot
+{
+public:
+    uint64_t hash;
+    uint64_t name;  // of the NUL-terminated name; 0 for an empty slot
+    uint64_t value; // index in the values
+};
+
+class Snapshot_value
+{
+public:
+    double number;
+    uint64_t matrix; // offset of int32 rows, int32 cols, rows*cols doubles row by row; 0 for a number
+};
+
+const char snapshot_magic[8] = {'C', 'A', 'L', 'C', 'S', 'N', 'P', '1'};
+
+//------------------------------------------------------------------------------
+// the contents of a snapshot file holding entries
+inline string snapshot_image(const vector<pair<string, Value>> &entries)
+{
+    uint64_t capacity = 16;
+    while (capacity < 2 * entries.size())
+        capacity *= 2;
+
+    Snapshot_header h{};
+    memcpy(h.magic, snapshot_magic, sizeof h.magic);
+    h.count = entries.size();
+    h.capacity = capacity;
+    h.slots = sizeof h;
+    h.values = h.slots + capacity * sizeof(Snapshot_slot);
+    string bytes(h.values + entries.size() * sizeof(Snapshot_value), '\0');
+    auto append = [&](const void *p, size_t n) {
+        bytes.resize((bytes.size() + 7) & ~size_t(7), '\0');
+        uint64_t offset = bytes.size();
+        bytes.append(static_cast<const char *>(p), n);
+        return offset;
+    };
+
+    vector<Snapshot_slot> slots(capacity);
+    for (size_t i = 0; i < entries.size(); ++i)
+    {
+        const string &name = entries[i].first;
+        const Value &v = entries[i].second;
+        Snapshot_value value{v.number, 0};
+        if (v.is_matrix())
+        {
+            const Matrix &m = *v.matrix;
+            int32_t shape[2] = {m.rows(), m.cols()};
+            value.matrix = append(shape, sizeof shape);
+            for (int r = 0; r < m.rows(); ++r)
+                for (int c = 0; c < m.cols(); ++c)
+                {
+                    double d = m(r, c);
+                    bytes.append(reinterpret_cast<const char *>(&d), sizeof d);
+                }
+        }
+        memcpy(&bytes[h.values + i * sizeof value], &value, sizeof value);
+
+        uint64_t hash = fnv1a(name.data(), name.size());
+        uint64_t s = hash & (capacity - 1);
+        while (slots[s].name)
+            s = (s + 1) & (capacity - 1);
+        slots[s] = Snapshot_slot{hash, append(name.c_str(), name.size() + 1), i};
+    }
+    memcpy(&bytes[h.slots], slots.data(), capacity * sizeof(Snapshot_slot));
+    h.size = bytes.size();
+    memcpy(&bytes[0], &h, sizeof h);
+    return bytes;
+}
+
+#ifdef SCRIPT_CACHE_POSIX
+
+//------------------------------------------------------------------------------
+// a snapshot file, mapped
+class Snapshot
+{
+public:
+    explicit Snapshot(const string &path); // map it and check its header
+    ~Snapshot() { munmap(const_cast<char *>(base), bytes); }
+    Snapshot(const Snapshot &) = delete;
+    Snapshot &operator=(const Snapshot &) = delete;
+
+    bool contains(const string &name) const { return lookup(name) != nullptr; }
+    bool find(const string &name, Value &v) const; // false if name isn't there
+    long size() const { return header().count; }
+
+    template <class F>
+    void for_each(F f) const // call f(name, value) for every variable, in no particular order
+    {
+        for (uint64_t s = 0; s < header().capacity; ++s)
+            if (slots()[s].name)
+                f(string(name_at(slots()[s].name)), value(slots()[s].value));
+    }
+
+private:
+    const char *base;
+    size_t bytes;
+    mutable unordered_map<uint64_t, Value> matrices; // by value index; copied out on first use
+
+    const Snapshot_header &header() const { return *reinterpret_cast<const Snapshot_header *>(base); }
+    const Snapshot_slot *slots() const { return reinterpret_cast<const Snapshot_slot *>(base + header().slots); }
+    const char *name_at(uint64_t offset) const;
+    const Snapshot_slot *lookup(const string &name) const;
+    Value value(uint64_t index) const;
+};
+
+//------------------------------------------------------------------------------
+inline Snapshot::Snapshot(const string &path)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        error("can't open snapshot ", path);
+    struct stat st;
+    void *p = fstat(fd, &st) == 0 && sizeof(Snapshot_header) <= size_t(st.st_size)
+                  ? mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)
+                  : MAP_FAILED;
+    close(fd);
+    if (p == MAP_FAILED)
+        error("not a snapshot: ", path);
+    base = static_cast<const char *>(p);
+    bytes = st.st_size;
+
+    const Snapshot_header &h = header();
+    if (memcmp(h.magic, snapshot_magic, sizeof h.magic) != 0 || h.size != bytes || h.capacity == 0 ||
+        (h.capacity & (h.capacity - 1)) || h.capacity <= h.count || h.slots % 8 || h.values % 8 ||
+        bytes < h.slots || (bytes - h.slots) / sizeof(Snapshot_slot) < h.capacity ||
+        bytes < h.values || (bytes - h.values) / sizeof(Snapshot_value) < h.count)
+    {
+        munmap(p, bytes);
+        error("not a snapshot: ", path);
+    }
+}
+
+//------------------------------------------------------------------------------
+inline const char *Snapshot::name_at(uint64_t offset) const
+{
+    if (bytes <= offset || !memchr(base + offset, '\0', bytes - offset))
+        error("bad snapshot");
+    return base + offset;
+}
+
+//------------------------------------------------------------------------------
+inline const Snapshot_slot *Snapshot::lookup(const string &name) const
+{
+    uint64_t hash = fnv1a(name.data(), name.size());
+    uint64_t mask = header().capacity - 1;
+    for (uint64_t n = 0, s = hash & mask; n <= mask; ++n, s = (s + 1) & mask) // stops at an empty slot
+    {
+        const Snapshot_slot &slot = slots()[s];
+        if (!slot.name)
+            return nullptr;
+        if (slot.hash == hash && name == name_at(slot.name))
+            return &slot;
+    }
+    return nullptr;
+}
+
+//------------------------------------------------------------------------------
+inline Value Snapshot::value(uint64_t index) const
+{
+    if (header().count <= index)
+        error("bad snapshot");
+    const Snapshot_value &v = reinterpret_cast<const Snapshot_value *>(base + header().values)[index];
+    if (!v.matrix)
+        return v.number;
+
+    auto p = matrices.find(index);
+    if (p != matrices.end())
+        return p->second;
+    int32_t shape[2];
+    if (bytes < v.matrix || bytes - v.matrix < sizeof shape)
+        error("bad snapshot");
+    memcpy(shape, base + v.matrix, sizeof shape);
+    const char *elements = base + v.matrix + sizeof shape;
+    if (shape[0] < 0 || shape[1] < 0 || (bytes - v.matrix - sizeof shape) / sizeof(double) < uint64_t(shape[0]) * shape[1])
+        error("bad snapshot");
+    Matrix m(shape[0], shape[1]);
+    for (int r = 0; r < m.rows(); ++r)
+        for (int c = 0; c < m.cols(); ++c)
+            memcpy(&m(r, c), elements + (long(r) * m.cols() + c) * sizeof(double), sizeof(double));
+    return matrices[index] = Value(move(m));
+}
+
+//------------------------------------------------------------------------------
+inline bool Snapshot::find(const string &name, Value &v) const
+{
+    const Snapshot_slot *s = lookup(name);
+    if (!s)
+        return false;
+    v = value(s->value);
+    return true;
+}
+
+//------------------------------------------------------------------------------
+inline void write_snapshot(const string &path, const vector<pair<string, Value>> &entries)
+{
+    if (!write_file(path, snapshot_image(entries)))
+        error("can't write snapshot ", path);
+}
+
+#else // not POSIX
+
+class Snapshot
+{
+public:
+    explicit Snapshot(const string &) { error("snapshots are not supported on this system"); }
+    bool contains(const string &) const { return false; }
+    bool find(const string &, Value &) const { return false; }
+    long size() const { return 0; }
+    template <class F>
+    void for_each(F) const {}
+};
+
+inline void write_snapshot(const string &, const vector<pair<string, Value>> &)
+{
+    error("snapshots are not supported on this system");
+}
+
+#endif
+
+#endif // SNAPSHOT_H
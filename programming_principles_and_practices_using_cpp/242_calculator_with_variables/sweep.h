@@ -0,0 +1,528 @@
+/*
+    sweep.h
+
+    A sweep evaluates one expression at every point of a grid: the Cartesian
+    product of ranges of values for some variables, e.g.
+        x=0:1:0.25 y=1:3:1
+    is the 5*3 points (0,1), (0,2), (0,3), (0.25,1), ... (1,3).
+
+    The points are numbered row by row (the last variable changes fastest), so a
+    block of consecutive indices (a "shard") is enough to describe a piece of
+    the work, and results can be put back together in index order.
+
+    run_sweep() evaluates a grid on a thread pool. The grid is cut into blocks
+    of consecutive points; each task walks its block like an odometer, so
+    neighbouring points use neighbouring memory and no point needs divisions to
+    find its coordinates. Results go to a Sweep_writer (CSV or binary) in
+    index order while the next window of blocks is being computed, so memory
+    use depends on the block size and the number of threads, not on the size
+    of the grid.
+
+    By default each point is run on its own, in double. A Sweep may instead
+    evaluate its points in batches (see batch.h), in double or, with
+    --float, in float. A batch's coordinates are computed in its own type,
+    from + i*step for each range, so a float sweep's coordinates and results
+    stay in float until they are written.
+*/
+
+#ifndef SWEEP_H
+#define SWEEP_H
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include "batch.h"
+#include "compiled_expression.h"
+#include "number_format.h"
+#include "work_stealing_pool.h"
+#include "std_lib_facilities.h" // after the standard headers: it #defines vector
+
+//------------------------------------------------------------------------------
+class Range // the values from, from+step, ..., up to and including to
+{
+public:
+    string var;
+    double from;
+    double step;
+    long count; // number of values
+    double value(long i) const { return from + i * step; }
+};
+
+//------------------------------------------------------------------------------
+// read a range written as var=from:to:step (or var=value, for a single value)
+inline Range parse_range(const string &s)
+{
+    istringstream is(s);
+    string var;
+    getline(is, var, '=');
+    if (!is || var.empty())
+        error("range expected (var=from:to:step): ", s);
+
+    double from, to, step;
+    char colon1, colon2;
+    if (!(is >> from))
+        error("bad range: ", s);
+    if (!(is >> colon1)) // a single value
+        return Range{var, from, 1, 1};
+    if (!(is >> to >> colon2 >> step) || colon1 != ':' || colon2 != ':' || is >> colon1)
+        error("bad range (var=from:to:step): ", s);
+    if (step <= 0 || to < from)
+        error("range must have from <= to and step > 0: ", s);
+
+    // allow for rounding: 0:1:0.1 should include 1
+    long n = long(floor((to - from) / step * (1 + 1e-12))) + 1;
+    return Range{var, from, step, n};
+}
+
+//------------------------------------------------------------------------------
+class Grid
+{
+public:
+    vector<Range> ranges;
+
+    long size() const; // number of points
+    void point(long index, double *values) const; // values[r] = coordinate r of point index
+};
+
+//------------------------------------------------------------------------------
+inline long Grid::size() const
+{
+    long n = 1;
+    for (const Range &r : ranges)
+    {
+        if (numeric_limits<long>::max() / r.count < n)
+            error("grid too large");
+        n *= r.count;
+    }
+    return n;
+}
+
+//------------------------------------------------------------------------------
+inline void Grid::point(long index, double *values) const
+{
+    for (int r = ranges.size() - 1; 0 <= r; --r)
+    {
+        values[r] = ranges[r].value(index % ranges[r].count);
+        index /= ranges[r].count;
+    }
+}
+
+//------------------------------------------------------------------------------
+// walks through consecutive points of a grid like an odometer, without divisions
+class Grid_walk
+{
+public:
+    Grid_walk(const Grid &g, long first, double *coordinates); // coordinates = those of point first
+    void next();                                               // coordinates = those of the next point
+
+private:
+    const Range *ranges;
+    int dims;
+    double *x;
+    vector<long> digits; // the index of each coordinate
+};
+
+//------------------------------------------------------------------------------
+inline Grid_walk::Grid_walk(const Grid &g, long first, double *coordinates)
+    : ranges(g.ranges.data()), dims(g.ranges.size()), x(coordinates), digits(dims)
+{
+    for (int r = dims - 1; 0 <= r; --r)
+    {
+        digits[r] = first % ranges[r].count;
+        first /= ranges[r].count;
+        x[r] = ranges[r].value(digits[r]);
+    }
+}
+
+//------------------------------------------------------------------------------
+inline void Grid_walk::next()
+{
+    long *d = digits.data();
+    for (int r = dims - 1; 0 <= r; --r)
+    {
+        if (++d[r] < ranges[r].count)
+        {
+            x[r] = ranges[r].value(d[r]);
+            return;
+        }
+        d[r] = 0;
+        x[r] = ranges[r].from;
+    }
+}
+
+//------------------------------------------------------------------------------
+enum class Evaluation
+{
+    point,        // run() at each point, in double
+    batch_double, // Batch_evaluator<double>
+    batch_float   // Batch_evaluator<float>: twice the lanes, less precision
+};
+
+//------------------------------------------------------------------------------
+// evaluates a compiled expression at points of a grid; an expression that
+// can't be run in batches (see batch.h) is run point by point whatever e says
+class Sweep
+{
+public:
+    Sweep(const Code &c, const Grid &g, Evaluation e = Evaluation::point);
+
+    double at(long index); // the value at point index; NaN on error
+    template <class T>
+    void evaluate(long first, long n, T *out); // out[i] = at(first+i), as a double or float
+
+    long errors = 0; // points at which the expression could not be evaluated
+
+private:
+    const Code &code;
+    const Grid &grid;
+    vector<int> range_of_slot; // slot i gets coordinate range_of_slot[i]
+    vector<double> coordinates;
+    vector<double> slots;
+    unique_ptr<Batch_evaluator<double>> doubles;
+    unique_ptr<Batch_evaluator<float>> floats;
+
+    double compute(); // the value at coordinates
+    template <class F, class T>
+    void evaluate_batches(Batch_evaluator<F> &batch, long first, long n, T *out);
+};
+
+//------------------------------------------------------------------------------
+inline Sweep::Sweep(const Code &c, const Grid &g, Evaluation e)
+    : code(c), grid(g), coordinates(g.ranges.size()), slots(c.names.size())
+{
+    if (code.uses_matrices)
+        error("a sweep needs an expression that yields a number");
+    for (int i = 0; i < int(code.names.size()); ++i)
+    {
+        int r = 0;
+        while (r < int(grid.ranges.size()) && grid.ranges[r].var != code.names[i])
+            ++r;
+        if (r == int(grid.ranges.size()) && !code.is_bound(i))
+            error("no range given for variable ", code.names[i]);
+        range_of_slot.push_back(r < int(grid.ranges.size()) ? r : -1);
+    }
+    for (const Range &r : grid.ranges)
+        if (numeric_limits<int>::max() < r.count)
+            return; // too many values for a batch's int indices: point by point
+    if (e == Evaluation::batch_double && Batch_evaluator<double>::can_run(code))
+        doubles = make_unique<Batch_evaluator<double>>(code);
+    if (e == Evaluation::batch_float && Batch_evaluator<float>::can_run(code))
+        floats = make_unique<Batch_evaluator<float>>(code);
+}
+
+//------------------------------------------------------------------------------
+inline double Sweep::at(long index)
+{
+    grid.point(index, coordinates.data());
+    return compute();
+}
+
+//------------------------------------------------------------------------------
+inline double Sweep::compute()
+{
+    for (int i = 0; i < int(slots.size()); ++i)
+        if (0 <= range_of_slot[i])
+            slots[i] = coordinates[range_of_slot[i]];
+    try
+    {
+        return run(code, 0, slots.data());
+    }
+    catch (exception &)
+    {
+        ++errors; // e.g. divide by zero at this point
+        return numeric_limits<double>::quiet_NaN();
+    }
+}
+
+//------------------------------------------------------------------------------
+// like calling at() for each point, but steps from point to point like an odometer
+template <class T>
+void Sweep::evaluate(long first, long n, T *out)
+{
+    if (doubles)
+        return evaluate_batches(*doubles, first, n, out);
+    if (floats)
+        return evaluate_batches(*floats, first, n, out);
+
+    Grid_walk walk(grid, first, coordinates.data());
+    for (long i = 0; i < n; ++i, walk.next())
+        out[i] = T(compute());
+}
+
+//------------------------------------------------------------------------------
+// evaluate() with batch: row r of rows holds coordinate r of each point of
+// the batch, computed in F as from + i*step, and a slot's column is the row
+// of its range (can_run(): every slot has a range)
+template <class F, class T>
+void Sweep::evaluate_batches(Batch_evaluator<F> &batch, long first, long n, T *out)
+{
+    const int width = Batch_evaluator<F>::width;
+    const int dims = grid.ranges.size();
+    vector<F> rows(dims * width);
+    vector<const F *> column(slots.size());
+    for (int i = 0; i < int(slots.size()); ++i)
+        column[i] = rows.data() + range_of_slot[i] * width;
+    vector<int> digits(dims); // the index in each range of the next point
+    for (int r = dims - 1; 0 <= r; --r)
+    {
+        digits[r] = first % grid.ranges[r].count;
+        first /= grid.ranges[r].count;
+    }
+    const Range &last = grid.ranges[dims - 1];
+    const F from = F(last.from);
+    const F step = F(last.step);
+    F values[width];
+
+    for (long done = 0; done < n; done += width)
+    {
+        int m = min(long(width), n - done);
+        // the last range changes fastest: its row is filled in runs up to
+        // where it wraps around, and the other rows are constant in each run.
+        // A run of the whole batch (the usual case) is filled by loops of
+        // constant length, which the compiler vectorizes
+        for (int p = 0; p < m;)
+        {
+            int d = digits[dims - 1];
+            int run = min(long(m - p), last.count - d);
+            int length = run == width ? width : run;
+            F *x = rows.data() + (dims - 1) * width + p;
+            if (length == width)
+                for (int k = 0; k < width; ++k)
+                    x[k] = from + F(d + k) * step;
+            else
+                for (int k = 0; k < run; ++k)
+                    x[k] = from + F(d + k) * step;
+            for (int r = 0; r < dims - 1; ++r)
+            {
+                F *y = rows.data() + r * width + p;
+                F c = F(grid.ranges[r].from) + F(digits[r]) * F(grid.ranges[r].step);
+                if (length == width)
+                    for (int k = 0; k < width; ++k)
+                        y[k] = c;
+                else
+                    fill(y, y + run, c);
+            }
+            p += run;
+            digits[dims - 1] += run;
+            for (int r = dims - 1; 0 < r && digits[r] == grid.ranges[r].count; --r)
+            {
+                digits[r] = 0;
+                ++digits[r - 1];
+            }
+        }
+        errors += batch.run(column.data(), m, values);
+        copy(values, values + m, out + done);
+    }
+}
+
+//------------------------------------------------------------------------------
+// receives the results of a sweep in index order
+class Sweep_writer
+{
+public:
+    virtual ~Sweep_writer() {}
+    virtual void write(long first, const double *values, long n) = 0; // values of points first...
+    virtual void write(long first, const float *values, long n);      // those of a float sweep
+};
+
+//------------------------------------------------------------------------------
+// unless a writer keeps floats, they are written as doubles
+inline void Sweep_writer::write(long first, const float *values, long n)
+{
+    double doubles[1024];
+    for (long done = 0; done < n; done += 1024)
+    {
+        long m = min(1024L, n - done);
+        copy(values + done, values + done + m, doubles);
+        write(first + done, doubles, m);
+    }
+}
+
+//------------------------------------------------------------------------------
+// one line per point: the coordinates, then the value
+class Csv_writer : public Sweep_writer
+{
+public:
+    Csv_writer(ostream &s, const Grid &g);
+    void write(long first, const double *values, long n) override;
+
+private:
+    ostream &os;
+    const Grid &grid;
+    vector<double> point;
+    Number_formatter shortest{Number_formatter::shortest}; // reads back exactly
+    string line; // reused for each point
+};
+
+//------------------------------------------------------------------------------
+inline Csv_writer::Csv_writer(ostream &s, const Grid &g)
+    : os(s), grid(g), point(g.ranges.size())
+{
+    for (const Range &r : grid.ranges)
+        os << r.var << ',';
+    os << "value\n";
+}
+
+//------------------------------------------------------------------------------
+inline void Csv_writer::write(long first, const double *values, long n)
+{
+    for (long i = 0; i < n; ++i)
+    {
+        grid.point(first + i, point.data());
+        line.clear();
+        for (double x : point)
+        {
+            line += shortest(x);
+            line += ',';
+        }
+        line += shortest(values[i]);
+        line += '\n';
+        os.write(line.data(), line.size());
+    }
+}
+
+//------------------------------------------------------------------------------
+// a header describing the grid, then the values as raw doubles in index order:
+//     "SWEEP1\n" (or "SWEEP1F\n" for floats)
+//     int32 number of ranges
+//     for each range: int32 length of the name, the name, double from, double step, int64 count
+//     the values (as many as the grid has points)
+// the coordinates of a point follow from its index (see Grid::point).
+// A float writer (for --float) writes the values as raw floats, as computed
+class Binary_writer : public Sweep_writer
+{
+public:
+    Binary_writer(ostream &s, const Grid &g, bool float_values = false);
+    void write(long first, const double *values, long n) override;
+    void write(long first, const float *values, long n) override;
+
+private:
+    ostream &os;
+    bool floats;
+    template <class T>
+    void put(T x) { os.write(reinterpret_cast<const char *>(&x), sizeof x); }
+    template <class T>
+    void put_values(const T *values, long n);
+};
+
+//------------------------------------------------------------------------------
+inline Binary_writer::Binary_writer(ostream &s, const Grid &g, bool float_values)
+    : os(s), floats(float_values)
+{
+    os << (floats ? "SWEEP1F\n" : "SWEEP1\n");
+    put(int32_t(g.ranges.size()));
+    for (const Range &r : g.ranges)
+    {
+        put(int32_t(r.var.size()));
+        os << r.var;
+        put(r.from);
+        put(r.step);
+        put(int64_t(r.count));
+    }
+}
+
+//------------------------------------------------------------------------------
+inline void Binary_writer::write(long, const double *values, long n)
+{
+    put_values(values, n);
+}
+
+inline void Binary_writer::write(long, const float *values, long n)
+{
+    put_values(values, n);
+}
+
+// the values as the header says: doubles, or floats
+template <class T>
+void Binary_writer::put_values(const T *values, long n)
+{
+    if (floats == is_same<T, float>::value)
+    {
+        os.write(reinterpret_cast<const char *>(values), n * sizeof(T));
+        return;
+    }
+    for (long i = 0; i < n; ++i)
+        if (floats)
+            put(float(values[i]));
+        else
+            put(double(values[i]));
+}
+
+//------------------------------------------------------------------------------
+class Sweep_statistics
+{
+public:
+    long points = 0;
+    long blocks = 0;
+    long errors = 0; // points that evaluated to NaN because of an error
+    double seconds = 0;
+};
+
+//------------------------------------------------------------------------------
+// run_sweep() with the results kept as T
+template <class T>
+Sweep_statistics run_sweep_as(const Code &code, const Grid &grid, Work_stealing_pool &pool,
+                              long block_size, Sweep_writer &out, Evaluation e)
+{
+    auto start = chrono::steady_clock::now();
+    Sweep check(code, grid); // complain before starting any tasks
+    if (block_size < 1)
+        error("run_sweep: block size must be positive");
+
+    Sweep_statistics stats;
+    stats.points = grid.size();
+    stats.blocks = (stats.points + block_size - 1) / block_size;
+    const long window = 4 * (pool.size() + 1); // blocks in flight: enough to keep every thread busy
+    atomic<long> errors{0};
+
+    // two windows of buffers: one being computed while the other is written
+    vector<vector<T>> computing(window), writing(window);
+    auto start_window = [&](long first_block, Task_group &group) {
+        for (long b = 0; b < window && first_block + b < stats.blocks; ++b)
+            group.run([&, b, first_block] {
+                long first = (first_block + b) * block_size;
+                long n = min(block_size, stats.points - first);
+                vector<T> &values = computing[b];
+                values.resize(n);
+                Sweep sweep(code, grid, e);
+                sweep.evaluate(first, n, values.data());
+                errors += sweep.errors;
+            });
+    };
+
+    long written = 0; // blocks
+    {
+        Task_group group(pool);
+        start_window(0, group);
+        group.wait();
+    }
+    while (written < stats.blocks)
+    {
+        swap(computing, writing);
+        long next = written + window;
+        Task_group group(pool);
+        if (next < stats.blocks)
+            start_window(next, group);
+        for (long b = 0; b < window && written < stats.blocks; ++b, ++written)
+            out.write(written * block_size, writing[b].data(), writing[b].size());
+        group.wait();
+    }
+
+    stats.errors = errors;
+    chrono::duration<double> t = chrono::steady_clock::now() - start;
+    stats.seconds = t.count();
+    return stats;
+}
+
+//------------------------------------------------------------------------------
+// evaluate code at every point of grid using pool, in blocks of block_size points;
+// the results go to out in index order (as floats for Evaluation::batch_float)
+inline Sweep_statistics run_sweep(const Code &code, const Grid &grid, Work_stealing_pool &pool,
+                                  long block_size, Sweep_writer &out, Evaluation e = Evaluation::point)
+{
+    if (e == Evaluation::batch_float)
+        return run_sweep_as<float>(code, grid, pool, block_size, out, e);
+    return run_sweep_as<double>(code, grid, pool, block_size, out, e);
+}
+
+#endif // SWEEP_H
@@ -0,0 +1,369 @@
+/*
+    wire.h
+
+    Requests to a calculator server (calculator --serve address) in a binary
+    format, sent as Messages (see channel.h). Reading the characters of a
+    short expression costs more than evaluating it, so a client may send the
+    work in one of three forms:
+        text      the expression as it would be typed
+        tokens    the expression already split into tokens
+        bytecode  the expression already compiled into a Code
+    Each request also carries bindings: values for some of the names in the
+    expression, as a table with one row per evaluation. Names that aren't
+    bound are taken from the server's variables. The answer is the value for
+    each row, as raw doubles (NaN where the evaluation failed), or an error.
+
+    The payloads:
+        text      string text, bindings
+        tokens    uint32 n, n tokens: char kind, then double value for a
+                  number or string name for a name; bindings
+        bytecode  code, bindings
+        bindings  uint32 number of names, the names, uint32 rows,
+                  rows * names doubles (row by row)
+        code      uint32 n, n instructions: uint8 op, int32 arg;
+                  uint32 n, n constants (double); uint32 n, n names (string);
+                  uint32 n, n calls: int32 body, int32 var;
+                  uint32 n, n shapes: int32 rows, int32 cols;
+                  uint32 n, n functions: int32 body, int32 slot, int32 params, int32 memo
+        values    uint32 rows, int64 errors, rows doubles
+        error     string message
+    Strings are a uint32 length followed by the characters.
+
+    Bytecode comes from outside, and run() trusts its Code, so get_code()
+    checks that every index is in range, every jump goes forward to the end
+    of a body, every branch of an if goes forward within its body to where
+    the stack is as deep as at the branch, and the stack can neither
+    underflow nor overflow.
+*/
+
+#ifndef WIRE_H
+#define WIRE_H
+
+#include <cerrno>
+#include <functional>
+#include <memory>
+#if defined(__unix__) || defined(__APPLE__)
+#include <poll.h>
+#endif
+#include "channel.h"
+#include "compiled_expression.h"
+#include "std_lib_facilities.h" // after the standard headers: it #defines vector
+
+//------------------------------------------------------------------------------
+// message types
+const char text_request = 'T';
+const char tokens_request = 'K';
+const char bytecode_request = 'B';
+const char values_reply = 'V';
+const char error_reply = 'E';
+const char stop_request = 'X'; // stop the server (for benchmarks and tests)
+
+//------------------------------------------------------------------------------
+class Bindings // values for some names; one row of values per evaluation
+{
+public:
+    vector<string> names;
+    long rows = 0;
+    vector<double> values; // rows * names.size(), row by row
+};
+
+//------------------------------------------------------------------------------
+inline void put_bindings(Message &m, const Bindings &b)
+{
+    m.put(uint32_t(b.names.size()));
+    for (const string &n : b.names)
+        m.put_string(n);
+    m.put(uint32_t(b.rows));
+    m.put_bytes(b.values.data(), b.values.size() * sizeof(double));
+}
+
+//------------------------------------------------------------------------------
+inline Bindings get_bindings(Message_reader &r)
+{
+    Bindings b;
+    uint32_t n = r.get<uint32_t>();
+    for (uint32_t i = 0; i < n; ++i)
+        b.names.push_back(r.get_string());
+    b.rows = r.get<uint32_t>();
+    size_t count = size_t(b.rows) * n;
+    const char *p = r.take(count * sizeof(double)); // checks that they are all there
+    b.values.resize(count);
+    memcpy(b.values.data(), p, count * sizeof(double));
+    return b;
+}
+
+//------------------------------------------------------------------------------
+inline void put_code(Message &m, const Code &code)
+{
+    m.put(uint32_t(code.instructions.size()));
+    for (const Instruction &in : code.instructions)
+    {
+        m.put(uint8_t(in.op));
+        m.put(int32_t(in.arg));
+    }
+    m.put(uint32_t(code.constants.size()));
+    m.put_bytes(code.constants.data(), code.constants.size() * sizeof(double));
+    m.put(uint32_t(code.names.size()));
+    for (const string &n : code.names)
+        m.put_string(n);
+    m.put(uint32_t(code.calls.size()));
+    for (const Call_site &c : code.calls)
+    {
+        m.put(int32_t(c.body));
+        m.put(int32_t(c.var));
+    }
+    m.put(uint32_t(code.shapes.size()));
+    for (const Shape &s : code.shapes)
+    {
+        m.put(int32_t(s.rows));
+        m.put(int32_t(s.cols));
+    }
+    m.put(uint32_t(code.functions.size()));
+    for (const Function_site &f : code.functions)
+    {
+        m.put(int32_t(f.body));
+        m.put(int32_t(f.slot));
+        m.put(int32_t(f.params));
+        m.put(int32_t(f.memo));
+    }
+}
+
+//------------------------------------------------------------------------------
+// check the instructions [first,last) of code, which end with Opcode::end and
+// run with a stack of their own; nesting counts the bodies we are inside
+inline void validate_block(const Code &code, int first, int last, int nesting)
+{
+    const int max_nesting = 64; // of integrands; validate_block() recurses that deep
+    if (max_nesting < nesting)
+        error("bytecode: integrands nested too deeply");
+
+    vector<int> stack; // for each value: the shape of the matrix literal being filled in, or -1
+    auto pop = [&](int n) {
+        if (int(stack.size()) < n)
+            error("bytecode: stack underflow");
+        stack.resize(stack.size() - n);
+    };
+    auto in_range = [](int i, int n) { return 0 <= i && i < n; };
+    vector<pair<int, int>> joins; // where a branch or skip goes, and the stack depth it expects there
+
+    for (int pc = first; pc < last; ++pc)
+    {
+        for (int i = 0; i < int(joins.size()); ++i)
+            if (joins[i].first == pc)
+            {
+                if (joins[i].second != int(stack.size()))
+                    error("bytecode: bad branch");
+                joins.erase(joins.begin() + i--);
+            }
+        Instruction in = code.instructions[pc];
+        switch (in.op)
+        {
+        case Opcode::constant:
+            if (!in_range(in.arg, code.constants.size()))
+                error("bytecode: no such constant");
+            stack.push_back(-1);
+            break;
+        case Opcode::load:
+            if (!in_range(in.arg, code.names.size()))
+                error("bytecode: no such slot");
+            stack.push_back(-1);
+            break;
+        case Opcode::add:
+        case Opcode::subtract:
+        case Opcode::multiply:
+        case Opcode::divide:
+        case Opcode::modulo:
+        case Opcode::zeros:
+            pop(2);
+            stack.push_back(-1);
+            break;
+        case Opcode::negate:
+        case Opcode::transpose:
+        case Opcode::identity:
+            pop(1);
+            stack.push_back(-1);
+            break;
+        case Opcode::jump: // over a body, which must end just before the target
+            if (in.arg <= pc + 1 || last <= in.arg || code.instructions[in.arg - 1].op != Opcode::end)
+                error("bytecode: bad jump");
+            validate_block(code, pc + 1, in.arg, nesting + 1);
+            pc = in.arg - 1;
+            break;
+        case Opcode::integrate:
+        case Opcode::solve:
+        {
+            if (!in_range(in.arg, code.calls.size()))
+                error("bytecode: no such call");
+            const Call_site &c = code.calls[in.arg];
+            if (!in_range(c.body - 1, pc) || code.instructions[c.body - 1].op != Opcode::jump ||
+                !in_range(c.var, code.names.size()))
+                error("bytecode: bad call");
+            pop(in.op == Opcode::integrate ? 3 : 2);
+            stack.push_back(-1);
+            break;
+        }
+        case Opcode::matrix:
+            if (!in_range(in.arg, code.shapes.size()))
+                error("bytecode: no such shape");
+            stack.push_back(in.arg);
+            break;
+        case Opcode::element: // only into a matrix literal, within its bounds
+        {
+            pop(1);
+            if (stack.empty() || stack.back() < 0)
+                error("bytecode: element outside a matrix literal");
+            const Shape &s = code.shapes[stack.back()];
+            if (in.arg < 0 || long(s.rows) * s.cols <= in.arg)
+                error("bytecode: element out of range");
+            break;
+        }
+        case Opcode::compare:
+            if (!in_range(in.arg, int(Relation::not_equal) + 1))
+                error("bytecode: no such relation");
+            pop(2);
+            stack.push_back(-1);
+            break;
+        case Opcode::branch: // to the else of an if: the condition is gone
+            pop(1);
+            if (in.arg <= pc || last <= in.arg)
+                error("bytecode: bad branch");
+            joins.push_back(make_pair(in.arg, int(stack.size())));
+            break;
+        case Opcode::skip: // over the else of an if, which pushes the value instead
+            pop(1);
+            if (in.arg <= pc || last <= in.arg)
+                error("bytecode: bad branch");
+            joins.push_back(make_pair(in.arg, int(stack.size()) + 1));
+            break;
+        case Opcode::call:
+        {
+            if (!in_range(in.arg, code.functions.size()))
+                error("bytecode: no such function");
+            pop(code.functions[in.arg].params);
+            stack.push_back(-1);
+            break;
+        }
+        case Opcode::end:
+            if (pc != last - 1 || stack.size() != 1 || !joins.empty())
+                error("bytecode: bad end");
+            break;
+        default:
+            error("bytecode: bad instruction");
+        }
+        if (max_stack < stack.size())
+            error("bytecode: expression too complex");
+    }
+}
+
+//------------------------------------------------------------------------------
+// read a Code from r and check that it is safe to run
+inline Code get_code(Message_reader &r)
+{
+    Code code;
+    uint32_t n = r.get<uint32_t>();
+    for (uint32_t i = 0; i < n; ++i)
+    {
+        uint8_t op = r.get<uint8_t>();
+        int32_t arg = r.get<int32_t>();
+        if (uint8_t(Opcode::end) < op)
+            error("bytecode: bad instruction");
+        code.instructions.push_back(Instruction{Opcode(op), arg});
+        if (Opcode::matrix <= Opcode(op) && Opcode(op) <= Opcode::identity)
+            code.uses_matrices = true;
+    }
+    n = r.get<uint32_t>();
+    for (uint32_t i = 0; i < n; ++i)
+        code.constants.push_back(r.get<double>());
+    n = r.get<uint32_t>();
+    for (uint32_t i = 0; i < n; ++i)
+        code.names.push_back(r.get_string());
+    n = r.get<uint32_t>();
+    for (uint32_t i = 0; i < n; ++i)
+    {
+        int body = r.get<int32_t>();
+        int var = r.get<int32_t>();
+        code.calls.push_back(Call_site{body, var});
+    }
+    n = r.get<uint32_t>();
+    for (uint32_t i = 0; i < n; ++i)
+    {
+        int rows = r.get<int32_t>();
+        int cols = r.get<int32_t>();
+        if (rows < 1 || cols < 1 || 1 << 20 < rows || 1 << 20 < cols)
+            error("bytecode: bad matrix shape");
+        code.shapes.push_back(Shape{rows, cols});
+    }
+    n = r.get<uint32_t>();
+    for (uint32_t i = 0; i < n; ++i)
+    {
+        Function_site f;
+        f.body = r.get<int32_t>();
+        f.slot = r.get<int32_t>();
+        f.params = r.get<int32_t>();
+        f.memo = r.get<int32_t>();
+        // the body must be one that a jump skips (and so is checked below)
+        if (f.body < 1 || code.size() <= f.body || code.instructions[f.body - 1].op != Opcode::jump ||
+            f.params < 0 || max_stack < f.params || f.slot < 0 || long(code.names.size()) <= f.slot + long(f.params) ||
+            (f.memo != 0 && f.memo != 1))
+            error("bytecode: bad function");
+        code.add_function(f.body, f.slot, f.params, f.memo);
+    }
+
+    if (code.instructions.empty())
+        error("bytecode: no instructions");
+    validate_block(code, 0, code.size(), 0);
+    return code;
+}
+
+#ifdef CHANNEL_POSIX
+
+//------------------------------------------------------------------------------
+// answer requests from any number of clients connecting to listener, one
+// request at a time, until a client sends stop_request
+inline void serve(int listener, function<Message(const Message &)> answer)
+{
+    vector<unique_ptr<Channel>> clients;
+    while (true)
+    {
+        vector<pollfd> fds{pollfd{listener, POLLIN, 0}};
+        for (auto &c : clients)
+            fds.push_back(pollfd{c->fd(), POLLIN, 0});
+        if (poll(fds.data(), fds.size(), -1) < 0 && errno != EINTR)
+            error("poll failed");
+
+        for (int i = 1; i < int(fds.size()); ++i)
+        {
+            if (!(fds[i].revents & (POLLIN | POLLHUP | POLLERR)))
+                continue;
+            Message m;
+            if (!clients[i - 1]->receive(m))
+            {
+                clients[i - 1].reset(); // gone
+                continue;
+            }
+            if (m.type == stop_request)
+                return;
+            if (!clients[i - 1]->send(answer(m)))
+                clients[i - 1].reset();
+        }
+        clients.erase(remove(clients.begin(), clients.end(), nullptr), clients.end());
+
+        if (fds[0].revents & POLLIN)
+        {
+            int fd = close_on_exec(accept(listener, nullptr, nullptr));
+            if (0 <= fd)
+                clients.push_back(make_unique<Channel>(fd));
+        }
+    }
+}
+
+#else // not POSIX
+
+inline void serve(int, function<Message(const Message &)>)
+{
+    error("the server is not supported on this system");
+}
+
+#endif
+
+#endif // WIRE_H
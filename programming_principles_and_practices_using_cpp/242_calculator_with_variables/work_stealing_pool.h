@@ -0,0 +1,228 @@
+/*
+    work_stealing_pool.h
+
+    A pool of worker threads, one per core. Each worker has its own queue of tasks.
+    A worker takes its newest task first (from the back of its queue); when its
+    own queue is empty it steals the oldest task (from the front) of another
+    worker. Tasks submitted by a worker go into that worker's queue, so work that
+    splits itself recursively (like adaptive integration) stays mostly local and
+    idle workers take the big, old pieces.
+
+    A Task_group collects the tasks belonging to one job. Task_group::wait() does
+    not block: the waiting thread runs tasks itself until the group is done. That
+    way a task may start and wait for a group of its own without deadlocking.
+*/
+
+#ifndef WORK_STEALING_POOL_H
+#define WORK_STEALING_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include "std_lib_facilities.h" // after the standard headers: it #defines vector
+
+//------------------------------------------------------------------------------
+class Work_stealing_pool
+{
+public:
+    explicit Work_stealing_pool(int n = thread::hardware_concurrency());
+    ~Work_stealing_pool();
+
+    void submit(function<void()> task); // queue a task for some worker
+    bool run_one();                     // run one queued task, if there is one
+    int size() const { return workers.size(); }
+
+private:
+    class Task_queue
+    {
+    public:
+        mutex m;
+        deque<function<void()>> tasks;
+    };
+
+    vector<unique_ptr<Task_queue>> queues; // queues[i] belongs to workers[i]
+    vector<thread> workers;
+    atomic<int> queued;   // tasks submitted but not yet started
+    atomic<unsigned> next; // where submit() puts tasks from non-workers
+    mutex sleep_mutex;
+    condition_variable wake;
+    bool done;
+
+    bool take(function<void()> &task); // pop from our own queue or steal
+    void work(int index);              // the body of each worker thread
+
+    static inline thread_local Work_stealing_pool *current_pool = nullptr; // the pool of this thread
+    static inline thread_local int current_index = -1;                     // our queue in current_pool
+};
+
+//------------------------------------------------------------------------------
+inline Work_stealing_pool::Work_stealing_pool(int n)
+    : queued(0), next(0), done(false)
+{
+    if (n < 1)
+        n = 1;
+    for (int i = 0; i < n; ++i)
+        queues.push_back(make_unique<Task_queue>());
+    for (int i = 0; i < n; ++i)
+        workers.push_back(thread([this, i] { work(i); }));
+}
+
+//------------------------------------------------------------------------------
+inline Work_stealing_pool::~Work_stealing_pool()
+{
+    {
+        lock_guard<mutex> lock(sleep_mutex);
+        done = true;
+    }
+    wake.notify_all();
+    for (thread &t : workers)
+        t.join();
+}
+
+//------------------------------------------------------------------------------
+inline void Work_stealing_pool::submit(function<void()> task)
+{
+    int i = current_pool == this ? current_index : next++ % queues.size();
+    {
+        lock_guard<mutex> lock(queues[i]->m);
+        queues[i]->tasks.push_back(move(task));
+    }
+    ++queued;
+    lock_guard<mutex> lock(sleep_mutex); // don't let a worker miss the wakeup
+    wake.notify_one();
+}
+
+//------------------------------------------------------------------------------
+inline bool Work_stealing_pool::take(function<void()> &task)
+{
+    if (queued == 0)
+        return false;
+
+    int me = current_pool == this ? current_index : 0;
+    {
+        Task_queue &q = *queues[me];
+        lock_guard<mutex> lock(q.m);
+        if (!q.tasks.empty())
+        {
+            task = move(q.tasks.back()); // newest first: it is still warm in cache
+            q.tasks.pop_back();
+            --queued;
+            return true;
+        }
+    }
+    for (int k = 1; k < int(queues.size()); ++k)
+    {
+        Task_queue &q = *queues[(me + k) % queues.size()];
+        lock_guard<mutex> lock(q.m);
+        if (!q.tasks.empty())
+        {
+            task = move(q.tasks.front()); // steal the oldest: probably the biggest piece
+            q.tasks.pop_front();
+            --queued;
+            return true;
+        }
+    }
+    return false;
+}
+
+//------------------------------------------------------------------------------
+inline bool Work_stealing_pool::run_one()
+{
+    function<void()> task;
+    if (!take(task))
+        return false;
+    task();
+    return true;
+}
+
+//------------------------------------------------------------------------------
+inline void Work_stealing_pool::work(int index)
+{
+    current_pool = this;
+    current_index = index;
+    while (true)
+    {
+        if (run_one())
+            continue;
+        unique_lock<mutex> lock(sleep_mutex);
+        wake.wait(lock, [this] { return done || queued > 0; });
+        if (done)
+            return;
+    }
+}
+
+//------------------------------------------------------------------------------
+// the pool shared by everything in the program that wants to run in parallel
+inline Work_stealing_pool &default_pool()
+{
+    static Work_stealing_pool pool;
+    return pool;
+}
+
+//------------------------------------------------------------------------------
+class Task_group
+{
+public:
+    explicit Task_group(Work_stealing_pool &p = default_pool())
+        : pool(p), active(0)
+    {
+    }
+    ~Task_group() { wait_quietly(); }
+
+    void run(function<void()> task); // run task on the pool as part of this group
+    void wait();                     // help until all tasks are done; rethrow the first error
+
+private:
+    Work_stealing_pool &pool;
+    atomic<int> active; // tasks started by run() and not yet finished
+    mutex error_mutex;
+    exception_ptr first_error;
+
+    void wait_quietly();
+};
+
+//------------------------------------------------------------------------------
+inline void Task_group::run(function<void()> task)
+{
+    ++active;
+    pool.submit([this, task] {
+        try
+        {
+            task();
+        }
+        catch (...)
+        {
+            lock_guard<mutex> lock(error_mutex);
+            if (!first_error)
+                first_error = current_exception();
+        }
+        --active;
+    });
+}
+
+//------------------------------------------------------------------------------
+inline void Task_group::wait_quietly()
+{
+    while (active > 0)
+        if (!pool.run_one())
+            this_thread::yield(); // the remaining tasks are running elsewhere
+}
+
+//------------------------------------------------------------------------------
+inline void Task_group::wait()
+{
+    wait_quietly();
+    if (first_error)
+    {
+        exception_ptr e = first_error;
+        first_error = nullptr;
+        rethrow_exception(e);
+    }
+}
+
+#endif // WORK_STEALING_POOL_H
@@ -1,4 +1,4 @@
-#include "std_lib_facilities.h"
+#include "../std_lib_facilities/std_lib_core.h" // the part of std_lib_facilities.h this program uses
 
 int main()
 {
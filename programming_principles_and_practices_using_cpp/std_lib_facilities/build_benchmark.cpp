@@ -0,0 +1,110 @@
+/*
+    build_benchmark.cpp
+
+    How long the compiler takes over one program, depending on how it gets
+    the course facilities: all of std_lib_facilities.h, or just the parts
+    it uses, as hello_world.cpp and vector.cpp #include them (std_lib_core.h
+    and so on). Compiles each program both ways, with the flags of its
+    build task (-g), and prints the best of a few runs, in seconds.
+
+    Run it in this directory, with the compiler as CXX (default g++):
+        g++ -O2 -std=c++17 -o build_benchmark build_benchmark.cpp
+        ./build_benchmark
+    (import std_lib_facilities isn't timed: GCC 12 can't build programs
+    that import the module; see std_lib_facilities.cppm.)
+*/
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include "std_lib_core.h"
+
+//------------------------------------------------------------------------------
+// the programs, without their #include "std_lib_facilities.h"
+const char *hello_world = R"(
+int main()
+{
+    cout << "Hello Programming!\nHere we go!\n";
+    keep_window_open();
+    return 0;
+}
+)";
+
+const char *vector_example = R"(
+int main()
+{
+    vector<double> temps;
+    for(double temp; cin >> temp;)
+        temps.push_back(temp);
+    double sum = 0;
+    for(double x : temps) sum += x;
+    cout << "Average temperature: " << sum/temps.size() << '\n';
+    sort(temps);
+    cout << "Median temperature: " << temps[temps.size()/2] << '\n';
+}
+)";
+
+//------------------------------------------------------------------------------
+string compiler()
+{
+    const char *cxx = getenv("CXX");
+    return cxx && *cxx ? cxx : "g++";
+}
+
+// seconds to run command once, or -1 if it fails; its errors go to log
+double seconds_to_run(const string &command, const string &log = "build_benchmark.log")
+{
+    auto start = chrono::steady_clock::now();
+    int status = system((command + " 2>" + log).c_str());
+    chrono::duration<double> t = chrono::steady_clock::now() - start;
+    return status == 0 ? t.count() : -1;
+}
+
+// the best of a few compilations of text (which #includes what it needs)
+double seconds_to_compile(const string &text, const string &options)
+{
+    const int runs = 3;
+    ofstream("build_benchmark_tu.cpp") << text;
+    double best = -1;
+    for (int i = 0; i < runs; ++i)
+    {
+        double t = seconds_to_run(compiler() + ' ' + options + " -c -o build_benchmark_tu.o build_benchmark_tu.cpp");
+        if (t < 0)
+            return -1;
+        if (best < 0 || t < best)
+            best = t;
+    }
+    return best;
+}
+
+//------------------------------------------------------------------------------
+int main()
+{
+    const string options = "-g"; // as the programs' build tasks
+    cout << "compiler: " << compiler() << "\n\n";
+
+    struct Program {
+        const char *name;
+        const char *text;
+        const char *parts; // the std_lib_*.h it #includes
+    };
+    const Program programs[] = {
+        {"hello_world.cpp", hello_world, "#include \"std_lib_core.h\"\n"},
+        {"vector.cpp", vector_example,
+         "#include \"std_lib_vector.h\"\n#include \"std_lib_algorithms.h\"\n"},
+    };
+
+    cout << setw(16) << "seconds" << setw(20) << "std_lib_facilities" << setw(10) << "parts" << '\n';
+    for (const Program &p : programs)
+    {
+        double all = seconds_to_compile(string("#include \"std_lib_facilities.h\"\n") + p.text, options);
+        double parts = seconds_to_compile(p.parts + string(p.text), options);
+        cout << setw(16) << p.name << setw(20) << all << setw(10) << parts << '\n';
+    }
+
+    remove("build_benchmark_tu.cpp");
+    remove("build_benchmark_tu.o");
+    remove("build_benchmark.log");
+}
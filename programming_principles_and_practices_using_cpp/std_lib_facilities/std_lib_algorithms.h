@@ -0,0 +1,51 @@
+/*
+	std_lib_algorithms.h
+
+	sort(), find(), and find_if() of a whole container.
+*/
+
+#ifndef STD_LIB_ALGORITHMS_H
+#define STD_LIB_ALGORITHMS_H
+
+#ifndef PPP_MODULE
+#include <algorithm>
+#endif
+#include "std_lib_core.h"
+
+// container algorithms. See 21.9.
+
+template<typename C>
+using Value_type = typename C::value_type;
+
+template<typename C>
+using Iterator = typename C::iterator;
+
+template<typename C>
+	// requires Container<C>()
+void sort(C& c)
+{
+	std::sort(c.begin(), c.end());
+}
+
+template<typename C, typename Pred>
+// requires Container<C>() && Binary_Predicate<Value_type<C>>()
+void sort(C& c, Pred p)
+{
+	std::sort(c.begin(), c.end(), p);
+}
+
+template<typename C, typename Val>
+	// requires Container<C>() && Equality_comparable<C,Val>()
+Iterator<C> find(C& c, Val v)
+{
+	return std::find(c.begin(), c.end(), v);
+}
+
+template<typename C, typename Pred>
+// requires Container<C>() && Predicate<Pred,Value_type<C>>()
+Iterator<C> find_if(C& c, Pred p)
+{
+	return std::find_if(c.begin(), c.end(), p);
+}
+
+#endif // STD_LIB_ALGORITHMS_H
@@ -0,0 +1,328 @@
+/*
+	std_lib_core.h
+
+	The part of std_lib_facilities.h that nearly every program uses: error()
+	and its exceptions, keep_window_open(), narrow_cast(), and to_string()
+	with the number formatting and parsing under it. It #includes only the
+	standard headers those need, not <regex>, <random>, and the rest that
+	std_lib_facilities.h offers.
+*/
+
+#ifndef STD_LIB_CORE_H
+#define STD_LIB_CORE_H
+
+#ifndef PPP_MODULE	// std_lib_facilities.cppm imports the standard headers itself
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#if __cplusplus>=201703L && defined(__has_include)
+#if __has_include(<charconv>)
+#include <charconv>
+#endif
+#endif
+#endif
+#if defined(__cpp_lib_to_chars)	// to_chars() and from_chars() for floating point, too
+#define PPP_CHARCONV 1
+#endif
+
+//------------------------------------------------------------------------------
+
+typedef long Unicode;
+
+//------------------------------------------------------------------------------
+
+#ifndef PPP_MODULE	// a module's using-directive stays in the module
+using namespace std;
+#endif
+
+// Numbers to characters and back without a stream, with to_chars() and
+// from_chars() where the library has them (C++17), snprintf() and strtod()
+// and friends otherwise. The characters are those of cout<<x and cin>>x:
+//	Chars_buffer b;	// reused from number to number: no allocation
+//	for (double x : v) os.write(b.format(x), b.size());
+//	if (!chars_to(first, last, x)) ...	// [first,last) isn't a number
+//	int i = string_to<int>(s);	// error() if s isn't an int
+
+// the characters of x, from first; returns their end (last is room enough)
+template<class T> typename enable_if<is_integral<T>::value, char*>::type
+format_chars(char* first, char* last, T x)
+{
+#ifdef PPP_CHARCONV
+	return to_chars(first, last, x).ptr;
+#else
+	int n = is_signed<T>::value ? snprintf(first, last-first, "%lld", (long long)x)
+		: snprintf(first, last-first, "%llu", (unsigned long long)x);
+	return first+n;
+#endif
+}
+
+template<class T> typename enable_if<is_floating_point<T>::value, char*>::type
+format_chars(char* first, char* last, T x)	// 6 significant digits, as an ostream's default
+{
+#ifdef PPP_CHARCONV
+	return to_chars(first, last, x, chars_format::general, 6).ptr;
+#else
+	return first+snprintf(first, last-first, "%.6Lg", (long double)x);
+#endif
+}
+
+class Chars_buffer {	// the characters of one number at a time
+public:
+	template<class T> const char* format(T x)	// valid until the next format()
+	{
+		char* end = format_chars(buf, buf+sizeof buf-1, x);
+		*end = 0;
+		n = int(end-buf);
+		return buf;
+	}
+	const char* data() const { return buf; }
+	int size() const { return n; }
+	string str() const { return string(buf, n); }
+private:
+	char buf[64];	// "-1.23457e+4931" or 20 digits and a sign, and a 0
+	int n = 0;
+};
+
+// x = the number that is all of [first,last), as >> reads it but with no
+// space before or after; false (and x unchanged) if there isn't one, or it
+// doesn't fit in a T
+template<class T> typename enable_if<is_arithmetic<T>::value && !is_same<T,bool>::value, bool>::type
+chars_to(const char* first, const char* last, T& x)
+{
+	if (last-first>1 && *first=='+' && first[1]!='-') ++first;	// from_chars() takes no +
+	if (first==last || *first=='+' || isspace((unsigned char)*first)) return false;
+#ifdef PPP_CHARCONV
+	T y;
+	from_chars_result r = from_chars(first, last, y);
+	if (r.ec!=errc() || r.ptr!=last) return false;
+	x = y;
+	return true;
+#else
+	if (is_unsigned<T>::value && *first=='-') return false;	// strtoull() would negate it
+	string s(first, last);	// strto*() need a terminating 0
+	char* end;
+	errno = 0;
+	if (is_floating_point<T>::value) {
+		long double v = strtold(s.c_str(), &end);
+		if (errno==ERANGE && (v==HUGE_VALL || v==-HUGE_VALL || T(v)==0)) return false;	// overflow or underflow
+		if (fabsl(v)!=HUGE_VALL && numeric_limits<T>::max()<fabsl(v)) return false;	// but inf is fine
+		x = T(v);
+	}
+	else if (is_signed<T>::value) {
+		long long v = strtoll(s.c_str(), &end, 10);
+		if (errno==ERANGE || (long long)T(v)!=v) return false;
+		x = T(v);
+	}
+	else {
+		unsigned long long v = strtoull(s.c_str(), &end, 10);
+		if (errno==ERANGE || (unsigned long long)T(v)!=v) return false;
+		x = T(v);
+	}
+	return end==s.c_str()+s.size();
+#endif
+}
+
+template<class T> struct Formats_as_number	// what format_chars() writes as << would
+	: integral_constant<bool, is_floating_point<T>::value
+		|| (is_integral<T>::value && !is_same<T,bool>::value && 1<sizeof(T))> { };	// chars << as characters
+
+template<class T> string to_string(const T& t, true_type)
+{
+	Chars_buffer b;
+	b.format(t);
+	return b.str();
+}
+
+template<class T> string to_string(const T& t, false_type)
+{
+	ostringstream os;
+	os << t;
+	return os.str();
+}
+
+template<class T> string to_string(const T& t)	// numbers without a stream; the rest as << writes them
+{
+	return to_string(t, Formats_as_number<T>());
+}
+
+// the decimal digits of u, written backwards ending at last; returns where they begin
+inline char* unsigned_digits(char* last, unsigned long long u)
+{
+	do *--last = char('0'+u%10); while (u /= 10);
+	return last;
+}
+
+// the same for i, with its sign
+inline char* int_digits(char* last, int i)
+{
+	last = unsigned_digits(last, i<0 ? 0u-unsigned(i) : unsigned(i));
+	if (i<0) *--last = '-';
+	return last;
+}
+
+struct Exit : runtime_error {
+	Exit(): runtime_error("Exit") {}
+};
+
+// a string literal for error() that is kept by pointer rather than copied:
+// error(literal("divide by zero")). Only for literals, which outlive any
+// Error; a char array on the stack is gone once the throw has unwound it
+struct Literal {
+	const char* p;
+};
+
+template<size_t N> Literal literal(const char (&x)[N]) { return Literal{x}; }
+
+struct Error_part {	// a piece of an Error's message, as given to error()
+	enum Kind { none, literal, text, number };
+	Kind kind;
+	const char* p;	// literal: not copied
+	string s;	// text: a copy, which allocates only past the small string size
+	int n;	// number
+
+	Error_part() :kind(none), p(""), n(0) { }
+	Error_part(Literal x) :kind(literal), p(x.p), n(0) { }
+	// any other char array or char* may be in something the throw destroys, so it is copied
+	template<class P, class = typename enable_if<is_same<P,const char*>::value || is_same<P,char*>::value>::type>
+	Error_part(P x) :kind(text), p(""), s(x), n(0) { }
+	Error_part(const string& x) :kind(text), p(""), s(x), n(0) { }
+	Error_part(int x) :kind(number), p(""), n(x) { }
+
+	void append_to(string& m) const
+	{
+		char digits[12];
+		switch (kind) {
+		case none:	break;
+		case literal:	m += p; break;
+		case text:	m += s; break;
+		case number:	m.append(int_digits(digits+sizeof digits, n), digits+sizeof digits); break;
+		}
+	}
+};
+
+// what error() throws: a runtime_error that keeps its message in parts and
+// puts them together when what() is first called, so that code that throws
+// and catches without looking (e.g. to try the next thing) never pays for it.
+// what() may be called from several threads at once (an exception_ptr lets
+// them all catch the same Error), so the message is published through an
+// atomic pointer: racing callers each build it, and all but the first throw
+// theirs away
+struct Error : runtime_error {
+	Error(const Error_part& s, const Error_part& s2 = Error_part())
+		:runtime_error(""), first(s), second(s2) { }
+	Error(const Error& e) :runtime_error(e), first(e.first), second(e.second) { }	// formats its own message
+	Error& operator=(const Error&) = delete;
+	~Error() { delete[] message.load(); }
+
+	const char* what() const noexcept override
+	{
+		if (second.kind==Error_part::none) {	// one part: it is the message
+			if (first.kind==Error_part::literal) return first.p;
+			if (first.kind==Error_part::text) return first.s.c_str();
+		}
+		if (const char* m = message.load(memory_order_acquire)) return m;
+
+		string m;
+		try {
+			first.append_to(m);
+			if (second.kind==Error_part::number) m += ": ";	// as error(s,i) always wrote it
+			second.append_to(m);
+		}
+		catch (...) { }	// out of memory: as much as we have
+		char* mine = new(nothrow) char[m.size()+1];
+		if (!mine) return "error (no memory for its message)";
+		mine[m.copy(mine, m.size())] = 0;
+		char* earlier = nullptr;
+		if (message.compare_exchange_strong(earlier, mine, memory_order_acq_rel)) return mine;
+		delete[] mine;	// another thread got there first
+		return earlier;
+	}
+private:
+	Error_part first;
+	Error_part second;
+	mutable atomic<char*> message {nullptr};
+};
+
+// error() simply disguises throws:
+[[noreturn]] inline void error(const Error_part& s)
+{
+	throw Error(s);
+}
+
+[[noreturn]] inline void error(const Error_part& s, const Error_part& s2)	// s+s2, or s+": "+s2 for an int s2
+{
+	throw Error(s, s2);
+}
+
+template<class T> T string_to(const string& s)	// the T that is all of s
+{
+	T x;
+	if (!chars_to(s.data(), s.data()+s.size(), x)) error("not a number of the type expected: ", s);
+	return x;
+}
+
+
+template<class T> char* as_bytes(T& i)	// needed for binary I/O
+{
+	void* addr = &i;	// get the address of the first byte
+						// of memory used to store the object
+	return static_cast<char*>(addr); // treat that memory as bytes
+}
+
+
+inline void keep_window_open()
+{
+	cin.clear();
+	cout << "Please enter a character to exit\n";
+	char ch;
+	cin >> ch;
+	return;
+}
+
+inline void keep_window_open(string s)
+{
+	if (s=="") return;
+	cin.clear();
+	cin.ignore(120,'\n');
+	for (;;) {
+		cout << "Please enter " << s << " to exit\n";
+		string ss;
+		while (cin >> ss && ss!=s)
+			cout << "Please enter " << s << " to exit\n";
+		return;
+	}
+}
+
+
+
+// error function to be used (only) until error() is introduced in Chapter 5:
+inline void simple_error(string s)	// write ``error: s and exit program
+{
+	cerr << "error: " << s << '\n';
+	keep_window_open();		// for some Windows environments
+	exit(1);
+}
+
+// make std::min() and std::max() accessible on systems with antisocial macros:
+#undef min
+#undef max
+
+
+// run-time checked narrowing cast (type conversion). See ???.
+template<class R, class A> R narrow_cast(const A& a)
+{
+	R r = R(a);
+	if (A(r)!=a) error(string("info loss"));
+	return r;
+}
+
+#endif // STD_LIB_CORE_H
@@ -0,0 +1,44 @@
+/*
+	std_lib_facilities.cppm
+
+	std_lib_facilities.h as a C++20 module: the standard headers it offers
+	are compiled once, as a header unit, and so are the facilities, so a
+	program that imports them doesn't parse <iostream>, <regex>, and the
+	rest again. The facilities are those of the std_lib_*.h parts; their
+	#includes, their using-directive, and the vector macro, which a module
+	can't export, are left to std_lib_facilities.h.
+
+	To build it with GCC (13 or later), in the directory of the program:
+		g++ -std=c++20 -fmodules-ts -x c++-header ../std_lib_facilities/std_lib_standard.h
+		g++ -std=c++20 -fmodules-ts -c -x c++ ../std_lib_facilities/std_lib_facilities.cppm
+	and then compile the program with PPP_IMPORT_MODULE #defined, so that
+	its #include "std_lib_facilities.h" imports the module:
+		g++ -std=c++20 -fmodules-ts -DPPP_IMPORT_MODULE -o hello_world hello_world.cpp std_lib_facilities.o
+	(The compiled interfaces go into gcm.cache/.) Vector and String
+	subscripts are checked as PPP_SUBSCRIPT_CHECK was when the module was
+	compiled.
+
+	GCC 12's modules are experimental: it crashes compiling
+	197_calculator_by_grammar with -O2 and miscompiles it without. So with
+	GCC 12, neither this file nor PPP_IMPORT_MODULE compiles; #include the
+	header or its parts instead.
+*/
+
+export module std_lib_facilities;
+
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ < 13
+#error "the std_lib_facilities module needs GCC 13 or later: GCC 12 miscompiles programs that import it"
+#endif
+
+export import "std_lib_standard.h";
+
+#define PPP_MODULE	// the parts leave their #includes and macros to us
+
+using namespace std;
+
+export {
+#include "std_lib_core.h"
+#include "std_lib_vector.h"
+#include "std_lib_random.h"
+#include "std_lib_algorithms.h"
+}
@@ -0,0 +1,47 @@
+/*
+   std_lib_facilities.h
+*/
+
+/*
+	simple "Programming: Principles and Practice using C++ (second edition)" course header to
+	be used for the first few weeks.
+	It provides the most common standard headers (in the global namespace)
+	and minimal exception/error support.
+	Students: please don't try to understand the details of headers just yet.
+	All will be explained. This header is primarily used so that you don't have
+	to understand every concept all at once.
+	By Chapter 10, you don't need this file and after Chapter 21, you'll understand it
+	Revised April 25, 2010: simple_error() added
+	
+	Revised November 25 2013: remove support for pre-C++11 compilers, use C++11: <chrono>
+	Revised November 28 2013: add a few container algorithms
+	Revised June 8 2014: added #ifndef to workaround Microsoft C++11 weakness
+	Revised October 19 2026: choice of subscript checking (PPP_SUBSCRIPT_CHECK) and checked_span()
+	Revised October 19 2026: Error, whose message is formatted only when what() asks for it
+	Revised October 19 2026: Chars_buffer, chars_to(), and string_to(): numbers without streams
+	Revised October 19 2026: one copy for all the programs, in parts (std_lib_core.h,
+		std_lib_vector.h, std_lib_random.h, std_lib_algorithms.h) and as a module
+		(std_lib_facilities.cppm); a program may #include just the parts it uses
+*/
+
+#ifndef H112
+#define H112 251113L
+
+#ifdef PPP_IMPORT_MODULE	// compiled as std_lib_facilities.cppm explains
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ < 13
+#error "PPP_IMPORT_MODULE needs GCC 13 or later: GCC 12 miscompiles programs that import std_lib_facilities"
+#endif
+import std_lib_facilities;
+using namespace std;
+#define vector Vector	// a module can't export a macro
+#else
+
+#include "std_lib_standard.h"
+#include "std_lib_core.h"
+#include "std_lib_vector.h"
+#include "std_lib_random.h"
+#include "std_lib_algorithms.h"
+
+#endif
+
+#endif //H112
@@ -0,0 +1,25 @@
+/*
+	std_lib_random.h
+
+	randint(), for the exercises that need random numbers.
+*/
+
+#ifndef STD_LIB_RANDOM_H
+#define STD_LIB_RANDOM_H
+
+#ifndef PPP_MODULE
+#include <random>
+#endif
+#include "std_lib_core.h"
+
+// random number generators. See 24.7.
+
+
+
+inline int randint(int min, int max) { static default_random_engine ran; return uniform_int_distribution<>{min, max}(ran); }
+
+inline int randint(int max) { return randint(0, max); }
+
+//inline double sqrt(int x) { return sqrt(double(x)); }	// to match C++0x
+
+#endif // STD_LIB_RANDOM_H
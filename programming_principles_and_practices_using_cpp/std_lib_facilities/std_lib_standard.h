@@ -0,0 +1,40 @@
+/*
+	std_lib_standard.h
+
+	The standard headers std_lib_facilities.h offers, and those its parts
+	use. std_lib_facilities.cppm imports them as one header unit: GCC 12
+	can't compile a module that imports twenty-odd of them one by one.
+*/
+
+#ifndef STD_LIB_STANDARD_H
+#define STD_LIB_STANDARD_H
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <forward_list>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <list>
+#include <random>
+#include <regex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+#if __cplusplus>=201703L && defined(__has_include)
+#if __has_include(<charconv>)
+#include <charconv>
+#endif
+#endif
+
+#endif // STD_LIB_STANDARD_H
@@ -0,0 +1,181 @@
+/*
+	std_lib_vector.h
+
+	Vector and String, std::vector and std::string with range-checked
+	subscripts, and the disgusting macro that makes every vector a Vector.
+*/
+
+#ifndef STD_LIB_VECTOR_H
+#define STD_LIB_VECTOR_H
+
+#ifndef PPP_MODULE
+#include <string>
+#include <vector>
+#endif
+#include "std_lib_core.h"
+
+struct Range_error : out_of_range {	// enhanced vector range error reporting
+	int index;	// the bad subscript; for a bad range, where it starts (-1 if that isn't an int)
+	Range_error(int i) :out_of_range(""), index(i)	// formatted here, without allocating
+	{
+		char digits[12];
+		char* p = append(message, "Range error: ");
+		p = append(p, int_digits(digits+sizeof digits, i), digits+sizeof digits);
+		*p = 0;
+	}
+	Range_error(size_t first, size_t count, size_t size)	// [first,first+count) isn't in [0,size)
+		:out_of_range(""), index(first<=size_t(numeric_limits<int>::max()) ? int(first) : -1)
+	{
+		char digits[20];
+		char* end = digits+sizeof digits;
+		char* p = append(message, "Range error: ");
+		p = append(p, unsigned_digits(end, count), end);
+		p = append(p, " elements from ");
+		p = append(p, unsigned_digits(end, first), end);
+		p = append(p, " of ");
+		p = append(p, unsigned_digits(end, size), end);
+		*p = 0;
+	}
+
+	const char* what() const noexcept override { return message; }	// "Range error: i"
+private:
+	char message[sizeof "Range error: 18446744073709551615 elements from 18446744073709551615 of 18446744073709551615"];
+
+	static char* append(char* p, const char* s) { while (*s) *p++ = *s++; return p; }
+	static char* append(char* p, const char* s, const char* end) { while (s<end) *p++ = *s++; return p; }
+};
+
+// Vector and String subscripts are checked as chosen by #defining
+// PPP_SUBSCRIPT_CHECK before #including this header:
+//	2 (the default): always
+//	1: in debug builds only (unless NDEBUG is #defined)
+//	0: never
+// A check in a loop keeps the compiler from vectorizing it; checked_span()
+// checks a whole range once instead, in every mode.
+#ifndef PPP_SUBSCRIPT_CHECK
+#define PPP_SUBSCRIPT_CHECK 2
+#endif
+#if PPP_SUBSCRIPT_CHECK==2 || (PPP_SUBSCRIPT_CHECK==1 && !defined(NDEBUG))
+#define PPP_CHECKED_SUBSCRIPTS 1
+#else
+#define PPP_CHECKED_SUBSCRIPTS 0
+#endif
+
+// out of line, so that a checked subscript is just a compare and a branch:
+#if defined(__GNUC__)
+__attribute__((noinline, cold))
+#endif
+[[noreturn]] inline void throw_range_error(int i)
+{
+	throw Range_error(i);
+}
+
+#if defined(__GNUC__)
+__attribute__((noinline, cold))
+#endif
+[[noreturn]] inline void throw_range_error(size_t first, size_t count, size_t size)
+{
+	throw Range_error(first, count, size);
+}
+
+
+// trivially range-checked vector (no iterator checking):
+template< class T> struct Vector : public std::vector<T> {
+	using size_type = typename std::vector<T>::size_type;
+
+#ifdef _MSC_VER
+	// microsoft doesn't yet support C++11 inheriting constructors
+	Vector() { }
+	explicit Vector(size_type n) :std::vector<T>(n) {}
+	Vector(size_type n, const T& v) :std::vector<T>(n,v) {}
+	template <class I>
+	Vector(I first, I last) : std::vector<T>(first, last) {}
+	Vector(initializer_list<T> list) : std::vector<T>(list) {}
+#else
+	using std::vector<T>::vector;	// inheriting constructor
+#endif
+
+	T& operator[](unsigned int i) // rather than return at(i);
+	{
+#if PPP_CHECKED_SUBSCRIPTS
+		if (this->size()<=i) throw_range_error(i);
+#endif
+		return std::vector<T>::operator[](i);
+	}
+	const T& operator[](unsigned int i) const
+	{
+#if PPP_CHECKED_SUBSCRIPTS
+		if (this->size()<=i) throw_range_error(i);
+#endif
+		return std::vector<T>::operator[](i);
+	}
+};
+
+// disgusting macro hack to get a range checked vector:
+#ifndef PPP_MODULE	// a module can't export a macro: see std_lib_facilities.h
+#define vector Vector
+#endif
+
+// trivially range-checked string (no iterator checking):
+struct String : std::string {
+	using size_type = std::string::size_type;
+//	using string::string;
+
+	char& operator[](unsigned int i) // rather than return at(i);
+	{
+#if PPP_CHECKED_SUBSCRIPTS
+		if (size()<=i) throw_range_error(i);
+#endif
+		return std::string::operator[](i);
+	}
+
+	const char& operator[](unsigned int i) const
+	{
+#if PPP_CHECKED_SUBSCRIPTS
+		if (size()<=i) throw_range_error(i);
+#endif
+		return std::string::operator[](i);
+	}
+};
+
+// count elements from first of a Vector, String, or other contiguous container,
+// checked once when the Checked_span is made and then subscripted without checks:
+//	Checked_span<double> s = checked_span(v);
+//	for (size_t i = 0; i<s.size(); ++i) sum += s[i];	// i<s.size() is the check
+template<class T> struct Checked_span {
+	T* first;
+	size_t n;
+
+	T& operator[](size_t i) const { return first[i]; }
+	size_t size() const { return n; }
+	T* begin() const { return first; }
+	T* end() const { return first+n; }
+};
+
+template<class C>
+auto checked_span(C& c, size_t first, size_t count) -> Checked_span<typename remove_pointer<decltype(c.data())>::type>
+{
+	if (c.size()<first || c.size()-first<count) throw_range_error(first, count, c.size());
+	return { c.data()+first, count };
+}
+
+template<class C>
+auto checked_span(C& c) -> Checked_span<typename remove_pointer<decltype(c.data())>::type>
+{
+	return { c.data(), c.size() };
+}
+
+
+namespace std {
+
+    template<> struct hash<String>
+    {
+        size_t operator()(const String& s) const
+        {
+            return hash<std::string>()(s);
+        }
+    };
+
+} // of namespace std
+
+#endif // STD_LIB_VECTOR_H